@@ -46,23 +46,63 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/socket.h>
 #include <string.h>
 #include <time.h>
 #include <mysql.h>
 #include <signal.h>
 #include <limits.h>
+#include <sched.h>
+#include <poll.h>
 #include <optionutil.h>
 #ifdef HAVE_SYS_UTSNAME_H
 #include <sys/utsname.h>
 #endif
 
+// The SIMD JSON escape kernels are built on x86 with GCC or Clang, which can
+// compile each kernel for its own instruction set.
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define JSON_SIMD_X86
+#include <immintrin.h>
+#endif
+
+// Non-blocking client API, if the client library has one.
+#if defined(MYSQL_WAIT_READ)
+#define ASYNC_MARIADB
+#elif !defined(MARIADB_BASE_VERSION) && defined(MYSQL_VERSION_ID) \
+  && MYSQL_VERSION_ID >= 80016
+#define ASYNC_MYSQL
+#endif
+
+// The JSON type is in the client headers from MySQL 5.7.8.
+#if !defined(MARIADB_BASE_VERSION) && defined(MYSQL_VERSION_ID) \
+  && MYSQL_VERSION_ID >= 50708 && MYSQL_VERSION_ID < 100000
+#define HAVE_MYSQL_TYPE_JSON
+#endif
+
+// The flags of prepared statement binds are bool from MySQL 8.0.
+#if !defined(MARIADB_BASE_VERSION) && defined(MYSQL_VERSION_ID) \
+  && MYSQL_VERSION_ID >= 80001 && MYSQL_VERSION_ID < 100000
+typedef bool STMTBOOL;
+#else
+typedef my_bool STMTBOOL;
+#endif
+
 // Settings.
+BOOL g_bAdaptive;
 BOOL g_bAutoBatch;
+BOOL g_bBinary;
 BOOL g_bArrayFile;
 BOOL g_bDryRun;
 BOOL g_bSkipEmpty;
 BOOL g_bSkipNull;
 BOOL g_bParallel;
+BOOL g_bPipeline;
+BOOL g_bPrefetch;
+BOOL g_bSplitFiles;
+BOOL g_bSplitHash;
+BOOL g_bSteal;
+unsigned int g_nStealThreads;
 BOOL g_bSQLNoCache;
 BOOL g_bStopOnError;
 BOOL g_bStopOnInitError;
@@ -71,10 +111,26 @@ BOOL g_bTiming;
 BOOL g_bTiny1AsBool;
 BOOL g_bUTF8;
 BOOL g_bVersion;
+unsigned int g_nAsync;
+unsigned int g_nGuardInterval;
+unsigned int g_nJSONKernel;
 unsigned int g_nLoglevel;
+unsigned int g_nMaxReplicaLag;
+unsigned int g_nMaxThreadsRunning;
 unsigned int g_nPort;
+unsigned int g_nSchedule;
+unsigned int g_nSnapshot;
+unsigned int g_nSplit;
+unsigned int g_nSplitPlan;
 unsigned int g_nStats;
+unsigned int g_nThreads;
+unsigned int g_nUnicode;
+unsigned long g_lBatchMax;
+unsigned long g_lBatchMB;
+unsigned long g_lBatchMin;
 unsigned long g_lBatchSize;
+unsigned long g_lBatchTime;
+unsigned long g_lCursorFetch;
 unsigned long g_lLimit;
 char **g_pConfigFile;
 char **g_pSkipCol;
@@ -130,6 +186,74 @@ volatile BOOL g_bStop;
 #define LOG_LEVEL(X) ((X) & 0x0000000F)
 #define LOG_FLAG_CHECK(X,Y) (((X) & LOG_FLAG_ ## Y) == LOG_FLAG_ ## Y)
 
+// Table scheduling.
+#define SCHEDULE_ORDERED 0x0000
+#define SCHEDULE_LARGEST 0x0001
+
+// How the key ranges of a split table are planned.
+#define SPLIT_PLAN_RANGE 0x0000
+#define SPLIT_PLAN_SAMPLE 0x0001
+
+// Consistent snapshot locking.
+#define SNAPSHOT_NONE 0x0000
+#define SNAPSHOT_FLUSH 0x0001
+#define SNAPSHOT_BACKUP 0x0002
+
+// How non-ASCII characters are exported.
+#define UNICODE_BYTES 0x0000
+#define UNICODE_PASS 0x0001
+#define UNICODE_ESCAPE 0x0002
+
+// The JSON escape kernels, as forced by --json-kernel.
+#define JSON_KERNEL_AUTO 0x0000
+#define JSON_KERNEL_SCALAR 0x0001
+#define JSON_KERNEL_SSE2 0x0002
+#define JSON_KERNEL_AVX2 0x0003
+#define JSON_KERNEL_AVX512 0x0004
+
+// Event loop connection states.
+#define ASYNC_STATE_IDLE 0x0000
+#define ASYNC_STATE_QUERY 0x0001
+#define ASYNC_STATE_RESULT 0x0002
+#define ASYNC_STATE_DONE 0x0003
+
+// Adaptive concurrency. The throughput has to rise by this many percent for
+// more workers to be allowed, and a batch latency this many times the lowest
+// one makes the controller back off.
+#define ADAPT_INTERVAL 1000
+#define ADAPT_GAIN 5
+#define ADAPT_LATENCY_JUMP 2
+#define ADAPT_NONE 0x0000
+#define ADAPT_UP 0x0001
+#define ADAPT_DOWN 0x0002
+
+// The load guard stops the export after this many failed checks in a row.
+#define GUARD_ERRORS_MAX 5
+
+// Pipeline sizes. The ring size must be a power of 2.
+#define PIPE_RING_SIZE 32
+#define PIPE_CHUNK_SIZE 65536
+
+// Used chunks and blocks are sent back to be reused, unless their buffer has
+// grown beyond this, for a large row.
+#define PIPE_BLOCK_KEEP (8 * PIPE_CHUNK_SIZE)
+
+// A pipeline stage that waits for a ring spins this many times, and then
+// sleeps until woken, checking for a stop this often (in ms).
+#define PIPE_SPIN_MAX 100
+#define PIPE_WAIT_MS 10
+
+// Rows are formatted into a buffer, which is written when it reaches this
+// size.
+#define ROWBUF_FLUSH_SIZE 65536
+
+// Row emission ops, compiled from the column flags of a table.
+#define EMIT_OP_CONST 0x0001
+#define EMIT_OP_COUNTER 0x0002
+#define EMIT_OP_BOOL 0x0003
+#define EMIT_OP_RAW 0x0004
+#define EMIT_OP_VALUE 0x0005
+
 // Statistics levels.
 #define STATS_NONE 0x0000
 #define STATS_NORMAL 0x0001
@@ -149,6 +273,9 @@ volatile BOOL g_bStop;
 #define JSONCOL_FLAG_BATCH 0x00000200
 #define JSONCOL_FLAG_SKIP 0x00000400
 #define JSONCOL_FLAG_PK 0x00000800
+#define JSONCOL_FLAG_NOESCAPE 0x00001000
+#define JSONCOL_FLAG_JSON (0x00002000 | JSONCOL_FLAG_NOESCAPE)
+#define JSONCOL_FLAG_UKEY 0x00004000
 #define JSONCOL_FLAG_LAST 0x10000000
 #define JSONCOL_FLAG_FIXEDNULL (JSONCOL_FLAG_FIXED | JSONCOL_FLAG_NULL)
 #define JSONCOL_FLAG_FIXEDNUMERIC (JSONCOL_FLAG_FIXED | JSONCOL_FLAG_NUMERIC)
@@ -157,14 +284,39 @@ volatile BOOL g_bStop;
 typedef struct tagJSONCOL {
   char *pName;
   char *pJSONName;
+  char *pJSONKey;
+  unsigned int nJSONKeyLen;
   char *pValue;
   char *pPrevValue;
+  unsigned int nPrevValueSize;
   unsigned long lValue;
   unsigned long lIncr;
   unsigned int nFlags;
+  unsigned int nKeySeq;
   int nMySQLCol;
   } JSONCOL, *PJSONCOL;
 
+// An op of the emission plan of a table, emitting one column of a row.
+typedef struct tagEMITOP {
+  unsigned int nOp;
+  BOOL bQuote;
+  int nMySQLCol;
+  PJSONCOL pCol;
+  char *pConst;
+  unsigned int nConstLen;
+  } EMITOP, *PEMITOP;
+
+typedef struct tagPIPESTATS {
+  unsigned long long llPuts;
+  unsigned long long llDepth;
+  unsigned long long llFull;
+  unsigned long long llEmpty;
+  unsigned int nMaxDepth;
+  } PIPESTATS, *PPIPESTATS;
+
+// The most columns that a table may be batched on, as in a MySQL index.
+#define KEY_COLS_MAX 16
+
 typedef struct tagJSONTABLE {
   FILE *fd;
   time_t tStop;
@@ -174,21 +326,217 @@ typedef struct tagJSONTABLE {
   unsigned int nCols;
   PJSONCOL pCols;
   PJSONCOL pBatchCol;
+  PJSONCOL pKeyCols[KEY_COLS_MAX];
+  unsigned int nKeyCols;
+  char *pKeyIndex;
+  char *pHashExpr;
+  PEMITOP pOps;
+  unsigned int nOps;
   char *pSQLFormat;
   char *pSQL;
   unsigned int nSQLBufLen;
   unsigned long lBatchSize;
+  unsigned long lSizeMin;
+  unsigned long lSizeMax;
   unsigned long lBatch;
   unsigned long lRows;
+  char *pRangeEnd;
+  unsigned long long llDataLength;
+  unsigned long long llEstRows;
+  BOOL bIntRange;
+  long long llKeyMin;
+  long long llKeyMax;
+  pthread_mutex_t mtxRange;
+  PIPESTATS statRows;
+  PIPESTATS statOut;
+  unsigned long long llFormatBytes;
+  unsigned long long llFormatUsecs;
+  struct tagJSONTABLE *pParent;
+  struct tagJSONTABLE **pParts;
+  unsigned int nParts;
+  unsigned int nPartsLeft;
+  unsigned int nPart;
   } JSONTABLE, *PJSONTABLE;
 
 typedef struct tagTHREADDATA {
   pthread_t thr;
   MYSQL *pMySQL;
+  MYSQL *pMySQLPrefetch;
   PJSONTABLE pTable;
+  PJSONTABLE *pQueue;
+  unsigned int nQueueHead;
+  unsigned int nQueueTail;
+  unsigned long long llQueueCost;
+  pthread_mutex_t mtxQueue;
+  unsigned int nId;
+  unsigned int nTables;
+  unsigned int nSteals;
   unsigned int nRet;
+  BOOL bStarted;
   } THREADDATA, *PTHREADDATA;
 
+// A single producer / single consumer ring, connecting two pipeline stages.
+// A stage that is done spinning sets bWaiting and sleeps on the condition,
+// and the other stage wakes it after the next get or put.
+typedef struct tagPIPERING {
+  void *pItems[PIPE_RING_SIZE];
+  unsigned int nHead;
+  unsigned int nTail;
+  BOOL bWaiting;
+  pthread_mutex_t mtx;
+  pthread_cond_t cond;
+  PIPESTATS stats;
+  } PIPERING, *PPIPERING;
+
+// A chunk of rows fetched from MySQL, copied to a buffer of its own.
+typedef struct tagROWCHUNK {
+  char **pRows;
+  unsigned long *pLengths;
+  unsigned int nRows;
+  unsigned int nRowsAlloc;
+  char *pData;
+  unsigned long lData;
+  unsigned long lDataAlloc;
+  } ROWCHUNK, *PROWCHUNK;
+
+// A block of formatted JSON, ready to be written.
+typedef struct tagOUTBLOCK {
+  char *pData;
+  size_t nLen;
+  size_t nSize;
+  } OUTBLOCK, *POUTBLOCK;
+
+// A buffer that rows are formatted into. A buffer with a flush function may
+// be flushed in the middle of a row, when a large value is formatted.
+typedef struct tagROWBUF {
+  char *pData;
+  size_t nLen;
+  size_t nSize;
+  BOOL (*pFlush)(struct tagROWBUF *pBuf, void *pData);
+  void *pFlushData;
+  } ROWBUF, *PROWBUF;
+
+// The pipeline of a table export. The exporting thread fetches the rows,
+// one thread formats them and one writes them to the file. Chunks and blocks
+// that are done with go back the other way on the free rings, so that the
+// buffers are reused for the whole table.
+typedef struct tagEXPORTPIPE {
+  PJSONTABLE pTable;
+  unsigned int nFields;
+  PROWCHUNK pChunk;
+  PIPERING ringRows;
+  PIPERING ringOut;
+  PIPERING ringFreeRows;
+  PIPERING ringFreeOut;
+  pthread_t thrFormat;
+  pthread_t thrWrite;
+  unsigned long long llFormatBytes;
+  unsigned long long llFormatUsecs;
+  volatile BOOL bError;
+  } EXPORTPIPE, *PEXPORTPIPE;
+
+// The state of a table export between batches.
+typedef struct tagEXPORTSTATE {
+  PJSONTABLE pTable;
+  BOOL bStitched;
+  BOOL bShared;
+  BOOL bPipeline;
+  BOOL bPeek;
+  BOOL bPrefetch;
+  unsigned long lBatchLimit;
+  unsigned long long llBatchStart;
+  unsigned long long llBatchBytes;
+  unsigned long long llFormatStart;
+  long long llEnd;
+  ROWBUF buf;
+  EXPORTPIPE pipe;
+  MYSQL *pMySQL;
+  MYSQL *pMySQLNext;
+  MYSQL_RES *pPrefetchRes;
+  pthread_t thrPrefetch;
+  } EXPORTSTATE, *PEXPORTSTATE;
+
+// Prepared statement exports. A statement is prepared for each combination
+// of batch conditions, as a split may give the range of a part an end.
+#define STMT_SHAPES 4
+#define STMT_VALUE_SIZE 256
+#define STMT_TEXT_SIZE 64
+#define STMT_DOUBLE_SIZE 330
+
+// A value fetched with the binary protocol.
+typedef union tagSTMTVALUE {
+  long long llValue;
+  MYSQL_TIME tmValue;
+  } STMTVALUE, *PSTMTVALUE;
+
+// The prepared statements of a table export and the buffers that rows are
+// fetched into. The values of a row are formatted as text into pValues.
+typedef struct tagSTMTEXPORT {
+  BOOL bCursor;
+  MYSQL_STMT *pStmts[STMT_SHAPES];
+  MYSQL_STMT *pStmt;
+  MYSQL_RES *pMeta;
+  MYSQL_BIND bindParams[KEY_COLS_MAX + 2];
+  long long llKeys[KEY_COLS_MAX + 1];
+  unsigned long lKeyLens[KEY_COLS_MAX + 1];
+  unsigned long long llLimit;
+  unsigned int nFields;
+  MYSQL_BIND *pBinds;
+  PSTMTVALUE pNative;
+  unsigned long *pLengths;
+  STMTBOOL *pNulls;
+  STMTBOOL *pErrors;
+  char **pValues;
+  unsigned long *pValueLens;
+  char *pText;
+  } STMTEXPORT, *PSTMTEXPORT;
+
+// A connection driven by the non-blocking event loop.
+typedef struct tagASYNCCONN {
+  PTHREADDATA pThr;
+  unsigned int nState;
+  int nWait;
+  int nTimeout;
+  MYSQL_RES *pRes;
+  EXPORTSTATE state;
+  } ASYNCCONN, *PASYNCCONN;
+
+// The export threads. The schedule mutex protects the table each thread is
+// exporting and the parts of split tables.
+PTHREADDATA g_pWorkers = NULL;
+unsigned int g_nWorkers = 0;
+pthread_mutex_t g_mtxSchedule = PTHREAD_MUTEX_INITIALIZER;
+
+// The adaptive concurrency controller. Threads wait for a slot before each
+// batch, and the controller sets the number of slots from the rows and the
+// batch latency it sees.
+BOOL g_bAdapting = FALSE;
+volatile BOOL g_bAdaptStop = FALSE;
+unsigned int g_nAdaptLimit = 0;
+unsigned int g_nAdaptRunning = 0;
+unsigned int g_nAdaptStart = 0;
+unsigned int g_nAdaptPeak = 0;
+unsigned long long g_llAdaptRows = 0;
+unsigned long long g_llAdaptUsecs = 0;
+unsigned long g_lAdaptBatches = 0;
+pthread_mutex_t g_mtxAdapt = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t g_condAdapt = PTHREAD_COND_INITIALIZER;
+
+// Batch sizing. With a time or data target per batch, the size of the next
+// batch of a table is set from how long the last one took and how much data
+// it had.
+BOOL g_bSizing = FALSE;
+
+// The load guard, which pauses new batches while the server is too busy or
+// the replica is lagging too far behind.
+BOOL g_bGuarding = FALSE;
+volatile BOOL g_bGuardStop = FALSE;
+volatile BOOL g_bGuardPause = FALSE;
+unsigned long long g_llGuardUsecs = 0;
+unsigned long g_lGuardPauses = 0;
+pthread_mutex_t g_mtxGuard = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t g_condGuard = PTHREAD_COND_INITIALIZER;
+
 // Configuration options.
 OPTIONS Options[] = {
 { NULL, OPT_TYPE_CFGFILEMAIN | OPT_FLAG_CFGFILEARRAY
@@ -196,14 +544,32 @@ OPTIONS Options[] = {
   &g_pConfigFile, (void *) g_pDefCfgFiles, NULL, (void *) "client" },
 { "array-file", OPT_TYPE_BOOL, (void *) &g_bArrayFile, (void *) FALSE,
   "Export rows in a top-level array", NULL },
+{ "adaptive", OPT_TYPE_BOOL, (void *) &g_bAdaptive, (void *) FALSE,
+  "Adjust the number of threads running batches to the throughput, with --threads as the max",
+  NULL },
+{ "async", OPT_TYPE_UINT, (void *) &g_nAsync, (void *) 0,
+  "Export using this many connections, all driven from one thread with the non-blocking client API",
+  NULL },
 { "auto-batch", OPT_TYPE_BOOL | OPT_FLAG_HIDDEN, (void *) &g_bAutoBatch,
   (void *) TRUE, "Automatically figure out the batching options", NULL },
 { "skip-auto-batch", OPT_TYPE_BOOLREVERSE, (void *) &g_bAutoBatch,
   (void *) FALSE, "Do not automatically check for batch columns", NULL },
 { "batch-col", OPT_TYPE_STR, (void *) &g_pBatchCol, (void *) NULL,
   "Column to batch on", NULL },
+{ "batch-max", OPT_TYPE_ULONG, (void *) &g_lBatchMax, (void *) 1000000,
+  "Max number of rows per batch when the batch size is adjusted", NULL },
+{ "batch-mb", OPT_TYPE_ULONG, (void *) &g_lBatchMB, (void *) 0,
+  "Adjust the batch size of each table to get about this many MB of data per batch",
+  NULL },
+{ "batch-min", OPT_TYPE_ULONG, (void *) &g_lBatchMin, (void *) 100,
+  "Min number of rows per batch when the batch size is adjusted", NULL },
 { "batch-size", OPT_TYPE_ULONG, (void *) &g_lBatchSize, (void *) 0,
   "Number of fetched rows per batch", NULL },
+{ "batch-time", OPT_TYPE_ULONG, (void *) &g_lBatchTime, (void *) 0,
+  "Adjust the batch size of each table to make a batch take about this many milliseconds",
+  NULL },
+{ "binary", OPT_TYPE_BOOL, (void *) &g_bBinary, (void *) FALSE,
+  "Export tables with prepared statements, using the binary protocol", NULL },
 { "skip-col", OPT_TYPE_STRARRAY, (void *) &g_pSkipCol, NULL,
   "Do not export the specified column", NULL },
 { "col-incr", OPT_TYPE_KEYVALUELIST, &g_pColIncr, (void *) NULL,
@@ -217,6 +583,9 @@ OPTIONS Options[] = {
   "Always quote this column in the output", NULL },
 { "col-unquoted", OPT_TYPE_STRARRAY, (void *) &g_pColUnquoted, (void *) FALSE,
   "Never quote this column in the output", NULL },
+{ "cursor-fetch", OPT_TYPE_ULONG, (void *) &g_lCursorFetch, (void *) 0,
+  "Stream each table through a read-only server side cursor, fetching this many rows at the time. The server first materializes the whole ordered result in a temporary table. Implies --binary and --skip-steal",
+  NULL },
 { "d|database", OPT_TYPE_STR | OPT_FLAG_NODEF, &g_pDatabase, (void *) NULL,
   "Database to load data into", NULL },
 { "defaults-file", OPT_TYPE_CFGFILEMAIN | OPT_FLAG_CFGFILEARRAY
@@ -234,11 +603,17 @@ OPTIONS Options[] = {
 { "file", OPT_TYPE_STR, (void *) &g_pFile, (void *) NULL, "Name of output file", NULL },
 { "help", OPT_TYPE_BOOL | OPT_FLAG_HELP, NULL, (void *) FALSE, "Show help",
   NULL },
+{ "guard-interval", OPT_TYPE_UINT, (void *) &g_nGuardInterval, (void *) 1,
+  "Seconds between checks of server load and replica lag", NULL },
 { "h|host", OPT_TYPE_STR, (void *) &g_pHost, (void *) NULL,
   "MySQL server host", NULL },
 { "include", OPT_TYPE_CFGFILE, (void *) &g_pIncludeFile, (void *) NULL,
   "Include this config file. Use to include config files for other config files",
   (void *) "jsonexport;-client" },
+{ "json-kernel", OPT_TYPE_SEL | OPT_FLAG_HIDDEN, (void *) &g_nJSONKernel,
+  (void *) JSON_KERNEL_AUTO,
+  "JSON escape kernel to use, the best the CPU supports by default (auto, scalar, sse2, avx2, avx512)",
+  (void *) "auto;scalar;sse2;avx2;avx512" },
 { "limit", OPT_TYPE_ULONG, (void *) &g_lLimit, (void *) 0,
   "Max # of rows to fetch", NULL },
 { "logfile", OPT_TYPE_STR | OPT_FLAG_NONULL, &g_pLogFile, (void *) NULL,
@@ -246,18 +621,55 @@ OPTIONS Options[] = {
 { "loglevel", OPT_TYPE_SEL, &g_nLoglevel, (void *) LOG_INFO,
   "Log level (status, error, info, verbose, debug)",
   (void *) ";status;error;info;verbose;debug" },
+{ "max-replica-lag", OPT_TYPE_UINT, (void *) &g_nMaxReplicaLag, (void *) 0,
+  "Pause the export while replica lag is over this many seconds", NULL },
+{ "max-threads-running", OPT_TYPE_UINT, (void *) &g_nMaxThreadsRunning,
+  (void *) 0,
+  "Pause the export while Threads_running, not counting the connections of the export, is over this",
+  NULL },
 { "skip-null", OPT_TYPE_BOOL, (void *) &g_bSkipNull, (void *) FALSE,
   "Skip NULL columns instead of exporting them as null", NULL },
 { "parallel", OPT_TYPE_BOOL | OPT_FLAG_HIDDEN, (void *) &g_bParallel,
   (void *) TRUE, "Enable parallel processing", NULL },
 { "skip-parallel", OPT_TYPE_BOOLREVERSE, (void *) &g_bParallel, (void *) FALSE,
   "Disable parallel processing", NULL },
+{ "pipeline", OPT_TYPE_BOOL, (void *) &g_bPipeline, (void *) FALSE,
+  "Fetch, format and write rows in separate threads. Each row is then copied once more, for the format thread",
+  NULL },
+{ "prefetch", OPT_TYPE_BOOL, (void *) &g_bPrefetch, (void *) FALSE,
+  "Send the query for the next batch on a second connection while the current batch is written",
+  NULL },
 { "p|password", OPT_TYPE_STR, (void *) &g_pPassword, (void *) NULL,
   "MySQL Password for user", NULL },
 { "P|port", OPT_TYPE_UINT, (void *) &g_nPort, (void *) 3306, "MySQL Port",
   NULL },
+{ "split", OPT_TYPE_UINT, (void *) &g_nSplit, (void *) 0,
+  "Split tables batched on a single column into this many key ranges, exported in parallel",
+  NULL },
+{ "split-plan", OPT_TYPE_SEL, (void *) &g_nSplitPlan, (void *) SPLIT_PLAN_RANGE,
+  "How to find the key ranges of a split table. Divide the MIN to MAX range of an integer key (range) or sample the key index for ranges with about the same number of rows (sample). Other keys are always sampled (range, sample)",
+  (void *) "range;sample" },
+{ "split-hash", OPT_TYPE_BOOL, (void *) &g_bSplitHash, (void *) FALSE,
+  "Split tables with no primary or unique key into --split parts by a CRC32 hash of their columns. Each part is a scan of the whole table",
+  NULL },
+{ "split-files", OPT_TYPE_BOOL, (void *) &g_bSplitFiles, (void *) FALSE,
+  "Keep each key range of a split table in a file of its own", NULL },
+{ "snapshot", OPT_TYPE_SEL, (void *) &g_nSnapshot, (void *) SNAPSHOT_NONE,
+  "Export all tables from one consistent snapshot, taking FLUSH TABLES WITH READ LOCK (flush) while the snapshot is started. LOCK INSTANCE FOR BACKUP (backup) only blocks DDL, so it can only be used with a single export connection (none, flush, backup)",
+  (void *) "none;flush;backup" },
 { "S|socket", OPT_TYPE_STR, (void *) &g_pSocket, (void *) NULL, "MySQL Socket",
   NULL },
+{ "schedule", OPT_TYPE_SEL, (void *) &g_nSchedule, (void *) SCHEDULE_LARGEST,
+  "Order to export tables in when running in parallel (ordered, largest)",
+  (void *) "ordered;largest" },
+{ "steal", OPT_TYPE_BOOL | OPT_FLAG_HIDDEN, (void *) &g_bSteal, (void *) TRUE,
+  "Let idle threads split the key range of tables other threads export", NULL },
+{ "skip-steal", OPT_TYPE_BOOLREVERSE, (void *) &g_bSteal, (void *) FALSE,
+  "Do not let idle threads split the key range of tables being exported",
+  NULL },
+{ "steal-threads", OPT_TYPE_UINT, (void *) &g_nStealThreads, (void *) 2,
+  "The most threads, and connections, beyond one for each table and table part, that are started only to split key ranges",
+  NULL },
 { "sql-no-cache", OPT_TYPE_BOOL | OPT_FLAG_HIDDEN, (void *) &g_bSQLNoCache,
   (void *) TRUE, "Add SQL_NO_CACHE to the SELECT.", NULL },
 { "skip-sql-no-cache", OPT_TYPE_BOOLREVERSE, (void *) &g_bSQLNoCache,
@@ -288,12 +700,18 @@ OPTIONS Options[] = {
   "Continue even if there is an error in a SQL Init statement.", NULL },
 { "t|table", OPT_TYPE_STRARRAY, (void *) &g_pTables, (void *) NULL,
   "Table to export. More than 1 may be specified.", NULL },
+{ "threads", OPT_TYPE_UINT, (void *) &g_nThreads, (void *) 0,
+  "Number of export threads when running in parallel. Default is the number of available CPUs",
+  NULL },
 { "skip-timing", OPT_TYPE_BOOLREVERSE | OPT_FLAG_HIDDEN, (void *) &g_bTiming,
   (void *) FALSE, "Show timing (for debugging and testing)", NULL },
 { "tiny1-as-bool", OPT_TYPE_BOOL, (void *) &g_bTiny1AsBool, (void *) FALSE,
   "Treat a tiny(1) as a bool column, exporting the strings TRUE and FALSE",
   NULL },
 { "u|user", OPT_TYPE_STR, &g_pUser, (void *) NULL, "MySQL Username", NULL },
+{ "unicode", OPT_TYPE_SEL, (void *) &g_nUnicode, (void *) UNICODE_BYTES,
+  "Export each non-ASCII byte as \\u00XX (bytes), or valid UTF-8 as is (pass) or as \\uXXXX (escape), with invalid bytes as \\u00XX. Pass and escape use utf8mb4 in UTF-8 mode (bytes, pass, escape)",
+  (void *) "bytes;pass;escape" },
 { "skip-utf8", OPT_TYPE_BOOLREVERSE, &g_bUTF8, (void *) TRUE,
   "Enable MySQL in UTF-8 mode", NULL },
 { "use-result", OPT_TYPE_BOOL, (void *) &g_bUseResult, (void *) FALSE,
@@ -306,21 +724,144 @@ OPTIONS Options[] = {
 void PrintMsg(unsigned int nLogLevel, char *pFmt, ...);
 void PrintStats(int nData);
 void *RunThread(void *pData);
-unsigned int ExportTable(MYSQL *pMySQL, PJSONTABLE pTable);
+unsigned int ExportQueue(PTHREADDATA pThr);
+BOOL FinishTableExport(PTHREADDATA pThr, PJSONTABLE pTable, BOOL bFinish);
+unsigned int ExportAsync(PTHREADDATA pConns, unsigned int nConns);
+BOOL AsyncStep(PASYNCCONN pAsync, int nReady);
+int AsyncQuery(PASYNCCONN pAsync, int nReady);
+int AsyncResult(PASYNCCONN pAsync, int nReady);
+void AsyncGetPoll(PASYNCCONN pAsync, struct pollfd *pFd);
+int AsyncGetReady(PASYNCCONN pAsync, short nRevents);
+PJSONTABLE GetNextTable(PTHREADDATA pThr);
+PJSONTABLE StealTableRange(PTHREADDATA pThr);
+void DistributeTables(PJSONTABLE *pQueue, unsigned int nQueue, PTHREADDATA pThreads, unsigned int nThreads);
+BOOL SetBatchCursor(PJSONTABLE pTable, char *pValue, long long *pllEnd);
+MYSQL *ConnectMySQL(void);
+BOOL ConnectThread(PTHREADDATA pThr, MYSQL *pMySQL);
+BOOL StartSnapshot(MYSQL *pMySQL);
+BOOL RunSnapshotSQL(MYSQL *pMySQL, char *pSQL);
+unsigned int GetDefaultThreads(void);
+BOOL OpenTableFile(PJSONTABLE pTable);
+void GetTableFileName(PJSONTABLE pTable, char *pFile);
+BOOL SplitTable(MYSQL *pMySQL, PJSONTABLE pTable, unsigned int nParts);
+char **SampleKeyBounds(MYSQL *pMySQL, PJSONTABLE pTable, unsigned int *pnParts);
+BOOL SplitTableHash(PJSONTABLE pTable, unsigned int nParts);
+BOOL CountTableRows(MYSQL *pMySQL, PJSONTABLE pTable);
+BOOL TableHasKey(MYSQL *pMySQL, PJSONTABLE pTable, BOOL *pbKey);
+BOOL GetTableSizes(MYSQL *pMySQL, PJSONTABLE pTables, unsigned int nTables);
+int CompareTableCost(const void *p1, const void *p2);
+PJSONTABLE CloneTable(PJSONTABLE pTable);
+void FreeTablePart(PJSONTABLE pPart);
+BOOL FinishTablePart(PJSONTABLE pPart);
+BOOL StitchTableParts(PJSONTABLE pTable);
+unsigned int ExportTable(MYSQL *pMySQL, MYSQL *pMySQLPrefetch, PJSONTABLE pTable);
+BOOL ExportStart(PEXPORTSTATE pState, PJSONTABLE pTable, BOOL bPipeline, MYSQL *pMySQL, MYSQL *pMySQLNext);
+BOOL PrefetchStart(PEXPORTSTATE pState, unsigned long lRows);
+MYSQL_RES *PrefetchWait(PEXPORTSTATE pState);
+void *PrefetchThread(void *pData);
+BOOL ExportBatch(PEXPORTSTATE pState, MYSQL_RES *pRes, BOOL *pbDone);
+BOOL ExportRow(PEXPORTSTATE pState, MYSQL_ROW pRow, unsigned long *pLengths);
+void AddFormatTime(PEXPORTSTATE pState);
+unsigned int ExportTableStmt(MYSQL *pMySQL, PJSONTABLE pTable);
+BOOL ExportStmtBatch(PEXPORTSTATE pState, PSTMTEXPORT pStmt, BOOL *pbDone);
+BOOL StmtExecute(PSTMTEXPORT pStmt, MYSQL *pMySQL, PJSONTABLE pTable, unsigned long lLimit, BOOL bStore);
+BOOL StmtBindResult(PSTMTEXPORT pStmt);
+BOOL StmtFetch(PSTMTEXPORT pStmt, BOOL *pbRow);
+void StmtFree(PSTMTEXPORT pStmt);
+unsigned long FormatInt(long long llValue, BOOL bUnsigned, char *pRet);
+unsigned long FormatTime(MYSQL_TIME *pTime, enum enum_field_types nType, unsigned int nDecimals, char *pRet);
+char *FormatDigits(char *pRet, unsigned long lValue, unsigned int nDigits);
+BOOL ExportEnd(PEXPORTSTATE pState, BOOL bError);
+void SizeBatch(PEXPORTSTATE pState, unsigned long lBatchRows);
+BOOL FormatRow(PJSONTABLE pTable, MYSQL_ROW pRow, unsigned long *pLengths, PROWBUF pBuf, BOOL bFirst);
+BOOL SetColKeys(PJSONTABLE pTable);
+BOOL SetEmitPlan(PJSONTABLE pTable);
+BOOL RowBufAdd(PROWBUF pBuf, char *pData, size_t nLen);
+BOOL RowBufReserve(PROWBUF pBuf, size_t nLen);
+BOOL RowBufEscape(PROWBUF pBuf, char *pValue, size_t nLen);
+BOOL RowBufFlush(PROWBUF pBuf, void *pData);
+BOOL SetBatchValue(PJSONCOL pCol, char *pValue);
+BOOL SetBatchValues(PJSONTABLE pTable, MYSQL_ROW pRow);
+BOOL PipeStart(PEXPORTPIPE pPipe, PJSONTABLE pTable);
+void RingInit(PPIPERING pRing);
+void RingFree(PPIPERING pRing);
+BOOL RingWait(PPIPERING pRing, BOOL bPut);
+void RingWake(PPIPERING pRing);
+BOOL PipeAddRow(PEXPORTPIPE pPipe, MYSQL_ROW pRow, unsigned long *pLengths);
+BOOL PipeFinish(PEXPORTPIPE pPipe);
+PROWCHUNK PipeGetChunk(PEXPORTPIPE pPipe, unsigned long lLen);
+void PipePutChunk(PEXPORTPIPE pPipe, PROWCHUNK pChunk);
+void PipeFreeChunk(PROWCHUNK pChunk);
+POUTBLOCK PipeGetBlock(PEXPORTPIPE pPipe);
+void PipePutBlock(PEXPORTPIPE pPipe, POUTBLOCK pBlock);
+void PipeFreeBlock(POUTBLOCK pBlock);
+void *FormatThread(void *pData);
+BOOL FormatFlush(PROWBUF pBuf, void *pData);
+void *WriteThread(void *pData);
+BOOL RingPut(PPIPERING pRing, void *pItem);
+void *RingGet(PPIPERING pRing);
+BOOL RingTryPut(PPIPERING pRing, void *pItem);
+void *RingTryGet(PPIPERING pRing);
+void AddPipeStats(PPIPESTATS pTo, PPIPESTATS pFrom);
+void PrintPipeStats(PJSONTABLE pTable);
+unsigned long long AdaptAcquire(void);
+void AdaptRelease(unsigned long lRows, unsigned long long llStart);
+void *AdaptThread(void *pData);
+unsigned long long GetUsecs(void);
+void GuardWait(void);
+void *GuardThread(void *pData);
+BOOL GetServerLoad(MYSQL *pMySQL, long *plThreadsRunning, long *plReplicaLag);
 BOOL StringIsNumeric(char *pStr, BOOL bInt);
 char *json_escape(char *pStr, char *pRet, unsigned int *pnLen);
 unsigned int json_len_escaped(char *pStr);
+BOOL JSONKernelInit(void);
+char *json_escape_char(unsigned char cChar, char *pRet);
+char *json_escape_scalar(char *pStr, size_t nLen, char *pRet);
+size_t json_len_escaped_scalar(char *pStr, size_t nLen);
+char *json_escape_utf8(char *pStr, size_t nLen, char *pRet);
+size_t json_len_escaped_utf8(char *pStr, size_t nLen);
+char *json_escape_utf8_scalar(char *pStr, size_t nLen, char *pRet);
+char *json_escape_pass_scalar(char *pStr, size_t nLen, char *pRet);
+unsigned int utf8_decode(unsigned char *pStr, unsigned char *pEnd, unsigned long *plCode);
+BOOL utf8_valid_scalar(char *pStr, size_t nLen);
+size_t ascii_len_scalar(char *pStr, size_t nLen);
+#ifdef JSON_SIMD_X86
+size_t ascii_len_sse2(char *pStr, size_t nLen);
+size_t ascii_len_avx2(char *pStr, size_t nLen);
+char *json_escape_sse2(char *pStr, size_t nLen, char *pRet);
+size_t json_len_escaped_sse2(char *pStr, size_t nLen);
+char *json_escape_avx2(char *pStr, size_t nLen, char *pRet);
+size_t json_len_escaped_avx2(char *pStr, size_t nLen);
+char *json_escape_avx512(char *pStr, size_t nLen, char *pRet);
+size_t json_len_escaped_avx512(char *pStr, size_t nLen);
+char *json_escape_pass_sse2(char *pStr, size_t nLen, char *pRet);
+char *json_escape_pass_avx2(char *pStr, size_t nLen, char *pRet);
+char *json_escape_pass_avx512(char *pStr, size_t nLen, char *pRet);
+BOOL utf8_valid_avx2(char *pStr, size_t nLen);
+__m256i utf8_check_avx2(__m256i v, __m256i vPrev);
+#endif
 char *BuildSQL(MYSQL *pMySQL, char *pRes, char *pPrefix, unsigned long lLimit, BOOL bQuotes, char *pBatchCol , char *pLast);
-char *FormatSQL(PJSONTABLE pTable, unsigned long lLimit);
+char *FormatSQL(MYSQL *pMySQL, PJSONTABLE pTable, unsigned long lLimit, char **ppParams);
 PJSONCOL FindColByName(PJSONCOL pCols, unsigned int nCols, char *pName);
 BOOL SetBatchingColumn(PJSONTABLE pTable);
+BOOL SetKeyOrder(MYSQL *pMySQL, PJSONTABLE pTable);
+BOOL SetUniqueKey(MYSQL *pMySQL, PJSONTABLE pTable);
 PJSONCOL SetColsFromResult(PJSONCOL pCols, unsigned int *pnCols, MYSQL_RES *pRes);
 void PrintTableCols(FILE *fd, PJSONTABLE pTable);
 
+// The JSON escape kernels, chosen at startup by what the CPU supports.
+char *(*g_pJSONEscape)(char *pStr, size_t nLen, char *pRet) = json_escape_scalar;
+size_t (*g_pJSONLenEscaped)(char *pStr, size_t nLen) = json_len_escaped_scalar;
+char *g_pJSONKernel = "scalar";
+char *(*g_pJSONEscapeBytes)(char *pStr, size_t nLen, char *pRet) = json_escape_scalar;
+char *(*g_pJSONEscapePass)(char *pStr, size_t nLen, char *pRet) = json_escape_pass_scalar;
+BOOL (*g_pUTF8Valid)(char *pStr, size_t nLen) = utf8_valid_scalar;
+size_t (*g_pASCIILen)(char *pStr, size_t nLen) = ascii_len_scalar;
+
 int main(int argc, char *argv[])
    {
    char szTmp[256];
-   char szFile[PATH_MAX + 1];
+   char *pTmp;
    int nRet = -1;
    int i, j;
    unsigned int nCols;
@@ -342,6 +883,12 @@ int main(int argc, char *argv[])
 #endif
    PKEYVALUE pKeyValue;
    PTHREADDATA pThreads = NULL;
+   PJSONTABLE *pQueue = NULL;
+   unsigned int nQueue = 0;
+   unsigned int nThreads = 0;
+   pthread_t thrAdapt;
+   pthread_t thrGuard;
+   MYSQL *pMySQLGuard;
 
 // Set NULL and default of values.
    ou_OptionArraySetNull(Options);
@@ -378,6 +925,8 @@ int main(int argc, char *argv[])
 
 // Reset error code to the default.
    nRet = -1;
+   if(JSONKernelInit())
+      goto ErrExit;
 
 // Add tables on commandline to list of tables.
    for(i = 1; i < argc; i++)
@@ -416,6 +965,50 @@ int main(int argc, char *argv[])
       fprintf(stderr, "You have to specify a batch size > 0\n");
       goto ErrExit;
       }
+   if((g_lBatchTime > 0 || g_lBatchMB > 0) && g_lBatchSize == 0)
+      {
+      fprintf(stderr, "--batch-time and --batch-mb need a --batch-size to start from.\n");
+      goto ErrExit;
+      }
+   if(g_lBatchMin == 0 || g_lBatchMin > g_lBatchMax)
+      {
+      fprintf(stderr, "--batch-min must be > 0 and not more than --batch-max.\n");
+      goto ErrExit;
+      }
+   g_bSizing = g_lBatchTime > 0 || g_lBatchMB > 0;
+   if(g_bSizing && (g_lBatchSize < g_lBatchMin || g_lBatchSize > g_lBatchMax))
+      {
+      fprintf(stderr, "--batch-size must be between --batch-min and --batch-max.\n");
+      goto ErrExit;
+      }
+
+// Check that the client library can do non-blocking calls.
+#if !defined(ASYNC_MARIADB) && !defined(ASYNC_MYSQL)
+   if(g_nAsync > 0)
+      {
+      fprintf(stderr, "The MySQL client library has no non-blocking API, so --async can't be used.\n");
+      goto ErrExit;
+      }
+#endif
+
+// A table streamed through a cursor has no batches, so the range of a
+// table part can't be split while it is exported.
+   if(g_lCursorFetch > 0)
+      {
+      if(!g_bBinary)
+         PrintMsg(LOG_INFO, "--cursor-fetch exports using the binary protocol, as with --binary.\n");
+      if(g_bSteal)
+         PrintMsg(LOG_INFO, "--cursor-fetch exports tables without batches, so idle threads won't split them.\n");
+      g_bBinary = TRUE;
+      g_bSteal = FALSE;
+      }
+
+// Prepared statements are run by the export threads only.
+   if(g_bBinary && (g_nAsync > 0 || g_bPrefetch))
+      {
+      fprintf(stderr, "--binary and --cursor-fetch can't be used with --async or --prefetch.\n");
+      goto ErrExit;
+      }
 
 // Check output directory.
    if(stat(g_pDirectory, &statBuf) != 0)
@@ -505,7 +1098,8 @@ int main(int argc, char *argv[])
 
 // Set up UTF8.
    if(g_bUTF8)
-      mysql_query(pMySQL, "SET NAMES utf8");
+      mysql_query(pMySQL, g_nUnicode == UNICODE_BYTES ? "SET NAMES utf8"
+        : "SET NAMES utf8mb4");
 
    if(g_pSQL == NULL)
       {
@@ -631,11 +1225,15 @@ int main(int argc, char *argv[])
       {
       pCols[j].pName = NULL;
       pCols[j].pJSONName = NULL;
+      pCols[j].pJSONKey = NULL;
+      pCols[j].nJSONKeyLen = 0;
       pCols[j].pValue = NULL;
       pCols[j].pPrevValue = NULL;
+      pCols[j].nPrevValueSize = 0;
       pCols[j].lValue = 0;
       pCols[j].lIncr = 0;
       pCols[j].nFlags = JSONCOL_FLAG_NONE;
+      pCols[j].nKeySeq = 0;
       pCols[j].nMySQLCol = -1;
       }
 
@@ -767,10 +1365,29 @@ int main(int argc, char *argv[])
       pTables[i].pSQLFormat = NULL;
       pTables[i].pSQL = NULL;
       pTables[i].pBatchCol = NULL;
+      pTables[i].nKeyCols = 0;
+      pTables[i].pKeyIndex = NULL;
+      pTables[i].pHashExpr = NULL;
       pTables[i].nSQLBufLen = 0;
       pTables[i].lBatchSize = 0;
+      pTables[i].lSizeMin = pTables[i].lSizeMax = 0;
       pTables[i].lRows = 0;
       pTables[i].nCols = nCols;
+      pTables[i].pRangeEnd = NULL;
+      pTables[i].llDataLength = 0;
+      pTables[i].llEstRows = 0;
+      pTables[i].bIntRange = FALSE;
+      pTables[i].llKeyMin = pTables[i].llKeyMax = 0;
+      memset(&pTables[i].statRows, 0, sizeof(PIPESTATS));
+      memset(&pTables[i].statOut, 0, sizeof(PIPESTATS));
+      pTables[i].llFormatBytes = pTables[i].llFormatUsecs = 0;
+      pTables[i].pParent = NULL;
+      pTables[i].pParts = NULL;
+      pTables[i].nParts = 0;
+      pTables[i].nPartsLeft = 0;
+      pTables[i].nPart = 0;
+      pTables[i].pOps = NULL;
+      pTables[i].nOps = 0;
 
       if(g_pSQL != NULL)
          {
@@ -793,7 +1410,7 @@ int main(int argc, char *argv[])
          if(g_lBatchSize > 0)
             {
 // Format the SQL statement with a single row limit.
-            FormatSQL(&pTables[i], 1);
+            FormatSQL(pMySQL, &pTables[i], 1, NULL);
             PrintMsg(LOG_DEBUG, "Formated SQL: %s\n", pTables[i].pSQL);
 
 // Execute the query.
@@ -875,11 +1492,15 @@ int main(int argc, char *argv[])
             {
             pTables[i].pCols[j].pName = NULL;
             pTables[i].pCols[j].pJSONName = NULL;
+            pTables[i].pCols[j].pJSONKey = NULL;
+            pTables[i].pCols[j].nJSONKeyLen = 0;
             pTables[i].pCols[j].pValue = NULL;
             pTables[i].pCols[j].pPrevValue = NULL;
+            pTables[i].pCols[j].nPrevValueSize = 0;
             pTables[i].pCols[j].lValue = 0;
             pTables[i].pCols[j].lIncr = 0;
             pTables[i].pCols[j].nFlags = JSONCOL_FLAG_NONE;
+            pTables[i].pCols[j].nKeySeq = 0;
             pTables[i].pCols[j].nMySQLCol = -1;
             }
 
@@ -911,7 +1532,9 @@ int main(int argc, char *argv[])
             }
 
 // Now get the batching column.
-         if(g_lBatchSize > 0 && SetBatchingColumn(&pTables[i]))
+         if(g_lBatchSize > 0 && (SetKeyOrder(pMySQL, &pTables[i])
+           || SetUniqueKey(pMySQL, &pTables[i])
+           || SetBatchingColumn(&pTables[i])))
             goto ErrExit;
 
 // Free the SHOW COLUMNS result.
@@ -933,6 +1556,10 @@ int main(int argc, char *argv[])
 // FROM<space>`<table name>`%<W|w>%O
          nLen += strlen(pTables[i].pName) + 11;
 
+// <space>FORCE<space>INDEX<space>(`<index name>`), with backticks doubled.
+         if(pTables[i].pKeyIndex != NULL)
+            nLen += strlen(pTables[i].pKeyIndex) * 2 + 17;
+
 // Allocate space for the SQL statement.
          if((pTables[i].pSQLFormat = malloc(nLen + 1)) == NULL)
             {
@@ -971,8 +1598,23 @@ int main(int argc, char *argv[])
 
          strcat(pTables[i].pSQLFormat, " FROM `");
          strcat(pTables[i].pSQLFormat, pTables[i].pName);
+         strcat(pTables[i].pSQLFormat, "`");
+
+// A table batched on a unique index is read in the order of that index.
+         if(pTables[i].pKeyIndex != NULL)
+            {
+            strcat(pTables[i].pSQLFormat, " FORCE INDEX (`");
+            pTmp = &pTables[i].pSQLFormat[strlen(pTables[i].pSQLFormat)];
+            for(j = 0; pTables[i].pKeyIndex[j] != '\0'; j++)
+               {
+               if(pTables[i].pKeyIndex[j] == '`')
+                  *pTmp++ = '`';
+               *pTmp++ = pTables[i].pKeyIndex[j];
+               }
+            strcpy(pTmp, "`)");
+            }
          strcat(pTables[i].pSQLFormat,
-           g_pSQLWhereSuffix == NULL ? "`%w%O" : "`%W%O");
+           g_pSQLWhereSuffix == NULL ? "%w%O" : "%W%O");
          }
 
       if(g_lBatchSize > 0 && SetBatchingColumn(&pTables[i]))
@@ -985,7 +1627,7 @@ int main(int argc, char *argv[])
       for(i = 0; i < nTables; i++)
          {
 // Format the SQL statement, but limit to 1 row only.
-         FormatSQL(&pTables[i], 1);
+         FormatSQL(pMySQL, &pTables[i], 1, NULL);
 
          if(mysql_query(pMySQL, pTables[i].pSQL) != 0)
             {
@@ -1012,55 +1654,151 @@ int main(int argc, char *argv[])
       goto Exit;
       }
 
+// Get the size of the tables, which is used to schedule the largest tables
+// first and to check which tables are worth splitting.
+   if(g_bParallel && g_pSQL == NULL && (g_nSchedule == SCHEDULE_LARGEST
+     || g_nSplit > 1 || g_bSteal) && GetTableSizes(pMySQL, pTables, nTables))
+      goto ErrExit;
+
+// Figure out how many threads to use at most. This is cut down to the number
+// of tables and table parts once the tables are split.
    if(g_bParallel)
-      {
+      nThreads = g_nAsync > 0 ? g_nAsync
+        : g_nThreads > 0 ? g_nThreads : GetDefaultThreads();
+   else
+      nThreads = 1;
+
 // Set up threads array.
-      if((pThreads = calloc(nTables, sizeof(THREADDATA))) == NULL)
-         {
-         fprintf(stderr, "Memory allocation error.\n");
+   if((pThreads = calloc(nThreads, sizeof(THREADDATA))) == NULL)
+      {
+      fprintf(stderr, "Memory allocation error.\n");
+      goto ErrExit;
+      }
+
+// For a consistent snapshot, lock the instance and start the snapshot on the
+// main connection and on the connections of all threads. The lock is held
+// only while the snapshots are started. Tables are split after that, the
+// first and last key ranges are open so any set of ranges covers all rows.
+// The backup lock doesn't block writes, so the snapshots of two connections
+// may differ, and it is only allowed with a single connection to export on.
+   if(g_nSnapshot == SNAPSHOT_BACKUP && (nThreads > 1 || g_bPrefetch))
+      {
+      fprintf(stderr, "--snapshot=backup doesn't give all threads the same snapshot. Use --snapshot=flush, or --threads=1 without --prefetch.\n");
+      goto ErrExit;
+      }
+   if(g_nSnapshot != SNAPSHOT_NONE)
+      {
+      if(RunSnapshotSQL(pMySQL, g_nSnapshot == SNAPSHOT_FLUSH
+        ? "FLUSH TABLES WITH READ LOCK" : "LOCK INSTANCE FOR BACKUP")
+        || StartSnapshot(pMySQL))
          goto ErrExit;
+      for(i = 0; i < nThreads; i++)
+         {
+         if(ConnectThread(&pThreads[i], pMySQL))
+            goto ErrExit;
          }
+      if(RunSnapshotSQL(pMySQL, g_nSnapshot == SNAPSHOT_FLUSH
+        ? "UNLOCK TABLES" : "UNLOCK INSTANCE"))
+         goto ErrExit;
+      }
 
-// Set up the individual threads.
+// Split tables into key ranges that are exported in parallel. This doesn't
+// work with a row limit, as that applies to the table as a whole. When work
+// stealing is enabled, tables that aren't split are set up as a single range,
+// so that other threads may split them later.
+   if(g_bParallel && (g_nSplit > 1 || g_bSteal) && g_pSQL == NULL
+     && g_lLimit == 0)
+      {
       for(i = 0; i < nTables; i++)
          {
-         pThreads[i].pTable = &pTables[i];
-         pThreads[i].nRet = 0;
-
-// Connect to MYSQL.
-         pThreads[i].pMySQL = mysql_init(NULL);
-         if(mysql_real_connect(pThreads[i].pMySQL, g_pHost, g_pUser,
-           g_pPassword, g_pDatabase, g_nPort, g_pSocket, CLIENT_COMPRESS)
-           == NULL)
-            {
-            fprintf(stderr, "MySQL Connection failed:\n%s\n",
-              mysql_error(pThreads[i].pMySQL));
+         if(SplitTable(pMySQL, &pTables[i], g_nSplit > 1 ? g_nSplit : 1))
             goto ErrExit;
-            }
+         }
+      }
 
-// Run init statements.
-         for(j = 0; g_pSQLThreadInit != NULL && g_pSQLThreadInit[j] != NULL;
-           i++)
-            {
-            PrintMsg(LOG_VERBOSE, "Running SQL Init:\n%s\n",
-              g_pSQLThreadInit[j]);
-            if(mysql_query(pThreads[i].pMySQL, g_pSQLThreadInit[j]) != 0)
-               {
-               PrintMsg(LOG_ERROR,
-                 "SQL Error %d\n%s\nin SQL Init statement:\n%s\n",
-                 mysql_errno(pThreads[i].pMySQL),
-                 mysql_error(pThreads[i].pMySQL), g_pSQLThreadInit[j]);
-               if(g_bStopOnInitError)
-                  goto ErrExit;
-               }
-            }
+// Set up the list of tables to export, where a split table is exported as
+// its parts.
+   for(i = 0, nQueue = 0; i < nTables; i++)
+      nQueue += pTables[i].nParts > 0 ? pTables[i].nParts : 1;
+   if((pQueue = calloc(nQueue, sizeof(PJSONTABLE))) == NULL)
+      {
+      fprintf(stderr, "Memory allocation error.\n");
+      goto ErrExit;
+      }
+   for(i = 0, nQueue = 0; i < nTables; i++)
+      {
+      if(pTables[i].nParts == 0)
+         pQueue[nQueue++] = &pTables[i];
+      for(j = 0; j < pTables[i].nParts; j++)
+         pQueue[nQueue++] = pTables[i].pParts[j];
+      }
 
-// Set up UTF8.
-         if(g_bUTF8)
-            mysql_query(pThreads[i].pMySQL, "SET NAMES utf8");
+// Sort the tables largest first.
+   if(g_bParallel && g_nSchedule == SCHEDULE_LARGEST)
+      {
+      qsort(pQueue, nQueue, sizeof(PJSONTABLE), CompareTableCost);
+      for(i = 0; i < nQueue; i++)
+         PrintMsg(LOG_DEBUG, "Queued table %s part %d, size %llu bytes.\n",
+           pQueue[i]->pName, pQueue[i]->nPart, pQueue[i]->llDataLength);
+      }
+
+// There is no point in having more threads than there are tables and table
+// parts, unless there are key ranges that idle threads can split, and then
+// only --steal-threads more. Close the connections of any threads not
+// needed.
+   for(i = 0, j = 0; g_bParallel && g_bSteal && i < nTables; i++)
+      {
+      if(pTables[i].bIntRange)
+         j++;
+      }
+   if(j > 0)
+      j = nQueue + g_nStealThreads;
+   else
+      j = nQueue;
+   if(g_bParallel && nThreads > j)
+      {
+      for(i = j; i < nThreads; i++)
+         {
+         if(pThreads[i].pMySQL != NULL)
+            mysql_close(pThreads[i].pMySQL);
+         if(pThreads[i].pMySQLPrefetch != NULL)
+            mysql_close(pThreads[i].pMySQLPrefetch);
+         }
+      nThreads = j;
+      }
+   PrintMsg(LOG_VERBOSE, "Exporting %d tables using %d threads.\n", nTables,
+     nThreads);
+
+// Set up the individual threads, each one with a queue of tables and a
+// connection of its own that is reused for all tables that thread exports.
+// The connections are already open when there is a snapshot.
+   for(i = 0; i < nThreads; i++)
+      {
+      pThreads[i].nId = i;
+      pThreads[i].pTable = NULL;
+      pThreads[i].nTables = 0;
+      pThreads[i].nRet = 0;
+      pThreads[i].nQueueHead = 0;
+      pThreads[i].nQueueTail = 0;
+      pThreads[i].llQueueCost = 0;
+      pThreads[i].bStarted = FALSE;
+      pthread_mutex_init(&pThreads[i].mtxQueue, NULL);
+      if((pThreads[i].pQueue = calloc(nQueue, sizeof(PJSONTABLE))) == NULL)
+         {
+         fprintf(stderr, "Memory allocation error.\n");
+         goto ErrExit;
          }
+      if(pThreads[i].pMySQL == NULL && ConnectThread(&pThreads[i], pMySQL))
+         goto ErrExit;
       }
 
+   g_pWorkers = pThreads;
+   g_nWorkers = nThreads;
+
+// Hand out the tables to the threads.
+   DistributeTables(pQueue, nQueue, pThreads, nThreads);
+   free(pQueue);
+
 /* Set up signal handlers. */
    sa.sa_handler = PrintStats;
    sigemptyset(&sa.sa_mask);
@@ -1076,37 +1814,45 @@ int main(int argc, char *argv[])
       goto ErrExit;
       }
 
-// Now, do the actual export.
-   tStart = g_bTiming ? time(NULL) : 0;
-   for(i = 0; i < nTables; i++)
+// Start the load guard, with a connection of its own.
+   if(g_nMaxThreadsRunning > 0 || g_nMaxReplicaLag > 0)
       {
-// Create and open export file.
-      if(g_pFile != NULL)
+      if((pMySQLGuard = ConnectMySQL()) == NULL)
+         goto ErrExit;
+      if((nRet = pthread_create(&thrGuard, NULL, GuardThread,
+        (void *) pMySQLGuard)) != 0)
          {
-         if((pTables[i].fd = fopen(g_pFile, "w")) == NULL)
-            {
-            fprintf(stderr, "Error opening file %s.\n", g_pFile);
-            perror("File open error");
-            goto ErrExit;
-            }
+         mysql_close(pMySQLGuard);
+         PrintMsg(LOG_ERROR, "pthread_create() error: %d\n", nRet);
+         goto ErrExit;
          }
-      else
-         {
-         strcpy(szFile, g_pDirectory);
-         strcat(szFile, "/");
-         strcat(szFile, pTables[i].pName);
-         strcat(szFile, g_pExtension);
+      g_bGuarding = TRUE;
+      }
+
+// Now, do the actual export.
+   tStart = g_bTiming ? time(NULL) : 0;
 
-         if((pTables[i].fd = fopen(szFile, "w")) == NULL)
+// Are we running in parallel, using the event loop or threads?
+   if(g_bParallel && g_nAsync > 0)
+      {
+      if((nRet = ExportAsync(pThreads, nThreads)) != 0)
+         goto ErrExit;
+      }
+   else if(g_bParallel)
+      {
+// Start the controller, which lets a few threads run at first.
+      if(g_bAdaptive && nThreads > 1)
+         {
+         g_nAdaptLimit = g_nAdaptStart = g_nAdaptPeak = 1;
+         g_bAdapting = TRUE;
+         if((nRet = pthread_create(&thrAdapt, NULL, AdaptThread,
+           (void *) &nThreads)) != 0)
             {
-            fprintf(stderr, "Error opening file %s.\n", szFile);
-            perror("File open error");
+            PrintMsg(LOG_ERROR, "pthread_create() error: %d\n", nRet);
             goto ErrExit;
             }
          }
-
-// Are we running in parallel?
-      if(g_bParallel)
+      for(i = 0; i < nThreads; i++)
          {
          if((nRet = pthread_create(&pThreads[i].thr, NULL, RunThread,
            (void *) &pThreads[i])) != 0)
@@ -1115,21 +1861,31 @@ int main(int argc, char *argv[])
             goto ErrExit;
             }
          }
-      else
-         if((nRet = ExportTable(pMySQL, &pTables[i])) != 0)
-            goto ErrExit;
       }
+// Export all tables using the main connection.
+   else if((nRet = ExportQueue(&pThreads[0])) != 0)
+      goto ErrExit;
 
 // Wait for threads if we are running in parallel.
    nRet = 0;
-   if(g_bParallel)
+   if(g_bParallel && g_nAsync == 0)
       {
-      for(i = 0; i < nTables; i++)
+      for(i = 0; i < nThreads; i++)
          {
          pthread_join(pThreads[i].thr, NULL);
          if(pThreads[i].nRet != 0)
             nRet = pThreads[i].nRet;
          }
+      if(g_bAdapting)
+         {
+         g_bAdaptStop = TRUE;
+         pthread_join(thrAdapt, NULL);
+         }
+      }
+   if(g_bGuarding)
+      {
+      g_bGuardStop = TRUE;
+      pthread_join(thrGuard, NULL);
       }
 
 // Run SQL statenents to finish up.
@@ -1151,20 +1907,44 @@ int main(int argc, char *argv[])
       {
       unsigned long lRows = 0;
       unsigned long lBatches = 0;
+      unsigned long long llFormatBytes = 0;
+      unsigned long long llFormatUsecs = 0;
 
       for(i = 0; i < nTables; i++)
          {
          if(g_nStats == STATS_FULL)
+            {
             fprintf(stderr, "Table: %s Rows: %ld Batches: %ld in %ld seconds\n",
               pTables[i].pName, pTables[i].lRows, pTables[i].lBatch + 1,
               pTables[i].tStop - pTables[i].tStart);
+            if(g_bPipeline && (g_nAsync == 0 || !g_bParallel))
+               PrintPipeStats(&pTables[i]);
+            fprintf(stderr, "  Formatted: %.1f MB at %.1f MB/s\n",
+              pTables[i].llFormatBytes / 1048576.0,
+              pTables[i].llFormatUsecs == 0 ? 0.0
+              : pTables[i].llFormatBytes / (double) pTables[i].llFormatUsecs);
+            if(g_bSizing && pTables[i].lSizeMax > 0)
+               fprintf(stderr, "  Batch size: Min: %lu Max: %lu rows\n",
+                 pTables[i].lSizeMin, pTables[i].lSizeMax);
+            }
          lBatches += pTables[i].lBatch + 1;
          lRows += pTables[i].lRows;
+         llFormatBytes += pTables[i].llFormatBytes;
+         llFormatUsecs += pTables[i].llFormatUsecs;
          }
 
       fprintf(stderr,
         "Tables exported: %d, Rows: %ld, Batches: %ld in %ld seconds\n",
         nTables, lRows, lBatches, tStop - tStart);
+      fprintf(stderr, "Formatted: %.1f MB at %.1f MB/s per thread\n",
+        llFormatBytes / 1048576.0, llFormatUsecs == 0 ? 0.0
+        : llFormatBytes / (double) llFormatUsecs);
+      if(g_bGuarding)
+         fprintf(stderr, "Paused for server load: %lu times for %.1f seconds\n",
+           g_lGuardPauses, g_llGuardUsecs / 1000000.0);
+      if(g_nStats == STATS_FULL && g_bAdapting)
+         fprintf(stderr, "Adaptive threads: Start: %u Peak: %u End: %u Max: %u\n",
+           g_nAdaptStart, g_nAdaptPeak, g_nAdaptLimit, nThreads);
       }
 
 // Now check the return value.
@@ -1203,403 +1983,5650 @@ void *RunThread(void *pData)
    {
    PTHREADDATA pThr = (PTHREADDATA) pData;
 
-// Export the table.
-   pThr->nRet = ExportTable(pThr->pMySQL, pThr->pTable);
+// Export tables until the queue is empty.
+   pThr->nRet = ExportQueue(pThr);
+   PrintMsg(LOG_DEBUG, "Thread %d exported %d tables.\n", pThr->nId,
+     pThr->nTables);
 
-// Close the MySQL connection.
+// Close the MySQL connections.
    mysql_close(pThr->pMySQL);
+   if(pThr->pMySQLPrefetch != NULL)
+      mysql_close(pThr->pMySQLPrefetch);
 
    return NULL;
    } // End of RunThread()
 
 
 /*
- * Function: ExportTable()
- * Export a MySQL table to a specified file.
+ * Function: ExportQueue()
+ * Export tables from the table queue of the thread, one at the time, until
+ * there is no more work, using the connection of the thread.
  * Arguments:
- * MYSQL *pMySQL - The MySQL Connection to use.
- * PJSONTABLE pTable - The table to export.
+ * PTHREADDATA pThr - The thread doing the export.
+ * Returns:
+ * unsigned int - An error code, 0 if there was no error.
+ */
+unsigned int ExportQueue(PTHREADDATA pThr)
+   {
+   unsigned int nRet;
+   PJSONTABLE pTable;
+
+   while(!g_bStop && (pTable = GetNextTable(pThr)) != NULL)
+      {
+      PrintMsg(LOG_VERBOSE, "Thread %d exporting table %s part %d.\n",
+        pThr->nId, pTable->pName == NULL ? "(SQL)" : pTable->pName,
+        pTable->nPart);
+
+// Create and open export file.
+      if(OpenTableFile(pTable))
+         {
+         g_bStop = TRUE;
+         return -1;
+         }
+
+      nRet = g_bBinary ? ExportTableStmt(pThr->pMySQL, pTable)
+        : ExportTable(pThr->pMySQL, pThr->pMySQLPrefetch, pTable);
+      if(FinishTableExport(pThr, pTable, nRet == 0))
+         {
+         g_bStop = TRUE;
+         return -1;
+         }
+      if(nRet != 0)
+         return nRet;
+      }
+
+   return 0;
+   } // End of ExportQueue()
+
+
+/*
+ * Function: FinishTableExport()
+ * Close the file of a table that a thread has exported and, if this was the
+ * last part of a split table, finish that table.
+ * Arguments:
+ * PTHREADDATA pThr - The thread that exported the table.
+ * PJSONTABLE pTable - The table.
+ * BOOL bFinish - The table was exported without error, so finish it.
+ * Returns:
+ * BOOL - TRUE if there is an error, else FALSE.
+ */
+BOOL FinishTableExport(PTHREADDATA pThr, PJSONTABLE pTable, BOOL bFinish)
+   {
+// Close the file now, so we don't keep a file open for every table.
+   fclose(pTable->fd);
+   pTable->fd = NULL;
+   pThr->nTables++;
+
+// The table is no longer being exported by this thread.
+   pthread_mutex_lock(&g_mtxSchedule);
+   pThr->pTable = NULL;
+   pthread_mutex_unlock(&g_mtxSchedule);
+
+// If this was the last part of a split table, then finish that table.
+   if(bFinish && pTable->pParent != NULL && FinishTablePart(pTable))
+      return TRUE;
+
+   return FALSE;
+   } // End of FinishTableExport()
+
+
+/*
+ * Function: ExportAsync()
+ * Export the table queues of a set of connections from a single thread,
+ * using the non-blocking client API. Each connection exports one table at a
+ * time, and the loop handles the result of whichever connection has one
+ * first, so many batch queries are in flight at the same time.
+ * Arguments:
+ * PTHREADDATA pConns - The connections, with their queues.
+ * unsigned int nConns - The number of connections.
  * Returns:
  * unsigned int - An error code, 0 if there was no error.
  */
-unsigned int ExportTable(MYSQL *pMySQL, PJSONTABLE pTable)
+unsigned int ExportAsync(PTHREADDATA pConns, unsigned int nConns)
    {
-   BOOL bFirstCol;
    unsigned int nRet = -1;
+   unsigned int nActive;
+   unsigned int nFds;
    unsigned int i;
-   unsigned int nJSONBufSize = 0;
-   unsigned long lBatchRows;
-   unsigned long lBatchLimit;
-   char *pJSONBuf = NULL;
-   MYSQL_RES *pRes;
-   MYSQL_ROW pRow;
-
-// Format the first SQL statement.
-   lBatchLimit = (g_lLimit > 0 && (g_lLimit < pTable->lBatchSize
-     || pTable->lBatchSize == 0)) ? g_lLimit : pTable->lBatchSize;
-   FormatSQL(pTable, lBatchLimit);
+   int nTimeout;
+   int nPoll;
+   PASYNCCONN pAsync = NULL;
+   PASYNCCONN *pPolled = NULL;
+   struct pollfd *pFds = NULL;
+
+   if((pAsync = calloc(nConns, sizeof(ASYNCCONN))) == NULL
+     || (pPolled = calloc(nConns, sizeof(PASYNCCONN))) == NULL
+     || (pFds = calloc(nConns, sizeof(struct pollfd))) == NULL)
+      {
+      fprintf(stderr, "Memory allocation error.\n");
+      goto ErrExit;
+      }
 
-   pTable->tStart = g_bTiming ? time(NULL) : 0;
-// If we are exporting as an array, the write the array leader now.
-   if(g_bArrayFile)
-      fprintf(pTable->fd, "[\n");
+// Start the first table on each connection.
+   for(i = 0, nActive = 0; i < nConns; i++)
+      {
+      pAsync[i].pThr = &pConns[i];
+      pAsync[i].nState = ASYNC_STATE_IDLE;
+      if(AsyncStep(&pAsync[i], 0))
+         goto ErrExit;
+      if(pAsync[i].nState != ASYNC_STATE_DONE)
+         nActive++;
+      }
 
-// Loop for all batches.
-   for(pTable->lBatch = 0; !g_bStop; pTable->lBatch++)
+// Wait for the connections that are waiting for the server, and move them
+// on as they are ready.
+   while(nActive > 0)
       {
-      PrintMsg(LOG_DEBUG, "Stmt: Batch %ld (limit: %ld)\n  SQL: %s\n",
-        pTable->lBatch, lBatchLimit, pTable->pSQL);
-      if(mysql_query(pMySQL, pTable->pSQL) != 0)
+      if(g_bGuarding)
+         GuardWait();
+      nTimeout = -1;
+      for(i = 0, nFds = 0; i < nConns; i++)
          {
-         fprintf(stderr, "MySQL Error:%s\nin:%s\n", mysql_error(pMySQL),
-           pTable->pSQL);
-         nRet = mysql_errno(pMySQL);
-         goto ErrExit;
+         if(pAsync[i].nState == ASYNC_STATE_DONE)
+            continue;
+         AsyncGetPoll(&pAsync[i], &pFds[nFds]);
+         if(pAsync[i].nTimeout >= 0 && (nTimeout < 0
+           || pAsync[i].nTimeout < nTimeout))
+            nTimeout = pAsync[i].nTimeout;
+         pPolled[nFds++] = &pAsync[i];
          }
 
-// Get the SQL result.
-      if(g_bUseResult)
+      if((nPoll = poll(pFds, nFds, nTimeout)) < 0)
          {
-         if((pRes = mysql_use_result(pMySQL)) == NULL)
-            {
-            fprintf(stderr, "MySQL store results failed:\n%s\nin:%s\n",
-              mysql_error(pMySQL), pTable->pSQL);
-            nRet = mysql_errno(pMySQL);
-            goto ErrExit;
-            }
+         if(errno == EINTR)
+            continue;
+         fprintf(stderr, "Error %d in poll()\n", errno);
+         goto ErrExit;
          }
-      else
+
+      for(i = 0; i < nFds; i++)
          {
-         if((pRes = mysql_store_result(pMySQL)) == NULL)
-            {
-            fprintf(stderr, "MySQL use results failed:\n%s\nin:%s\n",
-              mysql_error(pMySQL), pTable->pSQL);
-            nRet = mysql_errno(pMySQL);
+         if(pFds[i].revents == 0 && (nPoll > 0 || pPolled[i]->nTimeout < 0))
+            continue;
+         if(AsyncStep(pPolled[i], AsyncGetReady(pPolled[i], pFds[i].revents)))
             goto ErrExit;
-            }
+         if(pPolled[i]->nState == ASYNC_STATE_DONE)
+            nActive--;
          }
+      }
 
-// Set types of columns.
-      if(pTable->lBatch == 0)
+   nRet = 0;
+   for(i = 0; i < nConns; i++)
+      PrintMsg(LOG_DEBUG, "Connection %d exported %d tables.\n", pConns[i].nId,
+        pConns[i].nTables);
+
+ErrExit:
+   if(nRet != 0)
+      {
+      g_bStop = TRUE;
+      for(i = 0; pAsync != NULL && i < nConns; i++)
          {
-         if((pTable->pCols = SetColsFromResult(pTable->pCols, &pTable->nCols,
-           pRes)) == NULL)
+         if(pConns[i].nRet != 0)
+            nRet = pConns[i].nRet;
+
+// End the tables that other connections were in the middle of.
+         if(pAsync[i].nState == ASYNC_STATE_QUERY
+           || pAsync[i].nState == ASYNC_STATE_RESULT)
             {
-            fprintf(stderr, "Memory allocation error.\n");
-            goto ErrExit;
+            if(pAsync[i].pRes != NULL)
+               mysql_free_result(pAsync[i].pRes);
+            pAsync[i].pRes = NULL;
+            ExportEnd(&pAsync[i].state, TRUE);
+            FinishTableExport(pAsync[i].pThr, pAsync[i].state.pTable, FALSE);
+            pAsync[i].nState = ASYNC_STATE_DONE;
             }
          }
+      }
 
-// Now, get the rows.
-      lBatchRows = 0;
-      while((pRow = mysql_fetch_row(pRes)) != NULL && !g_bStop)
-         {
-         bFirstCol = TRUE;
-
-// Set column values.
-         for(i = 0; i < pTable->nCols; i++)
-            {
-            if(!JSONCOL_FLAG_CHECK(&pTable->pCols[i], MYSQL))
-               continue;
+// The connections are closed here, as the export threads close theirs.
+   for(i = 0; i < nConns; i++)
+      {
+      if(pConns[i].pMySQL != NULL)
+         mysql_close(pConns[i].pMySQL);
+      pConns[i].pMySQL = NULL;
+      }
+   if(pAsync != NULL)
+      free(pAsync);
+   if(pPolled != NULL)
+      free(pPolled);
+   if(pFds != NULL)
+      free(pFds);
 
-// Save as next value to use for batching.
-            if(JSONCOL_FLAG_CHECK(&pTable->pCols[i], BATCH)
-              && pTable->lBatchSize > 0
-              && (lBatchRows + 1) == mysql_num_rows(pRes))
-               {
-               if(pTable->pCols[i].pPrevValue != NULL)
-                  free(pTable->pCols[i].pPrevValue);
-               if(pRow[pTable->pCols[i].nMySQLCol] == NULL)
-                  {
-                  fprintf(stderr,"Record %ld in table %s has batching column as NULL. Stopping.\n",
-                    pTable->lRows, pTable->pName);
-                  goto ErrExit;
-                  }
-               pTable->pCols[i].pPrevValue
-                 = strdup(pRow[pTable->pCols[i].nMySQLCol]);
-               }
+   return nRet;
+   } // End of ExportAsync()
 
-// Ignore skipped columns.
-            if(JSONCOL_FLAG_CHECK(&pTable->pCols[i], SKIP))
-               continue;
 
-// Set value of column.
-            if(pRow[pTable->pCols[i].nMySQLCol] == NULL)
-               pTable->pCols[i].nFlags |= JSONCOL_FLAG_NULL;
-            else
-               {
-               pTable->pCols[i].nFlags &= ~JSONCOL_FLAG_NULL;
-               pJSONBuf = json_escape(pRow[pTable->pCols[i].nMySQLCol], pJSONBuf, &nJSONBufSize);
-               if(pTable->pCols[i].pValue != NULL)
-                  free(pTable->pCols[i].pValue);
-               pTable->pCols[i].pValue = strdup(pJSONBuf);
-               }
-            }
-
-// Print the trailing CRLF and also a coma if exporting as an array.
-         if(pTable->lRows > 0)
-            fprintf(pTable->fd, "%s\n", g_bArrayFile ? "," : "");
-         fprintf(pTable->fd, "{");
-
-// Now, print columns.
-         for(i = 0; i < pTable->nCols; i++)
-            {
-// Skip NULL and empty values.
-            if(JSONCOL_FLAG_CHECK(&pTable->pCols[i], SKIP)
-              || (JSONCOL_FLAG_CHECK(&pTable->pCols[i], MYSQL) 
-                && ((JSONCOL_FLAG_CHECK(&pTable->pCols[i], NULL) && g_bSkipNull)
-                || (!JSONCOL_FLAG_CHECK(&pTable->pCols[i], NULL) && pTable->pCols[i].pValue[0] == '\0' && g_bSkipEmpty))))
-               continue;
+/*
+ * Function: AsyncStep()
+ * Move the export on a connection of the event loop forward, until it has
+ * to wait for the server or there are no more tables to export.
+ * Arguments:
+ * PASYNCCONN pAsync - The connection.
+ * int nReady - What the connection is ready for, as returned by
+ *   AsyncGetReady(), or 0 if the connection isn't waiting.
+ * Returns:
+ * BOOL - TRUE if there is an error, else FALSE.
+ */
+BOOL AsyncStep(PASYNCCONN pAsync, int nReady)
+   {
+   PTHREADDATA pThr = pAsync->pThr;
+   PJSONTABLE pTable = pAsync->state.pTable;
+   BOOL bDone;
+   int nStatus;
+   MYSQL_RES *pRes;
 
-// Print column name.
-            fprintf(pTable->fd, "%s\"%s\":", bFirstCol ? "" : ",", pTable->pCols[i].pJSONName);
+   for(;;)
+      {
+      switch(pAsync->nState)
+         {
+// Start the next table, if there is one.
+         case ASYNC_STATE_IDLE:
+            if(g_bStop || (pTable = GetNextTable(pThr)) == NULL)
+               {
+               pAsync->nState = ASYNC_STATE_DONE;
+               return FALSE;
+               }
+            PrintMsg(LOG_VERBOSE, "Connection %d exporting table %s part %d.\n",
+              pThr->nId, pTable->pName == NULL ? "(SQL)" : pTable->pName,
+              pTable->nPart);
+            if(OpenTableFile(pTable))
+               goto ErrExit;
+            if(ExportStart(&pAsync->state, pTable, FALSE, pThr->pMySQL, NULL))
+               {
+               ExportEnd(&pAsync->state, TRUE);
+               FinishTableExport(pThr, pTable, FALSE);
+               goto ErrExit;
+               }
+            pAsync->nState = ASYNC_STATE_QUERY;
+            break;
 
-// Print column value.
-            if(JSONCOL_FLAG_CHECK(&pTable->pCols[i], NULL))
-               fprintf(pTable->fd, "null");
-            else if(JSONCOL_FLAG_CHECK(&pTable->pCols[i], FIXEDNUMERIC))
+// Send the batch query.
+         case ASYNC_STATE_QUERY:
+            if(nReady == 0)
                {
-               if(JSONCOL_FLAG_CHECK(&pTable->pCols[i], QUOTED))
-                  fprintf(pTable->fd, "\"%ld\"", pTable->pCols[i].lValue);
-               else
-                  fprintf(pTable->fd, "%ld", pTable->pCols[i].lValue);
-               pTable->pCols[i].lValue += pTable->pCols[i].lIncr;
+               PrintMsg(LOG_DEBUG, "Stmt: Batch %ld (limit: %ld)\n  SQL: %s\n",
+                 pTable->lBatch, pAsync->state.lBatchLimit, pTable->pSQL);
+               if(g_bSizing)
+                  pAsync->state.llBatchStart = GetUsecs();
                }
-            else if(JSONCOL_FLAG_CHECK(&pTable->pCols[i], BOOL))
-               fprintf(pTable->fd, *(pTable->pCols[i].pValue) == '0' ? "false" : "true");
-            else if(JSONCOL_FLAG_CHECK(&pTable->pCols[i], QUOTED) || !JSONCOL_FLAG_CHECK(&pTable->pCols[i], NUMERIC))
+            if((nStatus = AsyncQuery(pAsync, nReady)) > 0)
+               return FALSE;
+            nReady = 0;
+            if(nStatus < 0)
                {
-               if(JSONCOL_FLAG_CHECK(&pTable->pCols[i], UNQUOTED))
-                  fprintf(pTable->fd, "%s", pTable->pCols[i].pValue);
-               else
-                  fprintf(pTable->fd, "\"%s\"", pTable->pCols[i].pValue);
+               fprintf(stderr, "MySQL Error:%s\nin:%s\n",
+                 mysql_error(pThr->pMySQL), pTable->pSQL);
+               pThr->nRet = mysql_errno(pThr->pMySQL);
+               goto ErrTable;
+               }
+            pAsync->nState = ASYNC_STATE_RESULT;
+            break;
+
+// Read the result and export the rows in it.
+         case ASYNC_STATE_RESULT:
+            if((nStatus = AsyncResult(pAsync, nReady)) > 0)
+               return FALSE;
+            nReady = 0;
+            if(nStatus < 0 || pAsync->pRes == NULL)
+               {
+               fprintf(stderr, "MySQL store results failed:\n%s\nin:%s\n",
+                 mysql_error(pThr->pMySQL), pTable->pSQL);
+               pThr->nRet = mysql_errno(pThr->pMySQL);
+               goto ErrTable;
+               }
+            pRes = pAsync->pRes;
+            pAsync->pRes = NULL;
+            bDone = FALSE;
+            if(ExportBatch(&pAsync->state, pRes, &bDone))
+               goto ErrTable;
+            if(!bDone && !g_bStop)
+               {
+               pAsync->nState = ASYNC_STATE_QUERY;
+               break;
                }
-            else if(JSONCOL_FLAG_CHECK(&pTable->pCols[i], NUMERIC))
-               fprintf(pTable->fd, "%s", pTable->pCols[i].pValue);
 
-            bFirstCol = FALSE;
-            }
-         fprintf(pTable->fd, "}");
-         pTable->lRows++;
-         lBatchRows++;
+// The table is done.
+            if(ExportEnd(&pAsync->state, FALSE))
+               {
+               FinishTableExport(pThr, pTable, FALSE);
+               goto ErrExit;
+               }
+            if(FinishTableExport(pThr, pTable, TRUE))
+               goto ErrExit;
+            pAsync->nState = ASYNC_STATE_IDLE;
+            break;
+
+         default:
+            return FALSE;
          }
-      mysql_free_result(pRes);
+      }
+
+ErrTable:
+   ExportEnd(&pAsync->state, TRUE);
+   FinishTableExport(pThr, pTable, FALSE);
+
+ErrExit:
+   if(pThr->nRet == 0)
+      pThr->nRet = -1;
+   pAsync->nState = ASYNC_STATE_DONE;
+   g_bStop = TRUE;
+   return TRUE;
+   } // End of AsyncStep()
+
+
+/*
+ * Function: AsyncQuery()
+ * Send the current batch query of a connection, without blocking.
+ * Arguments:
+ * PASYNCCONN pAsync - The connection.
+ * int nReady - What the connection is ready for, or 0 to start the query.
+ * Returns:
+ * int - 0 when the query is done, -1 if there is an error or > 0 if the
+ *   connection has to wait for the server.
+ */
+int AsyncQuery(PASYNCCONN pAsync, int nReady)
+   {
+#if defined(ASYNC_MARIADB)
+   MYSQL *pMySQL = pAsync->pThr->pMySQL;
+   char *pSQL = pAsync->state.pTable->pSQL;
+   int nErr;
+
+   if(nReady == 0)
+      pAsync->nWait = mysql_real_query_start(&nErr, pMySQL, pSQL, strlen(pSQL));
+   else
+      pAsync->nWait = mysql_real_query_cont(&nErr, pMySQL, nReady);
+   if(pAsync->nWait != 0)
+      return 1;
+   return nErr == 0 ? 0 : -1;
+#elif defined(ASYNC_MYSQL)
+   MYSQL *pMySQL = pAsync->pThr->pMySQL;
+   char *pSQL = pAsync->state.pTable->pSQL;
+   int nSendBuf;
+   socklen_t nLen = sizeof(nSendBuf);
+
+// The MySQL API doesn't tell what it is waiting for. A query that fits in the
+// socket send buffer is sent by the first call, after which the server is
+// waited for. A longer one may also wait to be written.
+   if(nReady == 0)
+      {
+      pAsync->nWait = POLLIN;
+      if(getsockopt(mysql_get_socket(pMySQL), SOL_SOCKET, SO_SNDBUF,
+        &nSendBuf, &nLen) != 0 || strlen(pSQL) >= (size_t) nSendBuf)
+         pAsync->nWait |= POLLOUT;
+      }
+   switch(mysql_real_query_nonblocking(pMySQL, pSQL, strlen(pSQL)))
+      {
+      case NET_ASYNC_COMPLETE:
+         return 0;
+      case NET_ASYNC_NOT_READY:
+         return 1;
+      default:
+         return -1;
+      }
+#else
+   return -1;
+#endif
+   } // End of AsyncQuery()
+
+
+/*
+ * Function: AsyncResult()
+ * Read the result of the batch query of a connection, without blocking.
+ * Arguments:
+ * PASYNCCONN pAsync - The connection. The result is set in this when done.
+ * int nReady - What the connection is ready for, or 0 to start reading.
+ * Returns:
+ * int - 0 when the result is read, -1 if there is an error or > 0 if the
+ *   connection has to wait for the server.
+ */
+int AsyncResult(PASYNCCONN pAsync, int nReady)
+   {
+#if defined(ASYNC_MARIADB)
+   MYSQL *pMySQL = pAsync->pThr->pMySQL;
+
+   if(nReady == 0)
+      pAsync->nWait = mysql_store_result_start(&pAsync->pRes, pMySQL);
+   else
+      pAsync->nWait = mysql_store_result_cont(&pAsync->pRes, pMySQL, nReady);
+   return pAsync->nWait != 0 ? 1 : 0;
+#elif defined(ASYNC_MYSQL)
+   MYSQL *pMySQL = pAsync->pThr->pMySQL;
+
+   switch(mysql_store_result_nonblocking(pMySQL, &pAsync->pRes))
+      {
+      case NET_ASYNC_COMPLETE:
+         return 0;
+      case NET_ASYNC_NOT_READY:
+         return 1;
+      default:
+         return -1;
+      }
+#else
+   return -1;
+#endif
+   } // End of AsyncResult()
+
+
+/*
+ * Function: AsyncGetPoll()
+ * Set up what to poll for on a connection that is waiting for the server.
+ * Arguments:
+ * PASYNCCONN pAsync - The connection. The poll timeout is set in this, -1
+ *   if there is none.
+ * struct pollfd *pFd - The poll entry to set up.
+ */
+void AsyncGetPoll(PASYNCCONN pAsync, struct pollfd *pFd)
+   {
+   pFd->revents = 0;
+#if defined(ASYNC_MARIADB) || defined(ASYNC_MYSQL)
+   pFd->fd = mysql_get_socket(pAsync->pThr->pMySQL);
+#else
+   pFd->fd = -1;
+#endif
+#if defined(ASYNC_MARIADB)
+   pFd->events = ((pAsync->nWait & MYSQL_WAIT_READ) ? POLLIN : 0)
+     | ((pAsync->nWait & MYSQL_WAIT_WRITE) ? POLLOUT : 0)
+     | ((pAsync->nWait & MYSQL_WAIT_EXCEPT) ? POLLPRI : 0);
+   pAsync->nTimeout = (pAsync->nWait & MYSQL_WAIT_TIMEOUT)
+     ? (int) mysql_get_timeout_value_ms(pAsync->pThr->pMySQL) : -1;
+#elif defined(ASYNC_MYSQL)
+// A query being sent is also polled for writing, a result only for data.
+   pFd->events = pAsync->nState == ASYNC_STATE_QUERY ? pAsync->nWait : POLLIN;
+   pAsync->nTimeout = -1;
+#else
+   pFd->events = 0;
+   pAsync->nTimeout = 0;
+#endif
+
+   return;
+   } // End of AsyncGetPoll()
+
+
+/*
+ * Function: AsyncGetReady()
+ * Get what a connection is ready for, from the result of poll().
+ * Arguments:
+ * PASYNCCONN pAsync - The connection.
+ * short nRevents - The returned poll events, 0 if the poll timed out.
+ * Returns:
+ * int - What the connection is ready for, as passed to AsyncQuery() and
+ *   AsyncResult(). Never 0.
+ */
+int AsyncGetReady(PASYNCCONN pAsync, short nRevents)
+   {
+#if defined(ASYNC_MARIADB)
+   int nReady = 0;
+
+   if(nRevents & (POLLIN | POLLHUP | POLLERR))
+      nReady |= MYSQL_WAIT_READ;
+   if(nRevents & POLLOUT)
+      nReady |= MYSQL_WAIT_WRITE;
+   if(nRevents & POLLPRI)
+      nReady |= MYSQL_WAIT_EXCEPT;
+
+   return nReady == 0 ? MYSQL_WAIT_TIMEOUT : nReady;
+#else
+   return nRevents == 0 ? 1 : nRevents;
+#endif
+   } // End of AsyncGetReady()
+
+
+/*
+ * Function: GetNextTable()
+ * Get the next table for a thread to export. This is the next table in the
+ * queue of the thread. If that is empty, the last table in the queue of
+ * another thread is taken, and if there is none, the key range of a table
+ * another thread is exporting is split. A table is taken and set as the
+ * table of the thread under the schedule lock, so that it can be split as
+ * soon as it is taken. A thread with nothing to split waits for threads that
+ * haven't started yet, as they may take a table that can be split.
+ * Arguments:
+ * PTHREADDATA pThr - The thread to get a table for.
+ * Returns:
+ * PJSONTABLE - The next table to export, NULL if there is nothing to do.
+ */
+PJSONTABLE GetNextTable(PTHREADDATA pThr)
+   {
+   PJSONTABLE pTable = NULL;
+   unsigned int i;
+
+// Take the next table in our own queue.
+   pthread_mutex_lock(&g_mtxSchedule);
+   pThr->bStarted = TRUE;
+   pthread_mutex_lock(&pThr->mtxQueue);
+   if(pThr->nQueueHead < pThr->nQueueTail)
+      pTable = pThr->pQueue[pThr->nQueueHead++];
+   pthread_mutex_unlock(&pThr->mtxQueue);
+
+// Steal a table from the end of another threads queue.
+   for(i = 0; pTable == NULL && i < g_nWorkers; i++)
+      {
+      if(&g_pWorkers[i] == pThr)
+         continue;
+      pthread_mutex_lock(&g_pWorkers[i].mtxQueue);
+      if(g_pWorkers[i].nQueueHead < g_pWorkers[i].nQueueTail)
+         pTable = g_pWorkers[i].pQueue[--g_pWorkers[i].nQueueTail];
+      pthread_mutex_unlock(&g_pWorkers[i].mtxQueue);
+      if(pTable != NULL)
+         {
+         PrintMsg(LOG_DEBUG, "Thread %d took table %s part %d from thread %d.\n",
+           pThr->nId, pTable->pName, pTable->nPart, g_pWorkers[i].nId);
+         pThr->nSteals++;
+         }
+      }
+
+   if(pTable != NULL)
+      pThr->pTable = pTable;
+   pthread_mutex_unlock(&g_mtxSchedule);
 
-      if(lBatchRows < lBatchLimit || pTable->lBatchSize == 0 || (g_lLimit > 0 && pTable->lRows >= g_lLimit))
+// If all queues are empty, split the work of another thread. The event loop
+// starts all connections at once, so there is no one to wait for there.
+   while(pTable == NULL && g_bSteal && g_nWorkers > 1 && !g_bStop
+     && (pTable = StealTableRange(pThr)) == NULL && g_nAsync == 0)
+      {
+      pthread_mutex_lock(&g_mtxSchedule);
+      for(i = 0; i < g_nWorkers && g_pWorkers[i].bStarted; i++)
+         ;
+      pthread_mutex_unlock(&g_mtxSchedule);
+      if(i >= g_nWorkers)
          break;
+      usleep(1000);
+      }
+
+   return pTable;
+   } // End of GetNextTable()
+
+
+/*
+ * Function: StealTableRange()
+ * Split the key range of the table part with the most keys left that
+ * another thread is exporting. The second half of the keys after the
+ * current batch cursor of that part is set up as a new part of the table
+ * which the calling thread is to export.
+ * Arguments:
+ * PTHREADDATA pThr - The thread to get a table part for.
+ * Returns:
+ * PJSONTABLE - The new table part, NULL if there is nothing to split.
+ */
+PJSONTABLE StealTableRange(PTHREADDATA pThr)
+   {
+   char szTmp[32];
+   unsigned int i;
+   unsigned long long llLeft;
+   unsigned long long llMaxLeft = 0;
+   unsigned long lBatchSize;
+   long long llCursor;
+   long long llEnd;
+   long long llMid;
+   PJSONTABLE pVictim = NULL;
+   PJSONTABLE pTable;
+   PJSONTABLE pPart = NULL;
+   PJSONTABLE *pParts;
+   char *pPrev = NULL;
+   char *pEnd = NULL;
+
+   pthread_mutex_lock(&g_mtxSchedule);
+
+// Find the part with the most keys left to export.
+   for(i = 0; i < g_nWorkers; i++)
+      {
+      if((pTable = g_pWorkers[i].pTable) == NULL || pTable->pParent == NULL
+        || !pTable->pParent->bIntRange)
+         continue;
 
-      lBatchLimit = (g_lLimit > 0 && (g_lLimit - pTable->lRows < pTable->lBatchSize || pTable->lBatchSize == 0)) ? g_lLimit - pTable->lRows : pTable->lBatchSize;
-      FormatSQL(pTable, lBatchLimit);
+      pthread_mutex_lock(&pTable->mtxRange);
+      llCursor = pTable->pBatchCol->pPrevValue == NULL
+        ? pTable->pParent->llKeyMin - 1
+        : strtoll(pTable->pBatchCol->pPrevValue, NULL, 10);
+      llEnd = pTable->pRangeEnd == NULL ? pTable->pParent->llKeyMax
+        : strtoll(pTable->pRangeEnd, NULL, 10);
+      lBatchSize = pTable->lBatchSize;
+      pthread_mutex_unlock(&pTable->mtxRange);
+
+// Only split a range with at least two batches worth of keys left.
+      llLeft = llEnd > llCursor ? (unsigned long long) llEnd
+        - (unsigned long long) llCursor : 0;
+      if(llLeft > 2 * (unsigned long long) lBatchSize && llLeft > llMaxLeft)
+         {
+         pVictim = pTable;
+         llMaxLeft = llLeft;
+         }
       }
 
-   pTable->tStop = g_bTiming ? time(NULL) : 0;
+   if(pVictim != NULL)
+      {
+      pTable = pVictim->pParent;
+      if((pPart = CloneTable(pTable)) == NULL
+        || (pParts = realloc(pTable->pParts,
+          (pTable->nParts + 1) * sizeof(PJSONTABLE))) == NULL)
+         {
+         if(pPart != NULL)
+            FreeTablePart(pPart);
+         pthread_mutex_unlock(&g_mtxSchedule);
+         return NULL;
+         }
+      pTable->pParts = pParts;
+
+// Split the keys after the cursor in two. The cursor may have moved since
+// we looked, but that is fine as long as there are keys left.
+      pthread_mutex_lock(&pVictim->mtxRange);
+      llCursor = pVictim->pBatchCol->pPrevValue == NULL
+        ? pTable->llKeyMin - 1
+        : strtoll(pVictim->pBatchCol->pPrevValue, NULL, 10);
+      llEnd = pVictim->pRangeEnd == NULL ? pTable->llKeyMax
+        : strtoll(pVictim->pRangeEnd, NULL, 10);
+      if(llEnd - llCursor > 1)
+         {
+         llMid = llCursor + (long long) (((unsigned long long) llEnd
+           - (unsigned long long) llCursor) / 2);
+         sprintf(szTmp, "%lld", llMid);
+
+// Both bounds are allocated before the victim is changed, so that it keeps
+// its whole range if that fails. The new part takes over the end of the
+// range, which may be open.
+         if((pPrev = strdup(szTmp)) == NULL || (pEnd = strdup(szTmp)) == NULL)
+            {
+            fprintf(stderr, "Memory allocation error.\n");
+            if(pPrev != NULL)
+               free(pPrev);
+            }
+         else
+            {
+            pPart->pBatchCol->pPrevValue = pPrev;
+            pPart->pRangeEnd = pVictim->pRangeEnd;
+            pVictim->pRangeEnd = pEnd;
+            }
+         }
+      pthread_mutex_unlock(&pVictim->mtxRange);
 
-// Write the trailing cr/lf and array indicator now.
-   fprintf(pTable->fd, "%s%s", pTable->lRows == 0 ? "" : "\n",
-     g_bArrayFile ? "]\n" : "");
-   return 0;
+      if(pPart->pBatchCol->pPrevValue == NULL)
+         {
+         FreeTablePart(pPart);
+         pthread_mutex_unlock(&g_mtxSchedule);
+         return NULL;
+         }
 
-ErrExit:
-   pTable->tStop = g_bTiming ? time(NULL) : 0;
-   g_bStop = TRUE;
-   return nRet;
-   } // End of ExportTable()
+// Add the new part after the part it was split from, to keep the parts in
+// key order.
+      for(i = pTable->nParts; i > 0 && pTable->pParts[i - 1] != pVictim; i--)
+         pTable->pParts[i] = pTable->pParts[i - 1];
+      pTable->pParts[i] = pPart;
+      pTable->nParts++;
+      pTable->nPartsLeft++;
+      pPart->nPart = pTable->nParts;
+      pPart->llDataLength = pVictim->llDataLength / 2;
+      pPart->llEstRows = pVictim->llEstRows / 2;
+      pThr->pTable = pPart;
+      pThr->nSteals++;
+
+      PrintMsg(LOG_DEBUG, "Thread %d split table %s part %d at key %s.\n",
+        pThr->nId, pTable->pName, pVictim->nPart, szTmp);
+      }
+   pthread_mutex_unlock(&g_mtxSchedule);
+
+   return pPart;
+   } // End of StealTableRange()
 
 
 /*
- * Function: PrintMsg()
- * Print a message to the current log.
+ * Function: DistributeTables()
+ * Hand out the tables to export to the queues of the threads. Each table is
+ * given to the thread with the smallest total size of tables so far, so if
+ * the tables are ordered largest first, this is a longest processing time
+ * first schedule.
  * Arguments:
- * unsigned int nLoglevel - Log level of message.
- * char *pFmt - Message format as defined by vprintf().
- * ... Any arguments as per pFmt.
+ * PJSONTABLE *pQueue - The tables to export, in the order to export them.
+ * unsigned int nQueue - The number of tables in pQueue.
+ * PTHREADDATA pThreads - The threads.
+ * unsigned int nThreads - The number of threads in pThreads.
  */
-void PrintMsg(unsigned int nLoglevel, char *pFmt, ...)
+void DistributeTables(PJSONTABLE *pQueue, unsigned int nQueue,
+  PTHREADDATA pThreads, unsigned int nThreads)
    {
-   struct tm tm;
-   time_t now;
-   va_list va;
+   unsigned int i;
+   unsigned int j;
+   unsigned int nThread;
 
-   time(&now);
-   localtime_r(&now, &tm);
+   for(i = 0; i < nQueue; i++)
+      {
+// Without sizes, just hand the tables out in turn.
+      nThread = i % nThreads;
+      if(g_nSchedule == SCHEDULE_LARGEST)
+         {
+         for(j = 0; j < nThreads; j++)
+            {
+            if(pThreads[j].llQueueCost < pThreads[nThread].llQueueCost)
+               nThread = j;
+            }
+         }
+      pThreads[nThread].pQueue[pThreads[nThread].nQueueTail++] = pQueue[i];
+      pThreads[nThread].llQueueCost += pQueue[i]->llDataLength;
+      }
 
-// Print to logfile, if one is specified, or stderr if not.
-   if(LOG_LEVEL(nLoglevel) <= g_nLoglevel)
+   return;
+   } // End of DistributeTables()
+
+
+/*
+ * Function: ConnectMySQL()
+ * Open a new connection to MySQL for exporting, using the export database
+ * and running the thread init statements.
+ * Returns:
+ * MYSQL * - The new connection, NULL if there is an error.
+ */
+MYSQL *ConnectMySQL(void)
+   {
+   MYSQL *pMySQL;
+   int i;
+
+   if((pMySQL = mysql_init(NULL)) == NULL)
       {
-      va_start(va, pFmt);
-      if(LOG_FLAG_CHECK(nLoglevel, STDOUT) && g_fdLog != stdout)
-         vprintf(pFmt, va);
+      fprintf(stderr, "Memory allocation error.\n");
+      return NULL;
+      }
+#ifdef ASYNC_MARIADB
+   if(g_nAsync > 0)
+      mysql_options(pMySQL, MYSQL_OPT_NONBLOCK, 0);
+#endif
 
-// Print date and time, unless requested not to.
-      va_start(va, pFmt);
-      if(!LOG_FLAG_CHECK(nLoglevel, NODATE))
-         fprintf(g_fdLog == NULL ? stderr : g_fdLog,
-           "%04d-%02d-%02d %02d:%02d:%02d ", 1900 + tm.tm_year,
-           tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec);
+// Connect to MYSQL.
+   if(mysql_real_connect(pMySQL, g_pHost, g_pUser, g_pPassword, g_pDatabase,
+     g_nPort, g_pSocket, CLIENT_COMPRESS) == NULL)
+      {
+      fprintf(stderr, "MySQL Connection failed:\n%s\n", mysql_error(pMySQL));
+      mysql_close(pMySQL);
+      return NULL;
+      }
 
-      vfprintf(g_fdLog == NULL ? stderr : g_fdLog, pFmt, va);
-      va_end(va);
-      if(g_fdLog != NULL && g_fdLog != stderr)
-         fflush(g_fdLog);
+// Run init statements.
+   for(i = 0; g_pSQLThreadInit != NULL && g_pSQLThreadInit[i] != NULL; i++)
+      {
+      PrintMsg(LOG_VERBOSE, "Running SQL Init:\n%s\n", g_pSQLThreadInit[i]);
+      if(mysql_query(pMySQL, g_pSQLThreadInit[i]) != 0)
+         {
+         PrintMsg(LOG_ERROR, "SQL Error %d\n%s\nin SQL Init statement:\n%s\n",
+           mysql_errno(pMySQL), mysql_error(pMySQL), g_pSQLThreadInit[i]);
+         if(g_bStopOnInitError)
+            {
+            mysql_close(pMySQL);
+            return NULL;
+            }
+         }
+      }
+
+// Set up UTF8.
+   if(g_bUTF8)
+      mysql_query(pMySQL, g_nUnicode == UNICODE_BYTES ? "SET NAMES utf8"
+        : "SET NAMES utf8mb4");
+
+   return pMySQL;
+   } // End of ConnectMySQL()
+
+
+/*
+ * Function: ConnectThread()
+ * Set up the connections of a thread. When running in parallel, each thread
+ * has a connection of its own, else the main connection is used. A second
+ * connection is opened for prefetching batches, if asked to, and a
+ * snapshot is started on both if a consistent snapshot is used.
+ * Arguments:
+ * PTHREADDATA pThr - The thread to connect.
+ * MYSQL *pMySQL - The main connection.
+ * Returns:
+ * BOOL - TRUE if there is an error, else FALSE.
+ */
+BOOL ConnectThread(PTHREADDATA pThr, MYSQL *pMySQL)
+   {
+   if(!g_bParallel)
+      pThr->pMySQL = pMySQL;
+   else if((pThr->pMySQL = ConnectMySQL()) == NULL)
+      return TRUE;
+   else if(g_nSnapshot != SNAPSHOT_NONE && StartSnapshot(pThr->pMySQL))
+      return TRUE;
+
+// Open the second connection for prefetching batches. This is not needed
+// with the event loop, where other connections run while one is formatted.
+   pThr->pMySQLPrefetch = NULL;
+   if(g_bPrefetch && (!g_bParallel || g_nAsync == 0))
+      {
+      if((pThr->pMySQLPrefetch = ConnectMySQL()) == NULL)
+         return TRUE;
+      if(g_nSnapshot != SNAPSHOT_NONE && StartSnapshot(pThr->pMySQLPrefetch))
+         return TRUE;
+      }
+
+   return FALSE;
+   } // End of ConnectThread()
+
+
+/*
+ * Function: StartSnapshot()
+ * Start a consistent snapshot transaction on a connection. All connections
+ * started while the snapshot lock is held read the same data. The backup
+ * lock doesn't block writes, so it is only used with a single connection to
+ * export on. Only transactional tables, such as InnoDB ones, are read from
+ * the snapshot.
+ * Arguments:
+ * MYSQL *pMySQL - The connection to start the snapshot on.
+ * Returns:
+ * BOOL - TRUE if there is an error, else FALSE.
+ */
+BOOL StartSnapshot(MYSQL *pMySQL)
+   {
+   if(RunSnapshotSQL(pMySQL,
+     "SET SESSION TRANSACTION ISOLATION LEVEL REPEATABLE READ")
+     || RunSnapshotSQL(pMySQL,
+     "START TRANSACTION /*!40100 WITH CONSISTENT SNAPSHOT */"))
+      return TRUE;
+
+   return FALSE;
+   } // End of StartSnapshot()
+
+
+/*
+ * Function: RunSnapshotSQL()
+ * Run a statement to set up a consistent snapshot.
+ * Arguments:
+ * MYSQL *pMySQL - The connection to use.
+ * char *pSQL - The statement to run.
+ * Returns:
+ * BOOL - TRUE if there is an error, else FALSE.
+ */
+BOOL RunSnapshotSQL(MYSQL *pMySQL, char *pSQL)
+   {
+   PrintMsg(LOG_VERBOSE, "Running snapshot SQL:\n%s\n", pSQL);
+   if(mysql_query(pMySQL, pSQL) != 0)
+      {
+      PrintMsg(LOG_ERROR, "SQL Error %d\n%s\nin snapshot statement:\n%s\n",
+        mysql_errno(pMySQL), mysql_error(pMySQL), pSQL);
+      return TRUE;
+      }
+
+   return FALSE;
+   } // End of RunSnapshotSQL()
+
+
+/*
+ * Function: GetDefaultThreads()
+ * Get the default number of export threads, which is the number of CPUs
+ * available to this process, taking a cgroup CPU quota into account.
+ * Returns:
+ * unsigned int - The number of threads to use, always at least 1.
+ */
+unsigned int GetDefaultThreads(void)
+   {
+   long nCPUs;
+   long long llQuota = -1;
+   long long llPeriod = 0;
+   char szQuota[32];
+   FILE *fd;
+
+   if((nCPUs = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+      nCPUs = 1;
+
+// Check for a cgroup v2 quota, which is in the format "<quota> <period>" or
+// "max <period>" if there is no quota.
+   if((fd = fopen("/sys/fs/cgroup/cpu.max", "r")) != NULL)
+      {
+      if(fscanf(fd, "%31s %lld", szQuota, &llPeriod) == 2
+        && strcmp(szQuota, "max") != 0)
+         llQuota = atoll(szQuota);
+      fclose(fd);
+      }
+// If not found, check for a cgroup v1 quota, where -1 means no quota.
+   else if((fd = fopen("/sys/fs/cgroup/cpu/cpu.cfs_quota_us", "r")) != NULL)
+      {
+      if(fscanf(fd, "%lld", &llQuota) != 1)
+         llQuota = -1;
+      fclose(fd);
+      if((fd = fopen("/sys/fs/cgroup/cpu/cpu.cfs_period_us", "r")) != NULL)
+         {
+         if(fscanf(fd, "%lld", &llPeriod) != 1)
+            llPeriod = 0;
+         fclose(fd);
+         }
+      }
+
+// Round the quota up to whole CPUs.
+   if(llQuota > 0 && llPeriod > 0 && (llQuota + llPeriod - 1) / llPeriod < nCPUs)
+      nCPUs = (llQuota + llPeriod - 1) / llPeriod;
+
+   return (unsigned int) nCPUs;
+   } // End of GetDefaultThreads()
+
+
+/*
+ * Function: OpenTableFile()
+ * Create and open the export file for a table.
+ * Arguments:
+ * PJSONTABLE pTable - The table to open the file for.
+ * Returns:
+ * BOOL - TRUE if there is an error, else FALSE.
+ */
+BOOL OpenTableFile(PJSONTABLE pTable)
+   {
+   char szFile[PATH_MAX + 1];
+
+   GetTableFileName(pTable, szFile);
+   if((pTable->fd = fopen(szFile, "w")) == NULL)
+      {
+      fprintf(stderr, "Error opening file %s.\n", szFile);
+      perror("File open error");
+      return TRUE;
+      }
+
+   return FALSE;
+   } // End of OpenTableFile()
+
+
+/*
+ * Function: GetTableFileName()
+ * Get the name of the export file of a table. The parts of a split table
+ * has the part number added to the name, except the first part when the
+ * parts are stitched together, as that is written to the table file.
+ * Arguments:
+ * PJSONTABLE pTable - The table to get the filename for.
+ * char *pFile - A buffer of PATH_MAX + 1 bytes to hold the filename.
+ */
+void GetTableFileName(PJSONTABLE pTable, char *pFile)
+   {
+   PJSONTABLE pBase = pTable->pParent == NULL ? pTable : pTable->pParent;
+   BOOL bPart = pTable->pParent != NULL
+     && (pTable->nPart > 1 || g_bSplitFiles);
+
+   if(g_pFile != NULL && !bPart)
+      strcpy(pFile, g_pFile);
+   else if(g_pFile != NULL)
+      sprintf(pFile, "%s.%d", g_pFile, pTable->nPart);
+   else if(!bPart)
+      sprintf(pFile, "%s/%s%s", g_pDirectory, pBase->pName, g_pExtension);
+   else
+      sprintf(pFile, "%s/%s.%d%s", g_pDirectory, pBase->pName, pTable->nPart,
+        g_pExtension);
+
+   return;
+   } // End of GetTableFileName()
+
+
+/*
+ * Function: SplitTable()
+ * Split a table that is batched on a single column into a number of key
+ * ranges. The MIN to MAX range of an integer key is divided evenly, unless
+ * the ranges are to be sampled, and the ranges of any other key are sampled
+ * from the index. Each range is set up as a part of the table, to be
+ * exported on its own. A table with no key is split by a hash of its
+ * columns, if asked to.
+ * Tables that can't be split are left as they are.
+ * Arguments:
+ * MYSQL *pMySQL - The MySQL Connection to use.
+ * PJSONTABLE pTable - The table to split.
+ * unsigned int nParts - The number of ranges to split the table into.
+ * Returns:
+ * BOOL - TRUE if there is an error, else FALSE.
+ */
+BOOL SplitTable(MYSQL *pMySQL, PJSONTABLE pTable, unsigned int nParts)
+   {
+   char szTmp[64];
+   char *pSQL;
+   char **pBounds = NULL;
+   unsigned int i;
+   BOOL bInt;
+   long long llMin = 0;
+   long long llMax = 0;
+   unsigned long long llStep = 0;
+   MYSQL_RES *pRes;
+   MYSQL_ROW pRow;
+   MYSQL_FIELD *pField;
+   PJSONTABLE pPart;
+   BOOL bKey;
+
+// A table with no key to batch on can only be split by hash, and only if it
+// has no primary or unique key at all, as it isn't batched.
+   if(pTable->pBatchCol == NULL && g_bSplitHash && nParts > 1)
+      {
+      if(TableHasKey(pMySQL, pTable, &bKey))
+         return TRUE;
+      return bKey ? FALSE : SplitTableHash(pTable, nParts);
+      }
+
+// Only tables batched on a single column can be split, and there is no
+// point in splitting a table that is exported in a single batch. A table
+// with no estimate of its rows, as a newly loaded one, is counted.
+   if(pTable->pBatchCol == NULL || pTable->nKeyCols > 1
+     || pTable->lBatchSize == 0)
+      return FALSE;
+   if(pTable->llDataLength > 0 && pTable->llEstRows == 0
+     && CountTableRows(pMySQL, pTable))
+      return TRUE;
+   if(pTable->llDataLength > 0 && pTable->llEstRows <= pTable->lBatchSize)
+      return FALSE;
+
+// Incrementing columns would be numbered in each part.
+   for(i = 0; i < pTable->nCols; i++)
+      {
+      if(pTable->pCols[i].lIncr != 0)
+         return FALSE;
+      }
+
+// Get the key range of the table.
+   if((pSQL = malloc(strlen(pTable->pBatchCol->pName) * 2
+     + strlen(pTable->pName) + (g_pSQLWhereSuffix == NULL ? 0
+     : strlen(g_pSQLWhereSuffix)) + 48)) == NULL)
+      {
+      fprintf(stderr, "Memory allocation error.\n");
+      return TRUE;
+      }
+   sprintf(pSQL, "SELECT MIN(`%s`), MAX(`%s`) FROM `%s`%s%s",
+     pTable->pBatchCol->pName, pTable->pBatchCol->pName, pTable->pName,
+     g_pSQLWhereSuffix == NULL ? "" : " WHERE ",
+     g_pSQLWhereSuffix == NULL ? "" : g_pSQLWhereSuffix);
+   PrintMsg(LOG_DEBUG, "Key range SQL: %s\n", pSQL);
+   if(mysql_query(pMySQL, pSQL) != 0)
+      {
+      fprintf(stderr, "MySQL Error:%s\nin:%s\n", mysql_error(pMySQL), pSQL);
+      free(pSQL);
+      return TRUE;
+      }
+   free(pSQL);
+   if((pRes = mysql_store_result(pMySQL)) == NULL)
+      {
+      fprintf(stderr, "MySQL store results failed:\n%s\n", mysql_error(pMySQL));
+      return TRUE;
+      }
+
+// Check that the table isn't empty and if the key is an integer.
+   pField = mysql_fetch_fields(pRes);
+   bInt = pField->type == MYSQL_TYPE_TINY || pField->type == MYSQL_TYPE_SHORT
+     || pField->type == MYSQL_TYPE_LONG || pField->type == MYSQL_TYPE_INT24
+     || pField->type == MYSQL_TYPE_LONGLONG;
+   if((pRow = mysql_fetch_row(pRes)) == NULL
+     || pRow[0] == NULL || pRow[1] == NULL)
+      {
+      PrintMsg(LOG_VERBOSE, "Table %s is not split, no key range.\n",
+        pTable->pName);
+      mysql_free_result(pRes);
+      return FALSE;
+      }
+
+   errno = 0;
+   if(bInt)
+      {
+      llMin = strtoll(pRow[0], NULL, 10);
+      llMax = strtoll(pRow[1], NULL, 10);
+      }
+   mysql_free_result(pRes);
+   if(errno == ERANGE)
+      return FALSE;
+
+// Sample the ranges of a key that isn't an integer, or if asked to. Only
+// integer ranges may be split by other threads later, so there is nothing
+// to do for other keys unless the table is split now.
+   if((!bInt || g_nSplitPlan == SPLIT_PLAN_SAMPLE) && nParts > 1
+     && (pBounds = SampleKeyBounds(pMySQL, pTable, &nParts)) == NULL)
+      return TRUE;
+   if(!bInt && pBounds == NULL)
+      {
+      PrintMsg(LOG_VERBOSE, "Table %s is not split, no integer key range.\n",
+        pTable->pName);
+      return FALSE;
+      }
+
+// Compute the size of each range, there is no point in a range with no keys.
+   if(pBounds == NULL
+     && (unsigned long long) llMax - (unsigned long long) llMin + 1 < nParts)
+      nParts = (unsigned int) ((unsigned long long) llMax
+        - (unsigned long long) llMin + 1);
+   if(nParts < 2 && (!bInt || !g_bSteal))
+      {
+      if(pBounds != NULL)
+         free(pBounds);
+      return FALSE;
+      }
+   if(pBounds == NULL)
+      llStep = ((unsigned long long) llMax - (unsigned long long) llMin) / nParts + 1;
+
+   if((pTable->pParts = calloc(nParts, sizeof(PJSONTABLE))) == NULL)
+      {
+      fprintf(stderr, "Memory allocation error.\n");
+      return TRUE;
+      }
+
+// Set up the parts. The first part has no lower bound and the last no upper
+// bound, the batching starts after the end of the previous part.
+   for(i = 0; i < nParts; i++)
+      {
+      if((pPart = CloneTable(pTable)) == NULL)
+         return TRUE;
+      pPart->nPart = i + 1;
+      pPart->llDataLength = pTable->llDataLength / nParts;
+      pPart->llEstRows = pTable->llEstRows / nParts;
+      if(i > 0 && pBounds != NULL)
+         pPart->pBatchCol->pPrevValue = pBounds[i - 1];
+      else if(i > 0)
+         {
+         sprintf(szTmp, "%lld",
+           (long long) ((unsigned long long) llMin + llStep * i - 1));
+         pPart->pBatchCol->pPrevValue = strdup(szTmp);
+         }
+      if(i < nParts - 1 && pBounds != NULL)
+         pPart->pRangeEnd = strdup(pBounds[i]);
+      else if(i < nParts - 1)
+         {
+         sprintf(szTmp, "%lld",
+           (long long) ((unsigned long long) llMin + llStep * (i + 1) - 1));
+         pPart->pRangeEnd = strdup(szTmp);
+         }
+      if((i > 0 && pPart->pBatchCol->pPrevValue == NULL)
+        || (i < nParts - 1 && pPart->pRangeEnd == NULL))
+         {
+         fprintf(stderr, "Memory allocation error.\n");
+         return TRUE;
+         }
+      pTable->pParts[i] = pPart;
+      }
+   pTable->nParts = pTable->nPartsLeft = nParts;
+   pTable->bIntRange = bInt;
+   pTable->llKeyMin = llMin;
+   pTable->llKeyMax = llMax;
+   if(pBounds != NULL)
+      {
+      free(pBounds);
+      PrintMsg(LOG_VERBOSE, "Table %s split into %d parts sampled from the key index.\n",
+        pTable->pName, nParts);
+      }
+   else
+      PrintMsg(LOG_VERBOSE, "Table %s split into %d parts from %lld to %lld.\n",
+        pTable->pName, nParts, llMin, llMax);
+
+   return FALSE;
+   } // End of SplitTable()
+
+
+/*
+ * Function: SampleKeyBounds()
+ * Find the ends of key ranges with about the same number of rows, by reading
+ * the batch column at evenly spaced offsets in its index. The rows are
+ * counted first, as the estimate from information_schema may be far off and
+ * an underestimate would put most rows in the last range. Reading at the
+ * offsets scans that many index entries anyway.
+ * Arguments:
+ * MYSQL *pMySQL - The MySQL Connection to use.
+ * PJSONTABLE pTable - The table to sample.
+ * unsigned int *pnParts - The number of ranges wanted, set to the number of
+ *   ranges found.
+ * Returns:
+ * char ** - The last key of each range but the last, NULL if there is an
+ *   error.
+ */
+char **SampleKeyBounds(MYSQL *pMySQL, PJSONTABLE pTable, unsigned int *pnParts)
+   {
+   char **pBounds;
+   char *pSQL = NULL;
+   char *pOffset;
+   unsigned int nParts = *pnParts;
+   unsigned int i;
+   unsigned long long llRows;
+   MYSQL_RES *pRes;
+   MYSQL_ROW pRow;
+
+   if(CountTableRows(pMySQL, pTable))
+      return NULL;
+   llRows = pTable->llEstRows;
+   if(llRows < nParts)
+      nParts = (unsigned int) llRows;
+   *pnParts = 1;
+   if((pBounds = calloc(nParts > 1 ? nParts - 1 : 1, sizeof(char *))) == NULL
+     || (pSQL = malloc(strlen(pTable->pBatchCol->pName) * 2
+     + strlen(pTable->pName) + (g_pSQLWhereSuffix == NULL ? 0
+     : strlen(g_pSQLWhereSuffix)) + 80)) == NULL)
+      {
+      fprintf(stderr, "Memory allocation error.\n");
+      goto ErrExit;
+      }
+   sprintf(pSQL, "SELECT `%s` FROM `%s`%s%s ORDER BY `%s` LIMIT 1 OFFSET ",
+     pTable->pBatchCol->pName, pTable->pName,
+     g_pSQLWhereSuffix == NULL ? "" : " WHERE ",
+     g_pSQLWhereSuffix == NULL ? "" : g_pSQLWhereSuffix,
+     pTable->pBatchCol->pName);
+   pOffset = &pSQL[strlen(pSQL)];
+
+// Dive into the index for the last key of each range.
+   for(i = 1; i < nParts; i++)
+      {
+      sprintf(pOffset, "%llu", llRows * i / nParts - 1);
+      PrintMsg(LOG_DEBUG, "Key sample SQL: %s\n", pSQL);
+      if(mysql_query(pMySQL, pSQL) != 0
+        || (pRes = mysql_store_result(pMySQL)) == NULL)
+         {
+         fprintf(stderr, "MySQL Error:%s\nin:%s\n", mysql_error(pMySQL), pSQL);
+         goto ErrExit;
+         }
+
+// There are fewer rows than estimated, if this is past the end.
+      if((pRow = mysql_fetch_row(pRes)) == NULL || pRow[0] == NULL)
+         {
+         mysql_free_result(pRes);
+         break;
+         }
+      pBounds[i - 1] = strdup(pRow[0]);
+      mysql_free_result(pRes);
+      if(pBounds[i - 1] == NULL)
+         {
+         fprintf(stderr, "Memory allocation error.\n");
+         goto ErrExit;
+         }
+      *pnParts = i + 1;
+      }
+   free(pSQL);
+
+   return pBounds;
+
+ErrExit:
+   if(pBounds != NULL)
+      {
+      for(i = 0; i + 1 < nParts; i++)
+         free(pBounds[i]);
+      free(pBounds);
+      }
+   if(pSQL != NULL)
+      free(pSQL);
+   return NULL;
+   } // End of SampleKeyBounds()
+
+
+/*
+ * Function: CountTableRows()
+ * Count the rows of a table, for when the estimate from information_schema
+ * is missing or can't be trusted. The count is set as the estimated rows of
+ * the table.
+ * Arguments:
+ * MYSQL *pMySQL - The MySQL Connection to use.
+ * PJSONTABLE pTable - The table to count.
+ * Returns:
+ * BOOL - TRUE if there is an error, else FALSE.
+ */
+BOOL CountTableRows(MYSQL *pMySQL, PJSONTABLE pTable)
+   {
+   char *pSQL;
+   MYSQL_RES *pRes;
+   MYSQL_ROW pRow;
+
+   if((pSQL = malloc(strlen(pTable->pName) + (g_pSQLWhereSuffix == NULL ? 0
+     : strlen(g_pSQLWhereSuffix)) + 40)) == NULL)
+      {
+      fprintf(stderr, "Memory allocation error.\n");
+      return TRUE;
+      }
+   sprintf(pSQL, "SELECT COUNT(*) FROM `%s`%s%s", pTable->pName,
+     g_pSQLWhereSuffix == NULL ? "" : " WHERE ",
+     g_pSQLWhereSuffix == NULL ? "" : g_pSQLWhereSuffix);
+   PrintMsg(LOG_DEBUG, "Row count SQL: %s\n", pSQL);
+   if(mysql_query(pMySQL, pSQL) != 0
+     || (pRes = mysql_store_result(pMySQL)) == NULL)
+      {
+      fprintf(stderr, "MySQL Error:%s\nin:%s\n", mysql_error(pMySQL), pSQL);
+      free(pSQL);
+      return TRUE;
+      }
+   free(pSQL);
+   if((pRow = mysql_fetch_row(pRes)) != NULL && pRow[0] != NULL)
+      pTable->llEstRows = strtoull(pRow[0], NULL, 10);
+   mysql_free_result(pRes);
+
+   return FALSE;
+   } // End of CountTableRows()
+
+
+/*
+ * Function: TableHasKey()
+ * Check if a table has a primary key or a unique index. The key columns are
+ * only flagged when the table is batched, so information_schema is asked
+ * if none are.
+ * Arguments:
+ * MYSQL *pMySQL - The MySQL Connection to use.
+ * PJSONTABLE pTable - The table to check.
+ * BOOL *pbKey - Set to TRUE if the table has a key, else FALSE.
+ * Returns:
+ * BOOL - TRUE if there is an error, else FALSE.
+ */
+BOOL TableHasKey(MYSQL *pMySQL, PJSONTABLE pTable, BOOL *pbKey)
+   {
+   char *pSQL;
+   MYSQL_RES *pRes;
+   unsigned int i;
+
+   *pbKey = FALSE;
+   for(i = 0; i < pTable->nCols; i++)
+      {
+      if(JSONCOL_FLAG_CHECK(&pTable->pCols[i], PK)
+        || JSONCOL_FLAG_CHECK(&pTable->pCols[i], UKEY))
+         {
+         *pbKey = TRUE;
+         return FALSE;
+         }
+      }
+
+   if((pSQL = malloc((strlen(g_pDatabase) + strlen(pTable->pName)) * 2
+     + 160)) == NULL)
+      {
+      fprintf(stderr, "Memory allocation error.\n");
+      return TRUE;
+      }
+   strcpy(pSQL, "SELECT 1 FROM information_schema.STATISTICS"
+     " WHERE NON_UNIQUE = 0 AND TABLE_SCHEMA = '");
+   mysql_real_escape_string(pMySQL, &pSQL[strlen(pSQL)], g_pDatabase,
+     strlen(g_pDatabase));
+   strcat(pSQL, "' AND TABLE_NAME = '");
+   mysql_real_escape_string(pMySQL, &pSQL[strlen(pSQL)], pTable->pName,
+     strlen(pTable->pName));
+   strcat(pSQL, "' LIMIT 1");
+
+   PrintMsg(LOG_DEBUG, "Unique key SQL: %s\n", pSQL);
+   if(mysql_query(pMySQL, pSQL) != 0
+     || (pRes = mysql_store_result(pMySQL)) == NULL)
+      {
+      fprintf(stderr, "MySQL Error:%s\nin:%s\n", mysql_error(pMySQL), pSQL);
+      free(pSQL);
+      return TRUE;
+      }
+   free(pSQL);
+   *pbKey = mysql_num_rows(pRes) > 0;
+   mysql_free_result(pRes);
+
+   return FALSE;
+   } // End of TableHasKey()
+
+
+/*
+ * Function: SplitTableHash()
+ * Split a table with no key into parts by a hash of the selected columns,
+ * as "CRC32(CONCAT_WS('|', <col 1>, ...)) % <parts> = <part - 1>". Each part
+ * is a scan of the whole table, so this trades server CPU for exporting the
+ * table on more than one thread with less memory each.
+ * Arguments:
+ * PJSONTABLE pTable - The table to split.
+ * unsigned int nParts - The number of parts to split the table into.
+ * Returns:
+ * BOOL - TRUE if there is an error, else FALSE.
+ */
+BOOL SplitTableHash(PJSONTABLE pTable, unsigned int nParts)
+   {
+   unsigned int nLen;
+   unsigned int i;
+   PJSONTABLE pPart;
+
+// There is no point in splitting a table that fits in a single batch, and
+// incrementing columns would be numbered in each part.
+   if(g_lBatchSize > 0 && pTable->llDataLength > 0
+     && pTable->llEstRows <= g_lBatchSize)
+      return FALSE;
+   for(i = 0; i < pTable->nCols; i++)
+      {
+      if(pTable->pCols[i].lIncr != 0)
+         return FALSE;
+      }
+
+// CRC32(CONCAT_WS('|',<space>`<column name>`,<space>...))<space>%<space><parts><space>=<space>
+   nLen = 50;
+   for(i = 0; i < pTable->nCols; i++)
+      {
+      if(JSONCOL_FLAG_CHECK(&pTable->pCols[i], MYSQL)
+        && (JSONCOL_FLAG_CHECK(&pTable->pCols[i], BATCH)
+        || !JSONCOL_FLAG_CHECK(&pTable->pCols[i], SKIP)))
+         nLen += strlen(pTable->pCols[i].pName) + 4;
+      }
+   if((pTable->pHashExpr = malloc(nLen + 1)) == NULL)
+      {
+      fprintf(stderr, "Memory allocation error.\n");
+      return TRUE;
+      }
+   strcpy(pTable->pHashExpr, "CRC32(CONCAT_WS('|'");
+   for(i = 0; i < pTable->nCols; i++)
+      {
+      if(JSONCOL_FLAG_CHECK(&pTable->pCols[i], MYSQL)
+        && (JSONCOL_FLAG_CHECK(&pTable->pCols[i], BATCH)
+        || !JSONCOL_FLAG_CHECK(&pTable->pCols[i], SKIP)))
+         sprintf(&pTable->pHashExpr[strlen(pTable->pHashExpr)], ", `%s`",
+           pTable->pCols[i].pName);
+      }
+   sprintf(&pTable->pHashExpr[strlen(pTable->pHashExpr)], ")) %% %u = ",
+     nParts);
+
+   if((pTable->pParts = calloc(nParts, sizeof(PJSONTABLE))) == NULL)
+      {
+      fprintf(stderr, "Memory allocation error.\n");
+      return TRUE;
+      }
+   for(i = 0; i < nParts; i++)
+      {
+      if((pPart = CloneTable(pTable)) == NULL)
+         return TRUE;
+      pPart->nPart = i + 1;
+      pPart->llDataLength = pTable->llDataLength / nParts;
+      pPart->llEstRows = pTable->llEstRows / nParts;
+      pTable->pParts[i] = pPart;
+      }
+   pTable->nParts = pTable->nPartsLeft = nParts;
+   PrintMsg(LOG_VERBOSE, "Table %s split into %d parts by hash.\n",
+     pTable->pName, nParts);
+
+   return FALSE;
+   } // End of SplitTableHash()
+
+
+/*
+ * Function: GetTableSizes()
+ * Get the data length and estimated number of rows of the tables to export
+ * from information_schema, using a single query for all tables.
+ * Arguments:
+ * MYSQL *pMySQL - The MySQL Connection to use.
+ * PJSONTABLE pTables - The tables to get the size for.
+ * unsigned int nTables - The number of tables in pTables.
+ * Returns:
+ * BOOL - TRUE if there is an error, else FALSE.
+ */
+BOOL GetTableSizes(MYSQL *pMySQL, PJSONTABLE pTables, unsigned int nTables)
+   {
+   char *pSQL;
+   unsigned int i;
+   MYSQL_RES *pRes;
+   MYSQL_ROW pRow;
+
+   if((pSQL = malloc(strlen(g_pDatabase) * 2 + 128)) == NULL)
+      {
+      fprintf(stderr, "Memory allocation error.\n");
+      return TRUE;
+      }
+// MySQL 8 caches the table statistics in information_schema, get them from
+// the storage engine instead.
+   if(mysql_query(pMySQL,
+     "/*!80000 SET SESSION information_schema_stats_expiry = 0 */") != 0)
+      PrintMsg(LOG_VERBOSE, "Table statistics may be cached: %s\n",
+        mysql_error(pMySQL));
+
+   strcpy(pSQL, "SELECT TABLE_NAME, DATA_LENGTH, TABLE_ROWS"
+     " FROM information_schema.TABLES WHERE TABLE_SCHEMA = '");
+   mysql_real_escape_string(pMySQL, &pSQL[strlen(pSQL)], g_pDatabase,
+     strlen(g_pDatabase));
+   strcat(pSQL, "'");
+
+   PrintMsg(LOG_DEBUG, "Table size SQL: %s\n", pSQL);
+   if(mysql_query(pMySQL, pSQL) != 0)
+      {
+      fprintf(stderr, "MySQL Error:%s\nin:%s\n", mysql_error(pMySQL), pSQL);
+      free(pSQL);
+      return TRUE;
+      }
+   free(pSQL);
+   if((pRes = mysql_store_result(pMySQL)) == NULL)
+      {
+      fprintf(stderr, "MySQL store results failed:\n%s\n", mysql_error(pMySQL));
+      return TRUE;
+      }
+
+   while((pRow = mysql_fetch_row(pRes)) != NULL)
+      {
+      for(i = 0; i < nTables; i++)
+         {
+         if(pTables[i].pName != NULL && strcasecmp(pTables[i].pName, pRow[0]) == 0)
+            {
+            pTables[i].llDataLength = pRow[1] == NULL ? 0 : strtoull(pRow[1], NULL, 10);
+            pTables[i].llEstRows = pRow[2] == NULL ? 0 : strtoull(pRow[2], NULL, 10);
+            break;
+            }
+         }
+      }
+   mysql_free_result(pRes);
+
+   return FALSE;
+   } // End of GetTableSizes()
+
+
+/*
+ * Function: CompareTableCost()
+ * Compare the size of two tables for sorting with qsort(), largest first.
+ * Tables of the same size are kept in name and part order.
+ * Arguments:
+ * const void *p1 - Pointer to the first PJSONTABLE.
+ * const void *p2 - Pointer to the second PJSONTABLE.
+ * Returns:
+ * int - Less than, equal to or greater than 0 as p1 should be before, is the
+ *   same as or should be after p2.
+ */
+int CompareTableCost(const void *p1, const void *p2)
+   {
+   PJSONTABLE pTable1 = *(PJSONTABLE *) p1;
+   PJSONTABLE pTable2 = *(PJSONTABLE *) p2;
+   int nRet;
+
+   if(pTable1->llDataLength != pTable2->llDataLength)
+      return pTable1->llDataLength > pTable2->llDataLength ? -1 : 1;
+   if(pTable1->llEstRows != pTable2->llEstRows)
+      return pTable1->llEstRows > pTable2->llEstRows ? -1 : 1;
+   if(pTable1->pName != NULL && pTable2->pName != NULL
+     && (nRet = strcmp(pTable1->pName, pTable2->pName)) != 0)
+      return nRet;
+
+   return (int) pTable1->nPart - (int) pTable2->nPart;
+   } // End of CompareTableCost()
+
+
+/*
+ * Function: CloneTable()
+ * Create a copy of a table to be used as a part of it. The part has columns
+ * of its own, as these hold the state of the export, but share the column
+ * names and SQL format with the table.
+ * Arguments:
+ * PJSONTABLE pTable - The table to clone.
+ * Returns:
+ * PJSONTABLE - The new table part, NULL if there is an error.
+ */
+PJSONTABLE CloneTable(PJSONTABLE pTable)
+   {
+   PJSONTABLE pPart;
+   unsigned int i;
+
+   if((pPart = malloc(sizeof(JSONTABLE))) == NULL)
+      {
+      fprintf(stderr, "Memory allocation error.\n");
+      return NULL;
+      }
+   if((pPart->pCols = calloc(pTable->nCols, sizeof(JSONCOL))) == NULL)
+      {
+      fprintf(stderr, "Memory allocation error.\n");
+      free(pPart);
+      return NULL;
+      }
+   memcpy(pPart->pCols, pTable->pCols, pTable->nCols * sizeof(JSONCOL));
+   pPart->fd = NULL;
+   pPart->tStart = pPart->tStop = 0;
+   pPart->pName = pTable->pName;
+   pPart->pJSONName = pTable->pJSONName;
+   pPart->nCols = pTable->nCols;
+   pPart->pBatchCol = pTable->pBatchCol == NULL ? NULL
+     : &pPart->pCols[pTable->pBatchCol - pTable->pCols];
+   for(i = 0; i < pTable->nKeyCols; i++)
+      {
+      pPart->pKeyCols[i] = &pPart->pCols[pTable->pKeyCols[i] - pTable->pCols];
+      pPart->pKeyCols[i]->pPrevValue = NULL;
+      pPart->pKeyCols[i]->nPrevValueSize = 0;
+      }
+   pPart->nKeyCols = pTable->nKeyCols;
+   pPart->pKeyIndex = pTable->pKeyIndex;
+   pPart->pHashExpr = pTable->pHashExpr;
+   pPart->pSQLFormat = pTable->pSQLFormat;
+   pPart->pSQL = NULL;
+   pPart->nSQLBufLen = 0;
+   pPart->lBatchSize = pTable->lBatchSize;
+   pPart->lSizeMin = pPart->lSizeMax = 0;
+   pPart->lBatch = 0;
+   pPart->lRows = 0;
+   pPart->pRangeEnd = NULL;
+   pPart->llDataLength = pTable->llDataLength;
+   pPart->llEstRows = pTable->llEstRows;
+   pPart->bIntRange = FALSE;
+   pPart->llKeyMin = pPart->llKeyMax = 0;
+   pthread_mutex_init(&pPart->mtxRange, NULL);
+   memset(&pPart->statRows, 0, sizeof(PIPESTATS));
+   memset(&pPart->statOut, 0, sizeof(PIPESTATS));
+   pPart->llFormatBytes = pPart->llFormatUsecs = 0;
+   pPart->pParent = pTable;
+   pPart->pParts = NULL;
+   pPart->nParts = 0;
+   pPart->nPartsLeft = 0;
+   pPart->nPart = 0;
+   pPart->pOps = NULL;
+   pPart->nOps = 0;
+
+   return pPart;
+   } // End of CloneTable()
+
+
+/*
+ * Function: FreeTablePart()
+ * Free a table part from CloneTable() that was never exported. The column
+ * names and values are shared with the table and are left alone.
+ * Arguments:
+ * PJSONTABLE pPart - The table part to free.
+ */
+void FreeTablePart(PJSONTABLE pPart)
+   {
+   pthread_mutex_destroy(&pPart->mtxRange);
+   free(pPart->pCols);
+   free(pPart);
+   } // End of FreeTablePart()
+
+
+/*
+ * Function: FinishTablePart()
+ * Register that a part of a split table has been exported. When the last
+ * part is done, the statistics for the table is set and the part files are
+ * stitched together, unless they are to be kept.
+ * Arguments:
+ * PJSONTABLE pPart - The exported table part.
+ * Returns:
+ * BOOL - TRUE if there is an error, else FALSE.
+ */
+BOOL FinishTablePart(PJSONTABLE pPart)
+   {
+   PJSONTABLE pTable = pPart->pParent;
+   unsigned int i;
+   unsigned int nLeft;
+
+   pthread_mutex_lock(&g_mtxSchedule);
+   nLeft = --pTable->nPartsLeft;
+   pthread_mutex_unlock(&g_mtxSchedule);
+   if(nLeft > 0)
+      return FALSE;
+
+// Sum up the statistics of all parts.
+   pTable->lRows = 0;
+   pTable->lBatch = 0;
+   pTable->tStart = pTable->pParts[0]->tStart;
+   pTable->tStop = pTable->pParts[0]->tStop;
+   for(i = 0; i < pTable->nParts; i++)
+      {
+      pTable->lRows += pTable->pParts[i]->lRows;
+      pTable->lBatch += pTable->pParts[i]->lBatch + (i > 0 ? 1 : 0);
+      if(pTable->pParts[i]->tStart < pTable->tStart)
+         pTable->tStart = pTable->pParts[i]->tStart;
+      if(pTable->pParts[i]->tStop > pTable->tStop)
+         pTable->tStop = pTable->pParts[i]->tStop;
+      AddPipeStats(&pTable->statRows, &pTable->pParts[i]->statRows);
+      AddPipeStats(&pTable->statOut, &pTable->pParts[i]->statOut);
+      pTable->llFormatBytes += pTable->pParts[i]->llFormatBytes;
+      pTable->llFormatUsecs += pTable->pParts[i]->llFormatUsecs;
+      if(pTable->lSizeMin == 0 || (pTable->pParts[i]->lSizeMin > 0
+        && pTable->pParts[i]->lSizeMin < pTable->lSizeMin))
+         pTable->lSizeMin = pTable->pParts[i]->lSizeMin;
+      if(pTable->pParts[i]->lSizeMax > pTable->lSizeMax)
+         pTable->lSizeMax = pTable->pParts[i]->lSizeMax;
+      }
+
+   if(g_bSplitFiles)
+      return FALSE;
+
+   return StitchTableParts(pTable);
+   } // End of FinishTablePart()
+
+
+/*
+ * Function: StitchTableParts()
+ * Append the part files of a split table, in key order, to the export file
+ * of the table, which already has the rows of the first part, and then
+ * remove the part files.
+ * Arguments:
+ * PJSONTABLE pTable - The table to stitch together.
+ * Returns:
+ * BOOL - TRUE if there is an error, else FALSE.
+ */
+BOOL StitchTableParts(PJSONTABLE pTable)
+   {
+   char szFile[PATH_MAX + 1];
+   char szBuf[65536];
+   unsigned int i;
+   size_t nRead;
+   BOOL bFirst;
+   FILE *fdPart;
+
+   GetTableFileName(pTable, szFile);
+   if((pTable->fd = fopen(szFile, "a")) == NULL)
+      {
+      fprintf(stderr, "Error opening file %s.\n", szFile);
+      perror("File open error");
+      return TRUE;
+      }
+
+   bFirst = pTable->pParts[0]->lRows == 0;
+   for(i = 1; i < pTable->nParts; i++)
+      {
+      GetTableFileName(pTable->pParts[i], szFile);
+
+// Parts without rows are just removed.
+      if(pTable->pParts[i]->lRows > 0)
+         {
+         if((fdPart = fopen(szFile, "r")) == NULL)
+            {
+            fprintf(stderr, "Error opening file %s.\n", szFile);
+            perror("File open error");
+            fclose(pTable->fd);
+            return TRUE;
+            }
+
+// Separate the rows of this part from the previous one.
+         if(!bFirst)
+            fprintf(pTable->fd, "%s\n", g_bArrayFile ? "," : "");
+         bFirst = FALSE;
+
+         while((nRead = fread(szBuf, 1, sizeof(szBuf), fdPart)) > 0)
+            {
+            if(fwrite(szBuf, 1, nRead, pTable->fd) != nRead)
+               {
+               fprintf(stderr, "Error writing file for table %s.\n",
+                 pTable->pName);
+               perror("File write error");
+               fclose(fdPart);
+               fclose(pTable->fd);
+               return TRUE;
+               }
+            }
+         fclose(fdPart);
+         }
+      unlink(szFile);
+      }
+
+// Write the trailing cr/lf and array indicator now.
+   fprintf(pTable->fd, "%s%s", pTable->lRows == 0 ? "" : "\n",
+     g_bArrayFile ? "]\n" : "");
+   fclose(pTable->fd);
+   pTable->fd = NULL;
+
+   return FALSE;
+   } // End of StitchTableParts()
+
+
+/*
+ * Function: ExportTable()
+ * Export a MySQL table to a specified file.
+ * Arguments:
+ * MYSQL *pMySQL - The MySQL Connection to use.
+ * MYSQL *pMySQLPrefetch - Second connection, used in turn with the first one
+ *   to prefetch batches. NULL if batches are not prefetched.
+ * PJSONTABLE pTable - The table to export.
+ * Returns:
+ * unsigned int - An error code, 0 if there was no error.
+ */
+unsigned int ExportTable(MYSQL *pMySQL, MYSQL *pMySQLPrefetch, PJSONTABLE pTable)
+   {
+   BOOL bDone = FALSE;
+   BOOL bSlot = FALSE;
+   unsigned int nRet = -1;
+   unsigned long lRows = 0;
+   unsigned long long llStart = 0;
+   MYSQL *pMySQLTmp;
+   MYSQL_RES *pRes;
+   EXPORTSTATE state;
+
+   if(ExportStart(&state, pTable, g_bPipeline, pMySQL, pMySQLPrefetch))
+      goto ErrExit;
+
+// Loop for all batches.
+   while(!bDone && !g_bStop)
+      {
+// Don't start a batch while the server is too busy.
+      if(g_bGuarding)
+         GuardWait();
+
+// Wait for the adaptive controller to allow one more batch to run, and then
+// report the batch when done.
+      if(g_bAdapting)
+         {
+         if(bSlot)
+            AdaptRelease(pTable->lRows - lRows, llStart);
+         llStart = AdaptAcquire();
+         lRows = pTable->lRows;
+         bSlot = TRUE;
+         }
+      if(g_bSizing)
+         state.llBatchStart = GetUsecs();
+
+// If this batch was prefetched, get the result and swap the connections,
+// so that the next batch is prefetched on the one that is now free.
+      if(state.bPrefetch)
+         {
+         if((pRes = PrefetchWait(&state)) == NULL)
+            {
+            fprintf(stderr, "MySQL Error:%s\nin:%s\n",
+              mysql_error(state.pMySQLNext), pTable->pSQL);
+            nRet = mysql_errno(state.pMySQLNext);
+            goto ErrExit;
+            }
+         pMySQLTmp = pMySQL;
+         pMySQL = state.pMySQLNext;
+         state.pMySQLNext = pMySQLTmp;
+         state.pMySQL = pMySQL;
+         if(ExportBatch(&state, pRes, &bDone))
+            goto ErrExit;
+         continue;
+         }
+
+      PrintMsg(LOG_DEBUG, "Stmt: Batch %ld (limit: %ld)\n  SQL: %s\n",
+        pTable->lBatch, state.lBatchLimit, pTable->pSQL);
+      if(mysql_query(pMySQL, pTable->pSQL) != 0)
+         {
+         fprintf(stderr, "MySQL Error:%s\nin:%s\n", mysql_error(pMySQL),
+           pTable->pSQL);
+         nRet = mysql_errno(pMySQL);
+         goto ErrExit;
+         }
+
+// Get the SQL result. A shared key range and prefetching need the whole
+// batch to find the last key.
+      if(g_bUseResult && !state.bPeek)
+         {
+         if((pRes = mysql_use_result(pMySQL)) == NULL)
+            {
+            fprintf(stderr, "MySQL store results failed:\n%s\nin:%s\n",
+              mysql_error(pMySQL), pTable->pSQL);
+            nRet = mysql_errno(pMySQL);
+            goto ErrExit;
+            }
+         }
+      else
+         {
+         if((pRes = mysql_store_result(pMySQL)) == NULL)
+            {
+            fprintf(stderr, "MySQL use results failed:\n%s\nin:%s\n",
+              mysql_error(pMySQL), pTable->pSQL);
+            nRet = mysql_errno(pMySQL);
+            goto ErrExit;
+            }
+         }
+
+      if(ExportBatch(&state, pRes, &bDone))
+         goto ErrExit;
+      }
+   if(bSlot)
+      {
+      AdaptRelease(pTable->lRows - lRows, llStart);
+      bSlot = FALSE;
+      }
+
+   if(ExportEnd(&state, FALSE))
+      goto ErrExit;
+   return 0;
+
+ErrExit:
+   g_bStop = TRUE;
+   if(bSlot)
+      AdaptRelease(0, llStart);
+   ExportEnd(&state, TRUE);
+   return nRet;
+   } // End of ExportTable()
+
+
+/*
+ * Function: ExportTableStmt()
+ * Export a MySQL table to a specified file, using prepared statements and
+ * the binary protocol. The statement is prepared once and then executed for
+ * each batch, with the batch values bound as parameters. With a cursor, the
+ * whole table is a single batch, fetched from the server a few rows at the
+ * time. Note that the server materializes the ordered result of a cursor
+ * in a temporary table before the first row is fetched.
+ * Arguments:
+ * MYSQL *pMySQL - The MySQL Connection to use.
+ * PJSONTABLE pTable - The table to export.
+ * Returns:
+ * unsigned int - An error code, 0 if there was no error.
+ */
+unsigned int ExportTableStmt(MYSQL *pMySQL, PJSONTABLE pTable)
+   {
+   BOOL bDone = FALSE;
+   BOOL bSlot = FALSE;
+   unsigned int nRet = -1;
+   unsigned long lRows = 0;
+   unsigned long long llStart = 0;
+   EXPORTSTATE state;
+   STMTEXPORT stmt;
+
+   memset(&stmt, 0, sizeof(STMTEXPORT));
+   stmt.bCursor = g_lCursorFetch > 0;
+   if(ExportStart(&state, pTable, g_bPipeline, pMySQL, NULL))
+      goto ErrExit;
+   if(stmt.bCursor)
+      state.lBatchLimit = g_lLimit;
+
+// Loop for all batches.
+   while(!bDone && !g_bStop)
+      {
+// Don't start a batch while the server is too busy.
+      if(g_bGuarding)
+         GuardWait();
+
+// Wait for the adaptive controller to allow one more batch to run, and then
+// report the batch when done.
+      if(g_bAdapting)
+         {
+         if(bSlot)
+            AdaptRelease(pTable->lRows - lRows, llStart);
+         llStart = AdaptAcquire();
+         lRows = pTable->lRows;
+         bSlot = TRUE;
+         }
+      if(g_bSizing)
+         state.llBatchStart = GetUsecs();
+
+// A shared key range needs the whole batch to find the last key. The rows
+// of a cursor are left on the server.
+      if(StmtExecute(&stmt, pMySQL, pTable, state.lBatchLimit,
+        !stmt.bCursor && (!g_bUseResult || state.bShared)))
+         {
+         if(stmt.pStmt != NULL && mysql_stmt_errno(stmt.pStmt) != 0)
+            nRet = mysql_stmt_errno(stmt.pStmt);
+         goto ErrExit;
+         }
+      if(ExportStmtBatch(&state, &stmt, &bDone))
+         goto ErrExit;
+      }
+   if(bSlot)
+      {
+      AdaptRelease(pTable->lRows - lRows, llStart);
+      bSlot = FALSE;
+      }
+
+   if(ExportEnd(&state, FALSE))
+      goto ErrExit;
+   StmtFree(&stmt);
+   return 0;
+
+ErrExit:
+   g_bStop = TRUE;
+   if(bSlot)
+      AdaptRelease(0, llStart);
+   ExportEnd(&state, TRUE);
+   StmtFree(&stmt);
+   return nRet;
+   } // End of ExportTableStmt()
+
+
+/*
+ * Function: ExportStmtBatch()
+ * Export the rows of a batch run as a prepared statement. This is
+ * ExportBatch() for the binary protocol.
+ * Arguments:
+ * PEXPORTSTATE pState - The export state.
+ * PSTMTEXPORT pStmt - The executed statement. The result is freed.
+ * BOOL *pbDone - Set to TRUE if this was the last batch.
+ * Returns:
+ * BOOL - TRUE if there is an error, else FALSE.
+ */
+BOOL ExportStmtBatch(PEXPORTSTATE pState, PSTMTEXPORT pStmt, BOOL *pbDone)
+   {
+   PJSONTABLE pTable = pState->pTable;
+   BOOL bRangeDone = FALSE;
+   BOOL bRow;
+   unsigned long lBatchRows;
+   my_ulonglong llRows;
+   char *pKey;
+
+// Set types of columns.
+   if(pTable->lBatch == 0)
+      {
+      if((pTable->pCols = SetColsFromResult(pTable->pCols, &pTable->nCols,
+        pStmt->pMeta)) == NULL)
+         {
+         fprintf(stderr, "Memory allocation error.\n");
+         goto ErrExit;
+         }
+      if(SetEmitPlan(pTable))
+         goto ErrExit;
+      pState->pipe.nFields = pStmt->nFields;
+      }
+
+// For a shared key range, move the batch cursor to the last key of this
+// batch before any rows are written, as in ExportBatch().
+   llRows = mysql_stmt_num_rows(pStmt->pStmt);
+   if(pState->bShared && pTable->lBatchSize > 0 && llRows > 0)
+      {
+      mysql_stmt_data_seek(pStmt->pStmt, llRows - 1);
+      if(StmtFetch(pStmt, &bRow))
+         goto ErrExit;
+      if((pKey = pStmt->pValues[pTable->pBatchCol->nMySQLCol]) == NULL)
+         {
+         fprintf(stderr,"Record %ld in table %s has batching column as NULL. Stopping.\n",
+           pTable->lRows, pTable->pName);
+         goto ErrExit;
+         }
+      if(SetBatchCursor(pTable, pKey, &pState->llEnd))
+         goto ErrExit;
+      mysql_stmt_data_seek(pStmt->pStmt, 0);
+      }
+
+// Now, get the rows.
+   lBatchRows = 0;
+   while(!g_bStop)
+      {
+      if(StmtFetch(pStmt, &bRow))
+         goto ErrExit;
+      if(!bRow)
+         break;
+
+// Keys after the end of a shared range belong to another part.
+      if(pState->bShared && pTable->lBatchSize > 0
+        && strtoll(pStmt->pValues[pTable->pBatchCol->nMySQLCol], NULL, 10)
+        > pState->llEnd)
+         {
+         bRangeDone = TRUE;
+         break;
+         }
+
+      if(ExportRow(pState, pStmt->pValues, pStmt->pValueLens))
+         goto ErrExit;
+      pTable->lRows++;
+      lBatchRows++;
+      }
+   AddFormatTime(pState);
+
+// The last row is still in the buffers, so save its key as the next values
+// to use for batching.
+   if(pTable->lBatchSize > 0 && !pState->bShared && !pStmt->bCursor
+     && lBatchRows > 0 && SetBatchValues(pTable, pStmt->pValues))
+      goto ErrExit;
+   mysql_stmt_free_result(pStmt->pStmt);
+
+   if(pStmt->bCursor || bRangeDone || lBatchRows < pState->lBatchLimit || pTable->lBatchSize == 0 || (g_lLimit > 0 && pTable->lRows >= g_lLimit))
+      {
+      *pbDone = TRUE;
+      return FALSE;
+      }
+
+   pTable->lBatch++;
+   if(g_bSizing)
+      SizeBatch(pState, lBatchRows);
+   pState->lBatchLimit = (g_lLimit > 0 && (g_lLimit - pTable->lRows < pTable->lBatchSize || pTable->lBatchSize == 0)) ? g_lLimit - pTable->lRows : pTable->lBatchSize;
+   *pbDone = FALSE;
+
+   return FALSE;
+
+ErrExit:
+   mysql_stmt_free_result(pStmt->pStmt);
+   return TRUE;
+   } // End of ExportStmtBatch()
+
+
+/*
+ * Function: StmtExecute()
+ * Execute the statement for the next batch of a table, preparing it the
+ * first time, and bind the result buffers.
+ * Arguments:
+ * PSTMTEXPORT pStmt - The prepared statements of the table.
+ * MYSQL *pMySQL - The MySQL Connection to use.
+ * PJSONTABLE pTable - The table that is exported.
+ * unsigned long lLimit - The number of rows in the batch, 0 for all.
+ * BOOL bStore - Get the whole result before fetching the rows.
+ * Returns:
+ * BOOL - TRUE if there is an error, else FALSE.
+ */
+BOOL StmtExecute(PSTMTEXPORT pStmt, MYSQL *pMySQL, PJSONTABLE pTable,
+  unsigned long lLimit, BOOL bStore)
+   {
+   MYSQL_BIND *pBind;
+   STMTBOOL bTrue = 1;
+   unsigned long lCursor = CURSOR_TYPE_READ_ONLY;
+   PJSONCOL pCol;
+   BOOL bQuote;
+   char *pParams[2];
+   char *pValue;
+   unsigned int nShape;
+   unsigned int nParams = 0;
+   unsigned int i;
+   unsigned int k;
+
+// Format the SQL with placeholders, getting the batch values at the same
+// time, which decide which statement to use.
+   if(FormatSQL(pMySQL, pTable, lLimit, pParams) == NULL)
+      return TRUE;
+   nShape = (pParams[0] != NULL ? 1 : 0) | (pParams[1] != NULL ? 2 : 0);
+   PrintMsg(LOG_DEBUG, "Stmt: Batch %ld (limit: %ld)\n  SQL: %s\n",
+     pTable->lBatch, lLimit, pTable->pSQL);
+
+// Prepare the statement the first time it is used.
+   if((pStmt->pStmt = pStmt->pStmts[nShape]) == NULL)
+      {
+      if((pStmt->pStmt = mysql_stmt_init(pMySQL)) == NULL)
+         {
+         fprintf(stderr, "Memory allocation error.\n");
+         return TRUE;
+         }
+      pStmt->pStmts[nShape] = pStmt->pStmt;
+      if(bStore)
+         mysql_stmt_attr_set(pStmt->pStmt, STMT_ATTR_UPDATE_MAX_LENGTH, &bTrue);
+      if(pStmt->bCursor)
+         {
+         mysql_stmt_attr_set(pStmt->pStmt, STMT_ATTR_CURSOR_TYPE, &lCursor);
+         mysql_stmt_attr_set(pStmt->pStmt, STMT_ATTR_PREFETCH_ROWS,
+           &g_lCursorFetch);
+         }
+      if(mysql_stmt_prepare(pStmt->pStmt, pTable->pSQL,
+        strlen(pTable->pSQL)) != 0)
+         goto ErrExit;
+      }
+
+// Bind the batch values, typed as they would be quoted in the SQL, and the
+// limit. The lower bound has a value for each key column, the upper bound
+// is on the batch column only.
+   memset(pStmt->bindParams, 0, sizeof(pStmt->bindParams));
+   for(i = 0; i < 2; i++)
+      {
+      if(pParams[i] == NULL)
+         continue;
+      for(k = 0; k < (i == 0 ? pTable->nKeyCols : 1); k++)
+         {
+         pCol = pTable->pKeyCols[k];
+         pValue = i == 0 ? pCol->pPrevValue : pParams[i];
+         bQuote = JSONCOL_FLAG_CHECK(pCol, QUOTED)
+           || !JSONCOL_FLAG_CHECK(pCol, NUMERIC);
+         pBind = &pStmt->bindParams[nParams];
+         if(!bQuote && JSONCOL_FLAG_CHECK(pCol, INTEGER))
+            {
+            pBind->buffer_type = MYSQL_TYPE_LONGLONG;
+            pBind->is_unsigned = *pValue != '-';
+            pStmt->llKeys[nParams] = pBind->is_unsigned
+              ? (long long) strtoull(pValue, NULL, 10)
+              : strtoll(pValue, NULL, 10);
+            pBind->buffer = &pStmt->llKeys[nParams];
+            }
+         else
+            {
+            pBind->buffer_type = bQuote ? MYSQL_TYPE_STRING : MYSQL_TYPE_NEWDECIMAL;
+            pStmt->lKeyLens[nParams] = strlen(pValue);
+            pBind->buffer = pValue;
+            pBind->buffer_length = pStmt->lKeyLens[nParams];
+            pBind->length = &pStmt->lKeyLens[nParams];
+            }
+         nParams++;
+         }
+      }
+   if(lLimit > 0)
+      {
+      pBind = &pStmt->bindParams[nParams++];
+      pStmt->llLimit = lLimit;
+      pBind->buffer_type = MYSQL_TYPE_LONGLONG;
+      pBind->is_unsigned = 1;
+      pBind->buffer = &pStmt->llLimit;
+      }
+   if(nParams > 0 && mysql_stmt_bind_param(pStmt->pStmt, pStmt->bindParams))
+      goto ErrExit;
+
+   if(mysql_stmt_execute(pStmt->pStmt) != 0
+     || (bStore && mysql_stmt_store_result(pStmt->pStmt) != 0))
+      goto ErrExit;
+
+// Set up the result buffers after the first batch, all statements of the
+// table have the same columns.
+   if(pStmt->pMeta == NULL && StmtBindResult(pStmt))
+      return TRUE;
+   if(mysql_stmt_bind_result(pStmt->pStmt, pStmt->pBinds))
+      goto ErrExit;
+
+   return FALSE;
+
+ErrExit:
+   fprintf(stderr, "MySQL Error:%s\nin:%s\n", mysql_stmt_error(pStmt->pStmt),
+     pTable->pSQL);
+   return TRUE;
+   } // End of StmtExecute()
+
+
+/*
+ * Function: StmtBindResult()
+ * Set up the buffers that the rows of a prepared statement are fetched
+ * into. Integers, floating point and temporal values are fetched in their
+ * native form, everything else as strings.
+ * Arguments:
+ * PSTMTEXPORT pStmt - The executed statement.
+ * Returns:
+ * BOOL - TRUE if there is an error, else FALSE.
+ */
+BOOL StmtBindResult(PSTMTEXPORT pStmt)
+   {
+   MYSQL_FIELD *pFields;
+   MYSQL_BIND *pBind;
+   unsigned int i;
+
+   if((pStmt->pMeta = mysql_stmt_result_metadata(pStmt->pStmt)) == NULL)
+      {
+      fprintf(stderr, "MySQL Error:%s\n", mysql_stmt_error(pStmt->pStmt));
+      return TRUE;
+      }
+   pStmt->nFields = mysql_num_fields(pStmt->pMeta);
+   pFields = mysql_fetch_fields(pStmt->pMeta);
+
+   if((pStmt->pBinds = calloc(pStmt->nFields, sizeof(MYSQL_BIND))) == NULL
+     || (pStmt->pNative = calloc(pStmt->nFields, sizeof(STMTVALUE))) == NULL
+     || (pStmt->pLengths = calloc(pStmt->nFields, sizeof(unsigned long))) == NULL
+     || (pStmt->pNulls = calloc(pStmt->nFields, sizeof(STMTBOOL))) == NULL
+     || (pStmt->pErrors = calloc(pStmt->nFields, sizeof(STMTBOOL))) == NULL
+     || (pStmt->pValues = calloc(pStmt->nFields, sizeof(char *))) == NULL
+     || (pStmt->pValueLens = calloc(pStmt->nFields, sizeof(unsigned long))) == NULL
+     || (pStmt->pText = malloc(pStmt->nFields * STMT_TEXT_SIZE)) == NULL)
+      {
+      fprintf(stderr, "Memory allocation error.\n");
+      return TRUE;
+      }
+
+   for(i = 0; i < pStmt->nFields; i++)
+      {
+      pBind = &pStmt->pBinds[i];
+      pBind->length = &pStmt->pLengths[i];
+      pBind->is_null = &pStmt->pNulls[i];
+      pBind->error = &pStmt->pErrors[i];
+      pBind->is_unsigned = (pFields[i].flags & UNSIGNED_FLAG) == UNSIGNED_FLAG;
+      switch(pFields[i].type)
+         {
+         case MYSQL_TYPE_TINY:
+         case MYSQL_TYPE_SHORT:
+         case MYSQL_TYPE_LONG:
+         case MYSQL_TYPE_INT24:
+         case MYSQL_TYPE_LONGLONG:
+         case MYSQL_TYPE_YEAR:
+            pBind->buffer_type = MYSQL_TYPE_LONGLONG;
+            pBind->buffer = &pStmt->pNative[i].llValue;
+            break;
+
+         case MYSQL_TYPE_DATE:
+         case MYSQL_TYPE_NEWDATE:
+            pBind->buffer_type = MYSQL_TYPE_DATE;
+            pBind->buffer = &pStmt->pNative[i].tmValue;
+            break;
+
+         case MYSQL_TYPE_TIME:
+         case MYSQL_TYPE_DATETIME:
+         case MYSQL_TYPE_TIMESTAMP:
+            pBind->buffer_type = pFields[i].type;
+            pBind->buffer = &pStmt->pNative[i].tmValue;
+            break;
+
+// Strings start out with a small buffer, which grows as longer values are
+// fetched. Floating point values are made text by the client library, with
+// the code and the width the server uses for the text protocol.
+         default:
+            pBind->buffer_type = MYSQL_TYPE_STRING;
+            if(pFields[i].type == MYSQL_TYPE_FLOAT
+              || pFields[i].type == MYSQL_TYPE_DOUBLE)
+               pBind->buffer_length = STMT_DOUBLE_SIZE;
+            else
+               pBind->buffer_length = pFields[i].length < STMT_VALUE_SIZE
+                 ? pFields[i].length : STMT_VALUE_SIZE;
+            if((pBind->buffer = malloc(pBind->buffer_length + 1)) == NULL)
+               {
+               fprintf(stderr, "Memory allocation error.\n");
+               return TRUE;
+               }
+            break;
+         }
+      }
+
+   return FALSE;
+   } // End of StmtBindResult()
+
+
+/*
+ * Function: StmtFetch()
+ * Fetch the next row of a prepared statement, and format the values as
+ * text. The row is then in pValues and pValueLens.
+ * Arguments:
+ * PSTMTEXPORT pStmt - The executed statement.
+ * BOOL *pbRow - Set to TRUE if a row was fetched, FALSE at the end.
+ * Returns:
+ * BOOL - TRUE if there is an error, else FALSE.
+ */
+BOOL StmtFetch(PSTMTEXPORT pStmt, BOOL *pbRow)
+   {
+   MYSQL_FIELD *pFields = mysql_fetch_fields(pStmt->pMeta);
+   MYSQL_BIND *pBind;
+   BOOL bRebind = FALSE;
+   unsigned int i;
+   int nRet;
+   char *pText;
+   char *pTmp;
+
+   *pbRow = FALSE;
+   if((nRet = mysql_stmt_fetch(pStmt->pStmt)) == MYSQL_NO_DATA)
+      return FALSE;
+   if(nRet != 0 && nRet != MYSQL_DATA_TRUNCATED)
+      {
+      fprintf(stderr, "MySQL fetch failed:\n%s\n",
+        mysql_stmt_error(pStmt->pStmt));
+      return TRUE;
+      }
+
+   for(i = 0; i < pStmt->nFields; i++)
+      {
+      pBind = &pStmt->pBinds[i];
+      pText = &pStmt->pText[i * STMT_TEXT_SIZE];
+      if(pStmt->pNulls[i])
+         {
+         pStmt->pValues[i] = NULL;
+         pStmt->pValueLens[i] = 0;
+         continue;
+         }
+
+      switch(pBind->buffer_type)
+         {
+         case MYSQL_TYPE_LONGLONG:
+            pStmt->pValueLens[i] = FormatInt(pStmt->pNative[i].llValue,
+              pBind->is_unsigned, pText);
+
+// Zero filled columns, such as YEAR, are padded to the width of the column.
+            if(((pFields[i].flags & ZEROFILL_FLAG) == ZEROFILL_FLAG
+              || pFields[i].type == MYSQL_TYPE_YEAR)
+              && pStmt->pValueLens[i] < pFields[i].length
+              && pFields[i].length < STMT_TEXT_SIZE)
+               {
+               memmove(pText + pFields[i].length - pStmt->pValueLens[i], pText,
+                 pStmt->pValueLens[i] + 1);
+               memset(pText, '0', pFields[i].length - pStmt->pValueLens[i]);
+               pStmt->pValueLens[i] = pFields[i].length;
+               }
+            pStmt->pValues[i] = pText;
+            break;
+
+         case MYSQL_TYPE_DATE:
+         case MYSQL_TYPE_TIME:
+         case MYSQL_TYPE_DATETIME:
+         case MYSQL_TYPE_TIMESTAMP:
+            pStmt->pValueLens[i] = FormatTime(&pStmt->pNative[i].tmValue,
+              pBind->buffer_type, pFields[i].decimals, pText);
+            pStmt->pValues[i] = pText;
+            break;
+
+// Get the whole of a value that didn't fit, and keep the larger buffer for
+// the rows to come.
+         default:
+            if(pStmt->pLengths[i] > pBind->buffer_length)
+               {
+               if((pTmp = realloc(pBind->buffer, pStmt->pLengths[i] + 1)) == NULL)
+                  {
+                  fprintf(stderr, "Memory allocation error.\n");
+                  return TRUE;
+                  }
+               pBind->buffer = pTmp;
+               pBind->buffer_length = pStmt->pLengths[i];
+               if(mysql_stmt_fetch_column(pStmt->pStmt, pBind, i, 0) != 0)
+                  {
+                  fprintf(stderr, "MySQL fetch failed:\n%s\n",
+                    mysql_stmt_error(pStmt->pStmt));
+                  return TRUE;
+                  }
+               bRebind = TRUE;
+               }
+            pStmt->pValues[i] = pBind->buffer;
+            pStmt->pValues[i][pStmt->pLengths[i]] = '\0';
+            pStmt->pValueLens[i] = pStmt->pLengths[i];
+            break;
+         }
+      }
+
+   if(bRebind && mysql_stmt_bind_result(pStmt->pStmt, pStmt->pBinds))
+      {
+      fprintf(stderr, "MySQL Error:%s\n", mysql_stmt_error(pStmt->pStmt));
+      return TRUE;
+      }
+   *pbRow = TRUE;
+
+   return FALSE;
+   } // End of StmtFetch()
+
+
+/*
+ * Function: StmtFree()
+ * Close the prepared statements of a table export and free the buffers.
+ * Arguments:
+ * PSTMTEXPORT pStmt - The prepared statements.
+ */
+void StmtFree(PSTMTEXPORT pStmt)
+   {
+   unsigned int i;
+
+   for(i = 0; i < STMT_SHAPES; i++)
+      {
+      if(pStmt->pStmts[i] != NULL)
+         mysql_stmt_close(pStmt->pStmts[i]);
+      pStmt->pStmts[i] = NULL;
+      }
+   if(pStmt->pMeta != NULL)
+      mysql_free_result(pStmt->pMeta);
+   if(pStmt->pBinds != NULL)
+      {
+      for(i = 0; i < pStmt->nFields; i++)
+         {
+         if(pStmt->pBinds[i].buffer_type == MYSQL_TYPE_STRING)
+            free(pStmt->pBinds[i].buffer);
+         }
+      free(pStmt->pBinds);
+      }
+   free(pStmt->pNative);
+   free(pStmt->pLengths);
+   free(pStmt->pNulls);
+   free(pStmt->pErrors);
+   free(pStmt->pValues);
+   free(pStmt->pValueLens);
+   free(pStmt->pText);
+   memset(pStmt, 0, sizeof(STMTEXPORT));
+
+   return;
+   } // End of StmtFree()
+
+
+/*
+ * Function: FormatInt()
+ * Format an integer as text, two digits at the time.
+ * Arguments:
+ * long long llValue - The value.
+ * BOOL bUnsigned - The value is unsigned.
+ * char *pRet - Buffer for the text, at least 21 characters.
+ * Returns:
+ * unsigned long - The length of the text.
+ */
+unsigned long FormatInt(long long llValue, BOOL bUnsigned, char *pRet)
+   {
+   static const char szDigits[] =
+     "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+     "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+     "8081828384858687888990919293949596979899";
+   char szTmp[20];
+   char *pTmp = szTmp + sizeof(szTmp);
+   unsigned long long llAbs;
+   unsigned long lLen;
+
+   llAbs = bUnsigned || llValue >= 0 ? (unsigned long long) llValue
+     : 0 - (unsigned long long) llValue;
+   while(llAbs >= 100)
+      {
+      pTmp -= 2;
+      memcpy(pTmp, &szDigits[(llAbs % 100) * 2], 2);
+      llAbs /= 100;
+      }
+   if(llAbs >= 10)
+      {
+      pTmp -= 2;
+      memcpy(pTmp, &szDigits[llAbs * 2], 2);
+      }
+   else
+      *--pTmp = '0' + (char) llAbs;
+   if(!bUnsigned && llValue < 0)
+      *--pTmp = '-';
+
+   lLen = szTmp + sizeof(szTmp) - pTmp;
+   memcpy(pRet, pTmp, lLen);
+   pRet[lLen] = '\0';
+
+   return lLen;
+   } // End of FormatInt()
+
+
+/*
+ * Function: FormatTime()
+ * Format a temporal value as text, the way MySQL does.
+ * Arguments:
+ * MYSQL_TIME *pTime - The value.
+ * enum enum_field_types nType - The type of the value.
+ * unsigned int nDecimals - The number of decimals of the seconds.
+ * char *pRet - Buffer for the text, at least 32 characters.
+ * Returns:
+ * unsigned long - The length of the text.
+ */
+unsigned long FormatTime(MYSQL_TIME *pTime, enum enum_field_types nType,
+  unsigned int nDecimals, char *pRet)
+   {
+   static const unsigned long lScale[] = { 1000000, 100000, 10000, 1000, 100,
+     10, 1 };
+   char *pTmp = pRet;
+
+   if(nType == MYSQL_TYPE_TIME)
+      {
+      if(pTime->neg)
+         *pTmp++ = '-';
+      }
+   else
+      {
+      pTmp = FormatDigits(pTmp, pTime->year, 4);
+      *pTmp++ = '-';
+      pTmp = FormatDigits(pTmp, pTime->month, 2);
+      *pTmp++ = '-';
+      pTmp = FormatDigits(pTmp, pTime->day, 2);
+      if(nType == MYSQL_TYPE_DATE)
+         {
+         *pTmp = '\0';
+         return pTmp - pRet;
+         }
+      *pTmp++ = ' ';
+      }
+
+// A time may have more than 99 hours.
+   pTmp = FormatDigits(pTmp, pTime->hour, pTime->hour > 99 ? 3 : 2);
+   *pTmp++ = ':';
+   pTmp = FormatDigits(pTmp, pTime->minute, 2);
+   *pTmp++ = ':';
+   pTmp = FormatDigits(pTmp, pTime->second, 2);
+   if(nDecimals > 0 && nDecimals <= 6)
+      {
+      *pTmp++ = '.';
+      pTmp = FormatDigits(pTmp, pTime->second_part / lScale[nDecimals],
+        nDecimals);
+      }
+   *pTmp = '\0';
+
+   return pTmp - pRet;
+   } // End of FormatTime()
+
+
+/*
+ * Function: FormatDigits()
+ * Format a number with a fixed number of digits, with leading zeros.
+ * Arguments:
+ * char *pRet - Buffer for the digits.
+ * unsigned long lValue - The number.
+ * unsigned int nDigits - The number of digits.
+ * Returns:
+ * char * - A pointer after the digits.
+ */
+char *FormatDigits(char *pRet, unsigned long lValue, unsigned int nDigits)
+   {
+   unsigned int i;
+
+   for(i = nDigits; i > 0; i--)
+      {
+      pRet[i - 1] = '0' + (char) (lValue % 10);
+      lValue /= 10;
+      }
+
+   return pRet + nDigits;
+   } // End of FormatDigits()
+
+
+/*
+ * Function: ExportStart()
+ * Start the export of a table. The first SQL statement is formatted and the
+ * array leader is written.
+ * Arguments:
+ * PEXPORTSTATE pState - The export state to set up.
+ * PJSONTABLE pTable - The table to export.
+ * BOOL bPipeline - Format and write the rows in a pipeline.
+ * MYSQL *pMySQL - Connection the table is exported on, used to escape the
+ *   batch values in the SQL.
+ * MYSQL *pMySQLNext - Connection to prefetch the next batch on, NULL to not
+ *   prefetch.
+ * Returns:
+ * BOOL - TRUE if there is an error, else FALSE.
+ */
+BOOL ExportStart(PEXPORTSTATE pState, PJSONTABLE pTable, BOOL bPipeline,
+  MYSQL *pMySQL, MYSQL *pMySQLNext)
+   {
+   pState->pTable = pTable;
+   pState->pMySQL = pMySQL;
+   pState->bPipeline = FALSE;
+   pState->bPrefetch = FALSE;
+   pState->pMySQLNext = pTable->lBatchSize > 0 ? pMySQLNext : NULL;
+   pState->pPrefetchRes = NULL;
+   pState->llEnd = 0;
+   pState->llBatchStart = g_bSizing ? GetUsecs() : 0;
+   pState->llBatchBytes = 0;
+   pState->llFormatStart = 0;
+   memset(&pState->buf, 0, sizeof(ROWBUF));
+   pState->buf.pFlush = RowBufFlush;
+   pState->buf.pFlushData = pTable;
+   pTable->lBatch = 0;
+   if(g_bSizing && pTable->lBatchSize > 0)
+      pTable->lSizeMin = pTable->lSizeMax = pTable->lBatchSize;
+
+// Format the first SQL statement.
+   pState->lBatchLimit = (g_lLimit > 0 && (g_lLimit < pTable->lBatchSize
+     || pTable->lBatchSize == 0)) ? g_lLimit : pTable->lBatchSize;
+   FormatSQL(pState->pMySQL, pTable, pState->lBatchLimit, NULL);
+
+   pTable->tStart = g_bTiming ? time(NULL) : 0;
+// If we are exporting as an array, the write the array leader now. Parts
+// that are to be stitched together only contain rows, except that the first
+// part starts the table file.
+   pState->bStitched = pTable->pParent != NULL && !g_bSplitFiles;
+   if(g_bArrayFile && (!pState->bStitched || pTable->nPart == 1))
+      fprintf(pTable->fd, "[\n");
+
+// Check if the key range of this table may be split by other threads.
+   pState->bShared = g_bSteal && g_nWorkers > 1 && pTable->pParent != NULL
+     && pTable->pParent->bIntRange;
+   pState->bPeek = pState->bShared || pState->pMySQLNext != NULL;
+
+// Start the threads that format and write the rows.
+   if(bPipeline)
+      {
+      if(PipeStart(&pState->pipe, pTable))
+         return TRUE;
+      pState->bPipeline = TRUE;
+      }
+
+   return FALSE;
+   } // End of ExportStart()
+
+
+/*
+ * Function: ExportBatch()
+ * Export the rows in the result of a batch and format the SQL statement for
+ * the next batch.
+ * Arguments:
+ * PEXPORTSTATE pState - The export state.
+ * MYSQL_RES *pRes - The result of the batch. This is freed.
+ * BOOL *pbDone - Set to TRUE if this was the last batch.
+ * Returns:
+ * BOOL - TRUE if there is an error, else FALSE.
+ */
+BOOL ExportBatch(PEXPORTSTATE pState, MYSQL_RES *pRes, BOOL *pbDone)
+   {
+   PJSONTABLE pTable = pState->pTable;
+   BOOL bRangeDone = FALSE;
+   unsigned long lLimit = pState->lBatchLimit;
+   unsigned long lBatchRows;
+   MYSQL_ROW pRow;
+
+// Set types of columns.
+   if(pTable->lBatch == 0)
+      {
+      if((pTable->pCols = SetColsFromResult(pTable->pCols, &pTable->nCols,
+        pRes)) == NULL)
+         {
+         fprintf(stderr, "Memory allocation error.\n");
+         goto ErrExit;
+         }
+      if(SetEmitPlan(pTable))
+         goto ErrExit;
+      pState->pipe.nFields = mysql_num_fields(pRes);
+      }
+
+// For a shared key range, move the batch cursor to the last key of this
+// batch before any rows are written, so that another thread splitting the
+// range will not get any of these keys. Then get the end of the range, as
+// that may have been moved by a split after this batch was selected. When
+// prefetching, the cursor is also set now, so that the next batch may be
+// selected while this one is written.
+   if(pState->bPeek && pTable->lBatchSize > 0 && mysql_num_rows(pRes) > 0)
+      {
+      mysql_data_seek(pRes, mysql_num_rows(pRes) - 1);
+      pRow = mysql_fetch_row(pRes);
+      if(pRow[pTable->pBatchCol->nMySQLCol] == NULL)
+         {
+         fprintf(stderr,"Record %ld in table %s has batching column as NULL. Stopping.\n",
+           pTable->lRows, pTable->pName);
+         goto ErrExit;
+         }
+      if(pState->bShared)
+         {
+         if(SetBatchCursor(pTable, pRow[pTable->pBatchCol->nMySQLCol],
+           &pState->llEnd))
+            goto ErrExit;
+         }
+      else if(SetBatchValues(pTable, pRow))
+         goto ErrExit;
+
+// If there is a batch after this one, start selecting it.
+      if(pState->pMySQLNext != NULL
+        && mysql_num_rows(pRes) == lLimit
+        && (g_lLimit == 0 || pTable->lRows + mysql_num_rows(pRes) < g_lLimit)
+        && (!pState->bShared || strtoll(pRow[pTable->pBatchCol->nMySQLCol],
+        NULL, 10) <= pState->llEnd)
+        && PrefetchStart(pState, pTable->lRows + mysql_num_rows(pRes)))
+         goto ErrExit;
+      mysql_data_seek(pRes, 0);
+      }
+
+// Now, get the rows.
+   lBatchRows = 0;
+   while((pRow = mysql_fetch_row(pRes)) != NULL && !g_bStop)
+      {
+// Keys after the end of a shared range belong to another part.
+      if(pState->bShared && pTable->lBatchSize > 0
+        && strtoll(pRow[pTable->pBatchCol->nMySQLCol], NULL, 10)
+        > pState->llEnd)
+         {
+         bRangeDone = TRUE;
+         break;
+         }
+
+// Save as next values to use for batching.
+      if(pTable->lBatchSize > 0 && !pState->bPeek
+        && (lBatchRows + 1) == mysql_num_rows(pRes)
+        && SetBatchValues(pTable, pRow))
+         goto ErrExit;
+
+      if(ExportRow(pState, pRow, mysql_fetch_lengths(pRes)))
+         goto ErrExit;
+      pTable->lRows++;
+      lBatchRows++;
+      }
+   mysql_free_result(pRes);
+   AddFormatTime(pState);
+
+// A short batch is the last one. Compare to the limit of this batch, as
+// prefetching has already set the one of the next.
+   if(bRangeDone || lBatchRows < lLimit || pTable->lBatchSize == 0 || (g_lLimit > 0 && pTable->lRows >= g_lLimit))
+      {
+      *pbDone = TRUE;
+      return FALSE;
+      }
+
+   pTable->lBatch++;
+   if(g_bSizing)
+      SizeBatch(pState, lBatchRows);
+   if(!pState->bPrefetch)
+      {
+      pState->lBatchLimit = (g_lLimit > 0 && (g_lLimit - pTable->lRows < pTable->lBatchSize || pTable->lBatchSize == 0)) ? g_lLimit - pTable->lRows : pTable->lBatchSize;
+      FormatSQL(pState->pMySQL, pTable, pState->lBatchLimit, NULL);
+      }
+   *pbDone = FALSE;
+
+   return FALSE;
+
+ErrExit:
+   mysql_free_result(pRes);
+   return TRUE;
+   } // End of ExportBatch()
+
+
+/*
+ * Function: ExportRow()
+ * Hand a row to the pipeline or format it right away, writing the formatted
+ * rows when there are enough of them.
+ * Arguments:
+ * PEXPORTSTATE pState - The export state.
+ * MYSQL_ROW pRow - The row.
+ * unsigned long *pLengths - The lengths of the columns in the row.
+ * Returns:
+ * BOOL - TRUE if there is an error, else FALSE.
+ */
+BOOL ExportRow(PEXPORTSTATE pState, MYSQL_ROW pRow, unsigned long *pLengths)
+   {
+   unsigned int i;
+
+// Count the data of the batch, for sizing the next one.
+   if(g_lBatchMB > 0)
+      {
+      for(i = 0; i < pState->pipe.nFields; i++)
+         pState->llBatchBytes += pLengths[i];
+      }
+
+   if(pState->bPipeline)
+      return PipeAddRow(&pState->pipe, pRow, pLengths);
+
+// Time the formatting from the first row after a write up to the next write
+// or the end of the batch, as the format thread times a chunk of rows.
+   if(g_nStats > STATS_NONE && pState->llFormatStart == 0)
+      pState->llFormatStart = GetUsecs();
+   if(FormatRow(pState->pTable, pRow, pLengths, &pState->buf,
+     pState->pTable->lRows == 0))
+      return TRUE;
+   if(pState->buf.nLen >= ROWBUF_FLUSH_SIZE)
+      {
+      AddFormatTime(pState);
+      if(RowBufFlush(&pState->buf, pState->pTable))
+         return TRUE;
+      }
+
+   return FALSE;
+   } // End of ExportRow()
+
+
+/*
+ * Function: AddFormatTime()
+ * Add the time since the first row that ExportRow() formatted after the last
+ * write or batch to the format time of the table. That includes getting the
+ * rows from the result, but not running the query or writing the rows.
+ * Arguments:
+ * PEXPORTSTATE pState - The export state.
+ */
+void AddFormatTime(PEXPORTSTATE pState)
+   {
+   if(pState->llFormatStart != 0)
+      {
+      pState->pTable->llFormatUsecs += GetUsecs() - pState->llFormatStart;
+      pState->llFormatStart = 0;
+      }
+
+   return;
+   } // End of AddFormatTime()
+
+
+/*
+ * Function: ExportEnd()
+ * End the export of a table, waiting for any rows in the pipeline to be
+ * written and writing the array trailer.
+ * Arguments:
+ * PEXPORTSTATE pState - The export state.
+ * BOOL bError - The export failed, so just clean up.
+ * Returns:
+ * BOOL - TRUE if there is an error, else FALSE.
+ */
+BOOL ExportEnd(PEXPORTSTATE pState, BOOL bError)
+   {
+   PJSONTABLE pTable = pState->pTable;
+   MYSQL_RES *pRes;
+
+// Drop a batch that was prefetched, if the export was stopped.
+   if(pState->bPrefetch && (pRes = PrefetchWait(pState)) != NULL)
+      mysql_free_result(pRes);
+
+// Wait for the pipeline to write the last rows.
+   if(pState->bPipeline)
+      {
+      pState->bPipeline = FALSE;
+      if(PipeFinish(&pState->pipe))
+         bError = TRUE;
+      }
+   if(!bError && pState->buf.nLen > 0 && RowBufFlush(&pState->buf, pTable))
+      bError = TRUE;
+   pTable->tStop = g_bTiming ? time(NULL) : 0;
+   if(pState->buf.pData != NULL)
+      free(pState->buf.pData);
+   pState->buf.pData = NULL;
+   if(bError)
+      return TRUE;
+
+// Write the trailing cr/lf and array indicator now.
+   if(!pState->bStitched)
+      fprintf(pTable->fd, "%s%s", pTable->lRows == 0 ? "" : "\n",
+        g_bArrayFile ? "]\n" : "");
+
+   return FALSE;
+   } // End of ExportEnd()
+
+
+/*
+ * Function: SizeBatch()
+ * Set the size of the next batch of a table from the time and the data of
+ * the batch just exported, to get it near the targets. The size is changed
+ * by at most a factor of 2 per batch, so that a single slow batch doesn't
+ * throw it off, and is kept between the min and max.
+ * Arguments:
+ * PEXPORTSTATE pState - The export state.
+ * unsigned long lBatchRows - The number of rows in the batch.
+ */
+void SizeBatch(PEXPORTSTATE pState, unsigned long lBatchRows)
+   {
+   PJSONTABLE pTable = pState->pTable;
+   unsigned long long llUsecs;
+   double dSize;
+   double dTarget;
+
+   llUsecs = GetUsecs() - pState->llBatchStart;
+   if(lBatchRows == 0)
+      return;
+
+// Take the smallest size that meets both targets.
+   dSize = pTable->lBatchSize * 2.0;
+   if(g_lBatchTime > 0 && llUsecs > 0
+     && (dTarget = lBatchRows * (g_lBatchTime * 1000.0) / llUsecs) < dSize)
+      dSize = dTarget;
+   if(g_lBatchMB > 0 && pState->llBatchBytes > 0
+     && (dTarget = lBatchRows * (g_lBatchMB * 1048576.0)
+     / pState->llBatchBytes) < dSize)
+      dSize = dTarget;
+   if(dSize < pTable->lBatchSize / 2.0)
+      dSize = pTable->lBatchSize / 2.0;
+   if(dSize < g_lBatchMin)
+      dSize = g_lBatchMin;
+   if(dSize > g_lBatchMax)
+      dSize = g_lBatchMax;
+
+   if((unsigned long) dSize != pTable->lBatchSize)
+      PrintMsg(LOG_DEBUG, "Batch %ld of %lu rows, %llu bytes in %llu ms. Next batch: %lu rows\n",
+        pTable->lBatch, lBatchRows, pState->llBatchBytes, llUsecs / 1000,
+        (unsigned long) dSize);
+
+// The size of a table part is read by threads that steal from its range.
+   if(pTable->pParent != NULL)
+      pthread_mutex_lock(&pTable->mtxRange);
+   pTable->lBatchSize = (unsigned long) dSize;
+   if(pTable->pParent != NULL)
+      pthread_mutex_unlock(&pTable->mtxRange);
+   if(pTable->lBatchSize < pTable->lSizeMin)
+      pTable->lSizeMin = pTable->lBatchSize;
+   if(pTable->lBatchSize > pTable->lSizeMax)
+      pTable->lSizeMax = pTable->lBatchSize;
+   pState->llBatchBytes = 0;
+   } // End of SizeBatch()
+
+
+/*
+ * Function: PrefetchStart()
+ * Format the SQL statement for the next batch of a table and start a thread
+ * that runs it on the second connection.
+ * Arguments:
+ * PEXPORTSTATE pState - The export state.
+ * unsigned long lRows - Rows exported when the current batch is done.
+ * Returns:
+ * BOOL - TRUE if there is an error, else FALSE.
+ */
+BOOL PrefetchStart(PEXPORTSTATE pState, unsigned long lRows)
+   {
+   PJSONTABLE pTable = pState->pTable;
+   int nRet;
+
+   pState->lBatchLimit = (g_lLimit > 0 && (g_lLimit - lRows < pTable->lBatchSize || pTable->lBatchSize == 0)) ? g_lLimit - lRows : pTable->lBatchSize;
+   if(FormatSQL(pState->pMySQL, pTable, pState->lBatchLimit, NULL) == NULL)
+      return TRUE;
+   PrintMsg(LOG_DEBUG, "Prefetch: Batch %ld (limit: %ld)\n  SQL: %s\n",
+     pTable->lBatch + 1, pState->lBatchLimit, pTable->pSQL);
+
+   if((nRet = pthread_create(&pState->thrPrefetch, NULL, PrefetchThread,
+     (void *) pState)) != 0)
+      {
+      PrintMsg(LOG_ERROR, "pthread_create() error: %d\n", nRet);
+      return TRUE;
+      }
+   pState->bPrefetch = TRUE;
+
+   return FALSE;
+   } // End of PrefetchStart()
+
+
+/*
+ * Function: AdaptAcquire()
+ * Wait for the adaptive controller to allow one more batch to run.
+ * Returns:
+ * unsigned long long - The time the batch started, in microseconds.
+ */
+unsigned long long AdaptAcquire(void)
+   {
+   pthread_mutex_lock(&g_mtxAdapt);
+   while(g_nAdaptRunning >= g_nAdaptLimit && !g_bStop)
+      pthread_cond_wait(&g_condAdapt, &g_mtxAdapt);
+   g_nAdaptRunning++;
+   pthread_mutex_unlock(&g_mtxAdapt);
+
+   return GetUsecs();
+   } // End of AdaptAcquire()
+
+
+/*
+ * Function: AdaptRelease()
+ * Register that a batch is done, so another one may run.
+ * Arguments:
+ * unsigned long lRows - Rows exported by the batch.
+ * unsigned long long llStart - The time the batch started.
+ */
+void AdaptRelease(unsigned long lRows, unsigned long long llStart)
+   {
+   unsigned long long llUsecs = GetUsecs() - llStart;
+
+   pthread_mutex_lock(&g_mtxAdapt);
+   g_nAdaptRunning--;
+   g_llAdaptRows += lRows;
+   g_llAdaptUsecs += llUsecs;
+   g_lAdaptBatches++;
+   pthread_cond_signal(&g_condAdapt);
+   pthread_mutex_unlock(&g_mtxAdapt);
+
+   return;
+   } // End of AdaptRelease()
+
+
+/*
+ * Function: AdaptThread()
+ * The adaptive concurrency controller. Once every interval, the throughput
+ * and average batch latency are checked. While throughput keeps rising,
+ * more batches are allowed to run at the same time, doubling the number
+ * at first and then adding one at a time. If adding made no difference,
+ * one is taken away again, and if the latency jumps, the number is halved.
+ * Arguments:
+ * void *pData - Pointer to the number of threads, which is the max.
+ * Returns:
+ * void * - Always NULL.
+ */
+void *AdaptThread(void *pData)
+   {
+   unsigned int nMax = *(unsigned int *) pData;
+   unsigned int nLimit;
+   unsigned int nPrevLimit;
+   unsigned int nLast = ADAPT_NONE;
+   unsigned int i;
+   unsigned long lBatches;
+   unsigned long long llRows;
+   unsigned long long llUsecs;
+   BOOL bSlowStart = TRUE;
+   double dRate;
+   double dPrevRate = 0;
+   double dLatency;
+   double dMinLatency = 0;
+
+   while(!g_bAdaptStop && !g_bStop)
+      {
+// Sleep for an interval, but wake up now and then to check if we are done.
+      for(i = 0; i < ADAPT_INTERVAL / 100 && !g_bAdaptStop && !g_bStop; i++)
+         usleep(100000);
+      if(g_bAdaptStop || g_bStop)
+         break;
+
+// Get and reset the counters.
+      pthread_mutex_lock(&g_mtxAdapt);
+      llRows = g_llAdaptRows;
+      llUsecs = g_llAdaptUsecs;
+      lBatches = g_lAdaptBatches;
+      g_llAdaptRows = g_llAdaptUsecs = 0;
+      g_lAdaptBatches = 0;
+      nLimit = nPrevLimit = g_nAdaptLimit;
+      pthread_mutex_unlock(&g_mtxAdapt);
+      if(lBatches == 0)
+         continue;
+
+      dRate = llRows * 1000.0 / ADAPT_INTERVAL;
+      dLatency = (double) llUsecs / lBatches / 1000.0;
+      if(dMinLatency == 0 || dLatency < dMinLatency)
+         dMinLatency = dLatency;
+
+// Back off hard if latency jumps.
+      if(dLatency > dMinLatency * ADAPT_LATENCY_JUMP && nLimit > 1)
+         {
+         nLimit /= 2;
+         nLast = ADAPT_DOWN;
+         bSlowStart = FALSE;
+         }
+// If more workers helped, or fewer workers made things worse, add more.
+      else if((nLast != ADAPT_DOWN
+        && dRate > dPrevRate * (100 + ADAPT_GAIN) / 100)
+        || (nLast == ADAPT_DOWN && dRate < dPrevRate * (100 - ADAPT_GAIN) / 100))
+         {
+         nLimit = bSlowStart ? nLimit * 2 : nLimit + 1;
+         nLast = ADAPT_UP;
+         }
+// If more workers didn't help, take one back.
+      else if(nLast == ADAPT_UP && nLimit > 1)
+         {
+         nLimit--;
+         nLast = ADAPT_DOWN;
+         bSlowStart = FALSE;
+         }
+// Else hold, and try adding one again next time.
+      else
+         nLast = ADAPT_NONE;
+      if(nLimit > nMax)
+         nLimit = nMax;
+
+      PrintMsg(LOG_VERBOSE, "Adaptive: %.0f rows/s, %.0f rows/s per thread, %.1f ms per batch, %u threads.\n",
+        dRate, dRate / nPrevLimit, dLatency, nLimit);
+      dPrevRate = dRate;
+
+// Let waiting threads run if the limit was raised.
+      pthread_mutex_lock(&g_mtxAdapt);
+      g_nAdaptLimit = nLimit;
+      if(nLimit > g_nAdaptPeak)
+         g_nAdaptPeak = nLimit;
+      pthread_cond_broadcast(&g_condAdapt);
+      pthread_mutex_unlock(&g_mtxAdapt);
+      }
+
+// Make sure no thread is left waiting.
+   pthread_mutex_lock(&g_mtxAdapt);
+   pthread_cond_broadcast(&g_condAdapt);
+   pthread_mutex_unlock(&g_mtxAdapt);
+
+   return NULL;
+   } // End of AdaptThread()
+
+
+/*
+ * Function: GetUsecs()
+ * Get a monotonic time in microseconds.
+ * Returns:
+ * unsigned long long - The time.
+ */
+unsigned long long GetUsecs(void)
+   {
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+
+   return (unsigned long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+   } // End of GetUsecs()
+
+
+/*
+ * Function: GuardWait()
+ * Wait while the load guard has paused the export.
+ */
+void GuardWait(void)
+   {
+   pthread_mutex_lock(&g_mtxGuard);
+   while(g_bGuardPause && !g_bStop && !g_bGuardStop)
+      pthread_cond_wait(&g_condGuard, &g_mtxGuard);
+   pthread_mutex_unlock(&g_mtxGuard);
+
+   return;
+   } // End of GuardWait()
+
+
+/*
+ * Function: GuardThread()
+ * The load guard. Every guard interval, Threads_running and the replica lag
+ * are checked, and the export is paused while either is over its limit.
+ * The connections of the export, and the one of the guard, are not counted
+ * as running threads. If the load can't be checked, or replication is
+ * stopped, the export is paused too and the check is retried on the next
+ * interval. After GUARD_ERRORS_MAX failed checks in a row, the export is
+ * stopped.
+ * Arguments:
+ * void *pData - The MySQL connection to check with. Closed when done.
+ * Returns:
+ * void * - Always NULL.
+ */
+void *GuardThread(void *pData)
+   {
+   MYSQL *pMySQL = (MYSQL *) pData;
+   BOOL bPause;
+   unsigned int i;
+   unsigned int nErrors = 0;
+   long lThreadsRunning;
+   long lReplicaLag;
+   long lOwn;
+   unsigned long long llPauseStart = 0;
+
+   while(!g_bGuardStop && !g_bStop)
+      {
+      if(GetServerLoad(pMySQL, &lThreadsRunning, &lReplicaLag))
+         {
+         if(++nErrors >= GUARD_ERRORS_MAX)
+            {
+            PrintMsg(LOG_ERROR, "Server load check failed %u times, stopping export.\n",
+              nErrors);
+            g_bStop = TRUE;
+            break;
+            }
+         bPause = TRUE;
+         }
+      else
+         {
+         nErrors = 0;
+
+// Leave out the threads that run the queries of the export itself.
+         lOwn = 1 + (long) g_nWorkers * (g_bPrefetch
+           && (!g_bParallel || g_nAsync == 0) ? 2 : 1);
+         lThreadsRunning = lThreadsRunning > lOwn ? lThreadsRunning - lOwn : 0;
+         bPause = (g_nMaxThreadsRunning > 0
+           && lThreadsRunning > (long) g_nMaxThreadsRunning)
+           || (g_nMaxReplicaLag > 0 && lReplicaLag > (long) g_nMaxReplicaLag);
+         PrintMsg(LOG_DEBUG, "Guard: Threads_running %ld, replica lag %ld.\n",
+           lThreadsRunning, lReplicaLag);
+         }
+
+// Pause or resume the export if that changed.
+      if(bPause && !g_bGuardPause)
+         {
+         if(nErrors > 0)
+            PrintMsg(LOG_INFO, "Pausing export: server load unknown.\n");
+         else
+            PrintMsg(LOG_INFO, "Pausing export: Threads_running %ld, replica lag %ld.\n",
+              lThreadsRunning, lReplicaLag);
+         llPauseStart = GetUsecs();
+         g_lGuardPauses++;
+         g_bGuardPause = TRUE;
+         }
+      else if(!bPause && g_bGuardPause)
+         {
+         pthread_mutex_lock(&g_mtxGuard);
+         g_bGuardPause = FALSE;
+         g_llGuardUsecs += GetUsecs() - llPauseStart;
+         pthread_cond_broadcast(&g_condGuard);
+         pthread_mutex_unlock(&g_mtxGuard);
+         PrintMsg(LOG_INFO, "Resuming export.\n");
+         }
+
+// Sleep for an interval, but wake up now and then to check if we are done.
+      for(i = 0; i < g_nGuardInterval * 10 && !g_bGuardStop && !g_bStop; i++)
+         usleep(100000);
+      }
+
+// Make sure no thread is left waiting.
+   pthread_mutex_lock(&g_mtxGuard);
+   if(g_bGuardPause)
+      g_llGuardUsecs += GetUsecs() - llPauseStart;
+   g_bGuardPause = FALSE;
+   pthread_cond_broadcast(&g_condGuard);
+   pthread_mutex_unlock(&g_mtxGuard);
+   mysql_close(pMySQL);
+
+   return NULL;
+   } // End of GuardThread()
+
+
+/*
+ * Function: GetServerLoad()
+ * Get the number of running threads and the replica lag of the server.
+ * Arguments:
+ * MYSQL *pMySQL - The connection to use.
+ * long *plThreadsRunning - Set to the value of Threads_running.
+ * long *plReplicaLag - Set to the replica lag in seconds, -1 if the server
+ *   is not a replica.
+ * Returns:
+ * BOOL - TRUE if there is an error or replication is stopped, else FALSE.
+ */
+BOOL GetServerLoad(MYSQL *pMySQL, long *plThreadsRunning, long *plReplicaLag)
+   {
+   MYSQL_RES *pRes;
+   MYSQL_ROW pRow;
+   MYSQL_FIELD *pFields;
+   unsigned int i;
+   BOOL bStopped = FALSE;
+
+   *plThreadsRunning = 0;
+   *plReplicaLag = -1;
+
+// Get the number of running threads.
+   if(mysql_query(pMySQL, "SHOW GLOBAL STATUS LIKE 'Threads_running'") != 0
+     || (pRes = mysql_store_result(pMySQL)) == NULL)
+      {
+      fprintf(stderr, "MySQL Error %d checking server load:\n%s\n",
+        mysql_errno(pMySQL), mysql_error(pMySQL));
+      return TRUE;
+      }
+   if((pRow = mysql_fetch_row(pRes)) != NULL && pRow[1] != NULL)
+      *plThreadsRunning = atol(pRow[1]);
+   mysql_free_result(pRes);
+
+// Get the replica lag. Older servers only know SHOW SLAVE STATUS.
+   if(g_nMaxReplicaLag == 0)
+      return FALSE;
+   if(mysql_query(pMySQL, "SHOW REPLICA STATUS") != 0
+     && mysql_query(pMySQL, "SHOW SLAVE STATUS") != 0)
+      {
+      fprintf(stderr, "MySQL Error %d checking replica lag:\n%s\n",
+        mysql_errno(pMySQL), mysql_error(pMySQL));
+      return TRUE;
+      }
+   if((pRes = mysql_store_result(pMySQL)) == NULL)
+      return FALSE;
+   if((pRow = mysql_fetch_row(pRes)) != NULL)
+      {
+      pFields = mysql_fetch_fields(pRes);
+      for(i = 0; i < mysql_num_fields(pRes); i++)
+         {
+         if(strcasecmp(pFields[i].name, "Seconds_Behind_Source") == 0
+           || strcasecmp(pFields[i].name, "Seconds_Behind_Master") == 0)
+            {
+            if(pRow[i] == NULL)
+               bStopped = TRUE;
+            else
+               *plReplicaLag = atol(pRow[i]);
+            }
+         }
+      }
+   mysql_free_result(pRes);
+
+// The lag of a stopped replica is unknown, and it won't catch up on its own.
+   if(bStopped)
+      {
+      fprintf(stderr, "Replication is stopped, the replica lag is unknown.\n");
+      return TRUE;
+      }
+
+   return FALSE;
+   } // End of GetServerLoad()
+
+
+/*
+ * Function: PrefetchWait()
+ * Wait for a prefetched batch.
+ * Arguments:
+ * PEXPORTSTATE pState - The export state.
+ * Returns:
+ * MYSQL_RES * - The result of the batch, NULL if there is an error.
+ */
+MYSQL_RES *PrefetchWait(PEXPORTSTATE pState)
+   {
+   pthread_join(pState->thrPrefetch, NULL);
+   pState->bPrefetch = FALSE;
+
+   return pState->pPrefetchRes;
+   } // End of PrefetchWait()
+
+
+/*
+ * Function: PrefetchThread()
+ * Thread that selects the next batch of a table on the second connection.
+ * Arguments:
+ * void *pData - The export state.
+ * Returns:
+ * void * - Always NULL.
+ */
+void *PrefetchThread(void *pData)
+   {
+   PEXPORTSTATE pState = (PEXPORTSTATE) pData;
+
+   if(mysql_query(pState->pMySQLNext, pState->pTable->pSQL) != 0)
+      pState->pPrefetchRes = NULL;
+   else
+      pState->pPrefetchRes = mysql_store_result(pState->pMySQLNext);
+
+   return NULL;
+   } // End of PrefetchThread()
+
+
+/*
+ * Function: SetBatchCursor()
+ * Set the batch cursor, which is the last key exported, of a table with a
+ * key range that may be split by other threads, and get the current end of
+ * that range.
+ * Arguments:
+ * PJSONTABLE pTable - The table to set the cursor for.
+ * char *pValue - The new cursor value.
+ * long long *pllEnd - Set to the last key of the range.
+ * Returns:
+ * BOOL - TRUE if there is an error, else FALSE.
+ */
+BOOL SetBatchCursor(PJSONTABLE pTable, char *pValue, long long *pllEnd)
+   {
+   pthread_mutex_lock(&pTable->mtxRange);
+   if(SetBatchValue(pTable->pBatchCol, pValue))
+      {
+      pthread_mutex_unlock(&pTable->mtxRange);
+      return TRUE;
+      }
+   *pllEnd = pTable->pRangeEnd == NULL ? LLONG_MAX
+     : strtoll(pTable->pRangeEnd, NULL, 10);
+   pthread_mutex_unlock(&pTable->mtxRange);
+
+   return FALSE;
+   } // End of SetBatchCursor()
+
+
+/*
+ * Function: SetBatchValue()
+ * Set the last value of the batching column. The buffer holding the value
+ * is reused and only grown when a longer value comes along.
+ * Arguments:
+ * PJSONCOL pCol - The batching column.
+ * char *pValue - The value to set.
+ * Returns:
+ * BOOL - TRUE if there is an error, else FALSE.
+ */
+BOOL SetBatchValue(PJSONCOL pCol, char *pValue)
+   {
+   size_t nLen = strlen(pValue) + 1;
+   char *pTmp;
+
+   if(pCol->pPrevValue == NULL || nLen > pCol->nPrevValueSize)
+      {
+      if((pTmp = realloc(pCol->pPrevValue, nLen)) == NULL)
+         {
+         fprintf(stderr, "Memory allocation error.\n");
+         return TRUE;
+         }
+      pCol->pPrevValue = pTmp;
+      pCol->nPrevValueSize = nLen;
+      }
+   memcpy(pCol->pPrevValue, pValue, nLen);
+
+   return FALSE;
+   } // End of SetBatchValue()
+
+
+/*
+ * Function: SetBatchValues()
+ * Set the last values of all the key columns of a table from a row.
+ * Arguments:
+ * PJSONTABLE pTable - The table being batched.
+ * MYSQL_ROW pRow - The last row of the batch.
+ * Returns:
+ * BOOL - TRUE if there is an error, else FALSE.
+ */
+BOOL SetBatchValues(PJSONTABLE pTable, MYSQL_ROW pRow)
+   {
+   unsigned int i;
+
+   for(i = 0; i < pTable->nKeyCols; i++)
+      {
+      if(pRow[pTable->pKeyCols[i]->nMySQLCol] == NULL)
+         {
+         fprintf(stderr,"Record %ld in table %s has batching column as NULL. Stopping.\n",
+           pTable->lRows, pTable->pName);
+         return TRUE;
+         }
+      if(SetBatchValue(pTable->pKeyCols[i], pRow[pTable->pKeyCols[i]->nMySQLCol]))
+         return TRUE;
+      }
+
+   return FALSE;
+   } // End of SetBatchValues()
+
+
+/*
+ * Function: FormatRow()
+ * Format a row as a JSON object and add it to a buffer.
+ * Arguments:
+ * PJSONTABLE pTable - The table the row is from.
+ * MYSQL_ROW pRow - The row to format.
+ * unsigned long *pLengths - The lengths of the columns in the row.
+ * PROWBUF pBuf - Buffer to add the row to.
+ * BOOL bFirst - This is the first row in the file.
+ * Returns:
+ * BOOL - TRUE if there is an error, else FALSE.
+ */
+BOOL FormatRow(PJSONTABLE pTable, MYSQL_ROW pRow, unsigned long *pLengths,
+  PROWBUF pBuf, BOOL bFirst)
+   {
+   BOOL bFirstCol = TRUE;
+   PEMITOP pOp;
+   unsigned int i;
+   unsigned long lLen = 0;
+   char szTmp[32];
+   char *pValue = NULL;
+   char *pEnd;
+
+// Add the trailing CRLF and also a coma if exporting as an array.
+   if(!bFirst && RowBufAdd(pBuf, g_bArrayFile ? ",\n" : "\n",
+     g_bArrayFile ? 2 : 1))
+      return TRUE;
+   if(RowBufAdd(pBuf, "{", 1))
+      return TRUE;
+
+// Now, run the ops of the emission plan. The key of the first column added
+// is without the coma.
+   for(pOp = pTable->pOps, i = 0; i < pTable->nOps; pOp++, i++)
+      {
+// Skip NULL and empty values.
+      if(pOp->nMySQLCol >= 0)
+         {
+         pValue = pRow[pOp->nMySQLCol];
+         lLen = pLengths[pOp->nMySQLCol];
+         if((pValue == NULL && g_bSkipNull)
+           || (pValue != NULL && lLen == 0 && g_bSkipEmpty))
+            continue;
+         }
+
+// Constant columns have the key and value in one fragment.
+      if(pOp->nOp == EMIT_OP_CONST)
+         {
+         if(RowBufAdd(pBuf, pOp->pConst + (bFirstCol ? 1 : 0),
+           pOp->nConstLen - (bFirstCol ? 1 : 0)))
+            return TRUE;
+         bFirstCol = FALSE;
+         continue;
+         }
+
+// Add column name.
+      if(RowBufAdd(pBuf, pOp->pCol->pJSONKey + (bFirstCol ? 1 : 0),
+        pOp->pCol->nJSONKeyLen - (bFirstCol ? 1 : 0)))
+         return TRUE;
+      bFirstCol = FALSE;
+
+// Add column value.
+      if(pOp->nMySQLCol >= 0 && pValue == NULL)
+         {
+         if(RowBufAdd(pBuf, "null", 4))
+            return TRUE;
+         continue;
+         }
+      switch(pOp->nOp)
+         {
+         case EMIT_OP_COUNTER:
+            sprintf(szTmp, pOp->bQuote ? "\"%ld\"" : "%ld", pOp->pCol->lValue);
+            pOp->pCol->lValue += pOp->pCol->lIncr;
+            if(RowBufAdd(pBuf, szTmp, strlen(szTmp)))
+               return TRUE;
+            break;
+
+         case EMIT_OP_BOOL:
+            if(*pValue == '0' ? RowBufAdd(pBuf, "false", 5)
+              : RowBufAdd(pBuf, "true", 4))
+               return TRUE;
+            break;
+
+// Numeric and temporal values are copied as is.
+         case EMIT_OP_RAW:
+            if(RowBufReserve(pBuf, lLen + 2))
+               return TRUE;
+            pEnd = pBuf->pData + pBuf->nLen;
+            if(pOp->bQuote)
+               *pEnd++ = '"';
+            memcpy(pEnd, pValue, lLen);
+            pEnd += lLen;
+            if(pOp->bQuote)
+               *pEnd++ = '"';
+            pBuf->nLen = pEnd - pBuf->pData;
+            break;
+
+// Escape the value right into the buffer, in one pass. An escaped
+// character is at most 6 characters long. Large values are escaped in
+// pieces, so as not to reserve 6 times their size.
+         case EMIT_OP_VALUE:
+            if(lLen > ROWBUF_FLUSH_SIZE)
+               {
+               if((pOp->bQuote && RowBufAdd(pBuf, "\"", 1))
+                 || RowBufEscape(pBuf, pValue, lLen)
+                 || (pOp->bQuote && RowBufAdd(pBuf, "\"", 1)))
+                  return TRUE;
+               break;
+               }
+            if(RowBufReserve(pBuf, lLen * 6 + 2))
+               return TRUE;
+            pEnd = pBuf->pData + pBuf->nLen;
+            if(pOp->bQuote)
+               *pEnd++ = '"';
+            pEnd = g_pJSONEscape(pValue, lLen, pEnd);
+            if(pOp->bQuote)
+               *pEnd++ = '"';
+            pBuf->nLen = pEnd - pBuf->pData;
+            break;
+         }
+      }
+   if(RowBufAdd(pBuf, "}", 1))
+      return TRUE;
+
+   return FALSE;
+   } // End of FormatRow()
+
+
+/*
+ * Function: SetColKeys()
+ * Set the JSON key fragment of each column of a table, that is the coma,
+ * the quoted name and the colon, as added before the value of the column.
+ * Arguments:
+ * PJSONTABLE pTable - The table to set the column keys for.
+ * Returns:
+ * BOOL - TRUE if there is an error, else FALSE.
+ */
+BOOL SetColKeys(PJSONTABLE pTable)
+   {
+   unsigned int i;
+
+   for(i = 0; i < pTable->nCols; i++)
+      {
+      if(pTable->pCols[i].pJSONKey != NULL || pTable->pCols[i].pJSONName == NULL)
+         continue;
+      pTable->pCols[i].nJSONKeyLen = strlen(pTable->pCols[i].pJSONName) + 4;
+      if((pTable->pCols[i].pJSONKey = malloc(pTable->pCols[i].nJSONKeyLen + 1))
+        == NULL)
+         {
+         fprintf(stderr, "Memory allocation error.\n");
+         return TRUE;
+         }
+      sprintf(pTable->pCols[i].pJSONKey, ",\"%s\":", pTable->pCols[i].pJSONName);
+      }
+
+   return FALSE;
+   } // End of SetColKeys()
+
+
+/*
+ * Function: SetEmitPlan()
+ * Compile the column flags of a table into the ops that emit a row, once
+ * the columns of the result are known.
+ * Arguments:
+ * PJSONTABLE pTable - The table to set the emission plan for.
+ * Returns:
+ * BOOL - TRUE if there is an error, else FALSE.
+ */
+BOOL SetEmitPlan(PJSONTABLE pTable)
+   {
+   PJSONCOL pCol;
+   PEMITOP pOp;
+   unsigned int i;
+   BOOL bQuote;
+   char *pValue;
+
+   if(SetColKeys(pTable))
+      return TRUE;
+   if((pTable->pOps = calloc(pTable->nCols, sizeof(EMITOP))) == NULL)
+      {
+      fprintf(stderr, "Memory allocation error.\n");
+      return TRUE;
+      }
+   pTable->nOps = 0;
+
+   for(i = 0; i < pTable->nCols; i++)
+      {
+// Skipped columns, and columns that are neither in the result nor have a
+// fixed value, are not emitted.
+      pCol = &pTable->pCols[i];
+      if(JSONCOL_FLAG_CHECK(pCol, SKIP)
+        || (!JSONCOL_FLAG_CHECK(pCol, MYSQL) && !JSONCOL_FLAG_CHECK(pCol, FIXED)))
+         continue;
+
+      pOp = &pTable->pOps[pTable->nOps++];
+      pOp->pCol = pCol;
+      pOp->nMySQLCol = JSONCOL_FLAG_CHECK(pCol, MYSQL) ? pCol->nMySQLCol : -1;
+      bQuote = (JSONCOL_FLAG_CHECK(pCol, QUOTED)
+        || (!JSONCOL_FLAG_CHECK(pCol, NUMERIC) && !JSONCOL_FLAG_CHECK(pCol, JSON)))
+        && !JSONCOL_FLAG_CHECK(pCol, UNQUOTED);
+
+// Fixed numeric columns are counters, even if also in the result.
+      if(JSONCOL_FLAG_CHECK(pCol, FIXEDNUMERIC))
+         {
+         pOp->nOp = EMIT_OP_COUNTER;
+         pOp->bQuote = JSONCOL_FLAG_CHECK(pCol, QUOTED);
+         }
+// Other fixed values are formatted once, together with the key.
+      else if(pOp->nMySQLCol < 0)
+         {
+         pOp->nOp = EMIT_OP_CONST;
+         if(JSONCOL_FLAG_CHECK(pCol, NULL))
+            {
+            pValue = "null";
+            bQuote = FALSE;
+            }
+         else if(JSONCOL_FLAG_CHECK(pCol, BOOL))
+            {
+            pValue = *(pCol->pValue) == '0' ? "false" : "true";
+            bQuote = FALSE;
+            }
+         else
+            pValue = pCol->pValue;
+         pOp->nConstLen = pCol->nJSONKeyLen + strlen(pValue) + (bQuote ? 2 : 0);
+         if((pOp->pConst = malloc(pOp->nConstLen + 1)) == NULL)
+            {
+            fprintf(stderr, "Memory allocation error.\n");
+            return TRUE;
+            }
+         sprintf(pOp->pConst, bQuote ? "%s\"%s\"" : "%s%s", pCol->pJSONKey,
+           pValue);
+         }
+      else if(JSONCOL_FLAG_CHECK(pCol, BOOL))
+         pOp->nOp = EMIT_OP_BOOL;
+      else
+         {
+// A JSON document that is to be quoted is exported as a string.
+         pOp->nOp = JSONCOL_FLAG_CHECK(pCol, NOESCAPE)
+           && !(JSONCOL_FLAG_CHECK(pCol, JSON) && bQuote) ? EMIT_OP_RAW
+           : EMIT_OP_VALUE;
+         pOp->bQuote = bQuote;
+         }
+      }
+
+   return FALSE;
+   } // End of SetEmitPlan()
+
+
+/*
+ * Function: RowBufAdd()
+ * Add data to a row buffer, growing the buffer as needed.
+ * Arguments:
+ * PROWBUF pBuf - The buffer to add to.
+ * char *pData - The data to add.
+ * size_t nLen - The length of the data.
+ * Returns:
+ * BOOL - TRUE if there is an error, else FALSE.
+ */
+BOOL RowBufAdd(PROWBUF pBuf, char *pData, size_t nLen)
+   {
+   if(pBuf->nLen + nLen > pBuf->nSize && RowBufReserve(pBuf, nLen))
+      return TRUE;
+   memcpy(pBuf->pData + pBuf->nLen, pData, nLen);
+   pBuf->nLen += nLen;
+
+   return FALSE;
+   } // End of RowBufAdd()
+
+
+/*
+ * Function: RowBufReserve()
+ * Make sure there is room for more data in a row buffer.
+ * Arguments:
+ * PROWBUF pBuf - The buffer.
+ * size_t nLen - The length of the data to make room for.
+ * Returns:
+ * BOOL - TRUE if there is an error, else FALSE.
+ */
+BOOL RowBufReserve(PROWBUF pBuf, size_t nLen)
+   {
+   size_t nSize;
+   char *pTmp;
+
+   if(pBuf->nLen + nLen <= pBuf->nSize)
+      return FALSE;
+
+   for(nSize = pBuf->nSize == 0 ? ROWBUF_FLUSH_SIZE : pBuf->nSize;
+     nSize < pBuf->nLen + nLen; nSize *= 2)
+      ;
+   if((pTmp = realloc(pBuf->pData, nSize)) == NULL)
+      {
+      fprintf(stderr, "Memory allocation error.\n");
+      return TRUE;
+      }
+   pBuf->pData = pTmp;
+   pBuf->nSize = nSize;
+
+   return FALSE;
+   } // End of RowBufReserve()
+
+
+/*
+ * Function: RowBufEscape()
+ * Escape a large value for JSON into a row buffer. The value is escaped in
+ * pieces of ROWBUF_FLUSH_SIZE bytes, and the buffer is flushed between the
+ * pieces if it has a flush function. A piece isn't ended inside a UTF-8
+ * sequence.
+ * Arguments:
+ * PROWBUF pBuf - The buffer.
+ * char *pValue - The value to escape.
+ * size_t nLen - The length of the value.
+ * Returns:
+ * BOOL - TRUE if there is an error, else FALSE.
+ */
+BOOL RowBufEscape(PROWBUF pBuf, char *pValue, size_t nLen)
+   {
+   size_t nPart;
+   unsigned int i;
+
+   while(nLen > 0)
+      {
+      nPart = nLen;
+      if(nPart > ROWBUF_FLUSH_SIZE)
+         {
+         nPart = ROWBUF_FLUSH_SIZE;
+         for(i = 0; i < 3
+           && ((unsigned char) pValue[nPart] & 0xC0) == 0x80; i++)
+            nPart--;
+         }
+      if(RowBufReserve(pBuf, nPart * 6))
+         return TRUE;
+      pBuf->nLen = g_pJSONEscape(pValue, nPart, pBuf->pData + pBuf->nLen)
+        - pBuf->pData;
+      pValue += nPart;
+      nLen -= nPart;
+
+      if(nLen > 0 && pBuf->pFlush != NULL && pBuf->nLen >= ROWBUF_FLUSH_SIZE
+        && pBuf->pFlush(pBuf, pBuf->pFlushData))
+         return TRUE;
+      }
+
+   return FALSE;
+   } // End of RowBufEscape()
+
+
+/*
+ * Function: RowBufFlush()
+ * Write the contents of a row buffer to the file of a table and empty it.
+ * Arguments:
+ * PROWBUF pBuf - The buffer to write.
+ * void *pData - The table to write to.
+ * Returns:
+ * BOOL - TRUE if there is an error, else FALSE.
+ */
+BOOL RowBufFlush(PROWBUF pBuf, void *pData)
+   {
+   PJSONTABLE pTable = (PJSONTABLE) pData;
+
+   pTable->llFormatBytes += pBuf->nLen;
+   if(fwrite(pBuf->pData, 1, pBuf->nLen, pTable->fd) != pBuf->nLen)
+      {
+      fprintf(stderr, "Error %d writing table %s\n", errno, pTable->pName);
+      return TRUE;
+      }
+   pBuf->nLen = 0;
+
+   return FALSE;
+   } // End of RowBufFlush()
+
+
+/*
+ * Function: PipeStart()
+ * Set up the pipeline of a table export and start the format and write
+ * threads.
+ * Arguments:
+ * PEXPORTPIPE pPipe - The pipeline to start.
+ * PJSONTABLE pTable - The table to export.
+ * Returns:
+ * BOOL - TRUE if there is an error, else FALSE.
+ */
+BOOL PipeStart(PEXPORTPIPE pPipe, PJSONTABLE pTable)
+   {
+   int nRet;
+
+   memset(pPipe, 0, sizeof(EXPORTPIPE));
+   pPipe->pTable = pTable;
+   RingInit(&pPipe->ringRows);
+   RingInit(&pPipe->ringOut);
+
+   if((nRet = pthread_create(&pPipe->thrWrite, NULL, WriteThread,
+     (void *) pPipe)) != 0)
+      {
+      PrintMsg(LOG_ERROR, "pthread_create() error: %d\n", nRet);
+      RingFree(&pPipe->ringRows);
+      RingFree(&pPipe->ringOut);
+      return TRUE;
+      }
+   if((nRet = pthread_create(&pPipe->thrFormat, NULL, FormatThread,
+     (void *) pPipe)) != 0)
+      {
+      PrintMsg(LOG_ERROR, "pthread_create() error: %d\n", nRet);
+      RingPut(&pPipe->ringOut, NULL);
+      pthread_join(pPipe->thrWrite, NULL);
+      RingFree(&pPipe->ringRows);
+      RingFree(&pPipe->ringOut);
+      return TRUE;
+      }
+
+   return FALSE;
+   } // End of PipeStart()
+
+
+/*
+ * Function: PipeAddRow()
+ * Copy a fetched row to the current chunk of the pipeline. When the chunk is
+ * full, it is passed on to the format thread.
+ * Arguments:
+ * PEXPORTPIPE pPipe - The pipeline.
+ * MYSQL_ROW pRow - The row to add.
+ * unsigned long *pLengths - The lengths of the columns in the row.
+ * Returns:
+ * BOOL - TRUE if there is an error, else FALSE.
+ */
+BOOL PipeAddRow(PEXPORTPIPE pPipe, MYSQL_ROW pRow, unsigned long *pLengths)
+   {
+   PROWCHUNK pChunk = pPipe->pChunk;
+   unsigned long lLen = 0;
+   unsigned int i;
+   unsigned int nAlloc;
+   char **pCols;
+   void *pNew;
+
+   for(i = 0; i < pPipe->nFields; i++)
+      lLen += pRow[i] == NULL ? 0 : pLengths[i] + 1;
+
+// Pass on the current chunk if the row doesn't fit in it.
+   if(pChunk != NULL && pChunk->lData + lLen > pChunk->lDataAlloc)
+      {
+      pPipe->pChunk = NULL;
+      if(RingPut(&pPipe->ringRows, pChunk))
+         {
+         PipeFreeChunk(pChunk);
+         return TRUE;
+         }
+      pChunk = NULL;
+      }
+
+// Get an empty chunk if needed.
+   if(pChunk == NULL)
+      {
+      if((pChunk = PipeGetChunk(pPipe, lLen)) == NULL)
+         return TRUE;
+      pPipe->pChunk = pChunk;
+      }
+   if((pChunk->nRows + 1) * pPipe->nFields > pChunk->nRowsAlloc)
+      {
+      nAlloc = pChunk->nRowsAlloc == 0 ? pPipe->nFields * 64
+        : pChunk->nRowsAlloc * 2;
+      if((pNew = realloc(pChunk->pRows, nAlloc * sizeof(char *))) == NULL)
+         {
+         fprintf(stderr, "Memory allocation error.\n");
+         return TRUE;
+         }
+      pChunk->pRows = pNew;
+      if((pNew = realloc(pChunk->pLengths, nAlloc * sizeof(unsigned long)))
+        == NULL)
+         {
+         fprintf(stderr, "Memory allocation error.\n");
+         return TRUE;
+         }
+      pChunk->pLengths = pNew;
+      pChunk->nRowsAlloc = nAlloc;
+      }
+
+// Copy the column values.
+   pCols = &pChunk->pRows[pChunk->nRows * pPipe->nFields];
+   for(i = 0; i < pPipe->nFields; i++)
+      {
+      if(pRow[i] == NULL)
+         pCols[i] = NULL;
+      else
+         {
+         pCols[i] = &pChunk->pData[pChunk->lData];
+         pChunk->pLengths[pChunk->nRows * pPipe->nFields + i] = pLengths[i];
+         memcpy(pCols[i], pRow[i], pLengths[i]);
+         pCols[i][pLengths[i]] = '\0';
+         pChunk->lData += pLengths[i] + 1;
+         }
+      }
+   pChunk->nRows++;
+
+   return FALSE;
+   } // End of PipeAddRow()
+
+
+/*
+ * Function: PipeFinish()
+ * Pass on the last rows of a table export, wait for them to be written and
+ * add the pipeline statistics to the table.
+ * Arguments:
+ * PEXPORTPIPE pPipe - The pipeline to finish.
+ * Returns:
+ * BOOL - TRUE if there is an error, else FALSE.
+ */
+BOOL PipeFinish(PEXPORTPIPE pPipe)
+   {
+   PROWCHUNK pChunk;
+   POUTBLOCK pBlock;
+
+// Pass on the last chunk and then the end of the rows.
+   if(pPipe->pChunk != NULL && !RingPut(&pPipe->ringRows, pPipe->pChunk))
+      pPipe->pChunk = NULL;
+   RingPut(&pPipe->ringRows, NULL);
+   pthread_join(pPipe->thrFormat, NULL);
+   pthread_join(pPipe->thrWrite, NULL);
+
+// Free anything left behind if the export was stopped, and the chunks and
+// blocks kept for reuse.
+   if(pPipe->pChunk != NULL)
+      PipeFreeChunk(pPipe->pChunk);
+   while(pPipe->ringRows.nHead != pPipe->ringRows.nTail)
+      {
+      if((pChunk = pPipe->ringRows.pItems[pPipe->ringRows.nHead++ % PIPE_RING_SIZE]) != NULL)
+         PipeFreeChunk(pChunk);
+      }
+   while(pPipe->ringOut.nHead != pPipe->ringOut.nTail)
+      {
+      if((pBlock = pPipe->ringOut.pItems[pPipe->ringOut.nHead++ % PIPE_RING_SIZE]) != NULL)
+         PipeFreeBlock(pBlock);
+      }
+   while((pChunk = RingTryGet(&pPipe->ringFreeRows)) != NULL)
+      PipeFreeChunk(pChunk);
+   while((pBlock = RingTryGet(&pPipe->ringFreeOut)) != NULL)
+      PipeFreeBlock(pBlock);
+
+   AddPipeStats(&pPipe->pTable->statRows, &pPipe->ringRows.stats);
+   AddPipeStats(&pPipe->pTable->statOut, &pPipe->ringOut.stats);
+   RingFree(&pPipe->ringRows);
+   RingFree(&pPipe->ringOut);
+   pPipe->pTable->llFormatBytes += pPipe->llFormatBytes;
+   pPipe->pTable->llFormatUsecs += pPipe->llFormatUsecs;
+
+   return pPipe->bError;
+   } // End of PipeFinish()
+
+
+/*
+ * Function: PipeGetChunk()
+ * Get an empty chunk for the rows of a pipeline, reusing one that the format
+ * thread is done with if there is one.
+ * Arguments:
+ * PEXPORTPIPE pPipe - The pipeline.
+ * unsigned long lLen - The size of the first row to go in the chunk.
+ * Returns:
+ * PROWCHUNK - The chunk, NULL if there is an error.
+ */
+PROWCHUNK PipeGetChunk(PEXPORTPIPE pPipe, unsigned long lLen)
+   {
+   PROWCHUNK pChunk;
+
+   if((pChunk = RingTryGet(&pPipe->ringFreeRows)) != NULL)
+      {
+      pChunk->nRows = 0;
+      pChunk->lData = 0;
+      if(lLen <= pChunk->lDataAlloc)
+         return pChunk;
+      PipeFreeChunk(pChunk);
+      }
+
+   if((pChunk = calloc(1, sizeof(ROWCHUNK))) == NULL)
+      {
+      fprintf(stderr, "Memory allocation error.\n");
+      return NULL;
+      }
+   pChunk->lDataAlloc = lLen > PIPE_CHUNK_SIZE ? lLen : PIPE_CHUNK_SIZE;
+   if((pChunk->pData = malloc(pChunk->lDataAlloc)) == NULL)
+      {
+      free(pChunk);
+      fprintf(stderr, "Memory allocation error.\n");
+      return NULL;
+      }
+
+   return pChunk;
+   } // End of PipeGetChunk()
+
+
+/*
+ * Function: PipePutChunk()
+ * Send a chunk that is formatted back to the fetching thread for reuse. A
+ * chunk that was grown for a large row, or that there is no room for, is
+ * freed.
+ * Arguments:
+ * PEXPORTPIPE pPipe - The pipeline.
+ * PROWCHUNK pChunk - The chunk.
+ */
+void PipePutChunk(PEXPORTPIPE pPipe, PROWCHUNK pChunk)
+   {
+   if(pChunk->lDataAlloc > PIPE_CHUNK_SIZE
+     || RingTryPut(&pPipe->ringFreeRows, pChunk))
+      PipeFreeChunk(pChunk);
+
+   return;
+   } // End of PipePutChunk()
+
+
+/*
+ * Function: PipeFreeChunk()
+ * Free a chunk of rows.
+ * Arguments:
+ * PROWCHUNK pChunk - The chunk.
+ */
+void PipeFreeChunk(PROWCHUNK pChunk)
+   {
+   free(pChunk->pRows);
+   free(pChunk->pLengths);
+   free(pChunk->pData);
+   free(pChunk);
+
+   return;
+   } // End of PipeFreeChunk()
+
+
+/*
+ * Function: PipeGetBlock()
+ * Get a block to format rows into, reusing one that the write thread is done
+ * with if there is one. The buffer of a new block is allocated as the rows are
+ * formatted.
+ * Arguments:
+ * PEXPORTPIPE pPipe - The pipeline.
+ * Returns:
+ * POUTBLOCK - The block, NULL if there is an error.
+ */
+POUTBLOCK PipeGetBlock(PEXPORTPIPE pPipe)
+   {
+   POUTBLOCK pBlock;
+
+   if((pBlock = RingTryGet(&pPipe->ringFreeOut)) == NULL
+     && (pBlock = calloc(1, sizeof(OUTBLOCK))) == NULL)
+      {
+      fprintf(stderr, "Memory allocation error.\n");
+      return NULL;
+      }
+   pBlock->nLen = 0;
+
+   return pBlock;
+   } // End of PipeGetBlock()
+
+
+/*
+ * Function: PipePutBlock()
+ * Send a block that is written back to the format thread for reuse. A block
+ * with a buffer grown large, or that there is no room for, is freed.
+ * Arguments:
+ * PEXPORTPIPE pPipe - The pipeline.
+ * POUTBLOCK pBlock - The block.
+ */
+void PipePutBlock(PEXPORTPIPE pPipe, POUTBLOCK pBlock)
+   {
+   if(pBlock->nSize > PIPE_BLOCK_KEEP
+     || RingTryPut(&pPipe->ringFreeOut, pBlock))
+      PipeFreeBlock(pBlock);
+
+   return;
+   } // End of PipePutBlock()
+
+
+/*
+ * Function: PipeFreeBlock()
+ * Free a block of formatted JSON.
+ * Arguments:
+ * POUTBLOCK pBlock - The block.
+ */
+void PipeFreeBlock(POUTBLOCK pBlock)
+   {
+   if(pBlock->pData != NULL)
+      free(pBlock->pData);
+   free(pBlock);
+
+   return;
+   } // End of PipeFreeBlock()
+
+
+/*
+ * Function: FormatThread()
+ * Pipeline thread that formats chunks of rows as JSON.
+ * Arguments:
+ * void *pData - The pipeline.
+ * Returns:
+ * void * - Always NULL.
+ */
+void *FormatThread(void *pData)
+   {
+   PEXPORTPIPE pPipe = (PEXPORTPIPE) pData;
+   PROWCHUNK pChunk;
+   POUTBLOCK pBlock;
+   ROWBUF buf;
+   BOOL bFirst = TRUE;
+   unsigned int i;
+   unsigned long long llStart;
+
+   while((pChunk = RingGet(&pPipe->ringRows)) != NULL)
+      {
+      if((pBlock = PipeGetBlock(pPipe)) == NULL)
+         {
+         PipeFreeChunk(pChunk);
+         goto ErrExit;
+         }
+      memset(&buf, 0, sizeof(ROWBUF));
+      buf.pData = pBlock->pData;
+      buf.nSize = pBlock->nSize;
+      buf.pFlush = FormatFlush;
+      buf.pFlushData = pPipe;
+
+// Format the rows in the chunk into the buffer of the block, which is then
+// handed over to the write thread as is.
+      llStart = GetUsecs();
+      for(i = 0; i < pChunk->nRows; i++)
+         {
+         if(FormatRow(pPipe->pTable, &pChunk->pRows[i * pPipe->nFields],
+           &pChunk->pLengths[i * pPipe->nFields], &buf, bFirst))
+            {
+            pBlock->pData = buf.pData;
+            PipeFreeBlock(pBlock);
+            PipeFreeChunk(pChunk);
+            goto ErrExit;
+            }
+         bFirst = FALSE;
+         }
+      pPipe->llFormatUsecs += GetUsecs() - llStart;
+      pPipe->llFormatBytes += buf.nLen;
+      pBlock->pData = buf.pData;
+      pBlock->nLen = buf.nLen;
+      pBlock->nSize = buf.nSize;
+      PipePutChunk(pPipe, pChunk);
+
+// And pass them on to be written.
+      if(RingPut(&pPipe->ringOut, pBlock))
+         {
+         PipeFreeBlock(pBlock);
+         break;
+         }
+      }
+   RingPut(&pPipe->ringOut, NULL);
+
+   return NULL;
+
+ErrExit:
+   pPipe->bError = TRUE;
+   g_bStop = TRUE;
+   RingPut(&pPipe->ringOut, NULL);
+
+   return NULL;
+   } // End of FormatThread()
+
+
+/*
+ * Function: FormatFlush()
+ * Pass what is formatted so far in the buffer of the format thread on to be
+ * written, when a large value is formatted.
+ * Arguments:
+ * PROWBUF pBuf - The buffer of the format thread.
+ * void *pData - The pipeline.
+ * Returns:
+ * BOOL - TRUE if there is an error, else FALSE.
+ */
+BOOL FormatFlush(PROWBUF pBuf, void *pData)
+   {
+   PEXPORTPIPE pPipe = (PEXPORTPIPE) pData;
+   POUTBLOCK pBlock;
+   char *pFree;
+   size_t nFree;
+
+// Swap the buffer for the empty one of another block.
+   if((pBlock = PipeGetBlock(pPipe)) == NULL)
+      return TRUE;
+   pPipe->llFormatBytes += pBuf->nLen;
+   pFree = pBlock->pData;
+   nFree = pBlock->nSize;
+   pBlock->pData = pBuf->pData;
+   pBlock->nLen = pBuf->nLen;
+   pBlock->nSize = pBuf->nSize;
+   pBuf->pData = pFree;
+   pBuf->nSize = nFree;
+   pBuf->nLen = 0;
+   if(RingPut(&pPipe->ringOut, pBlock))
+      {
+      PipeFreeBlock(pBlock);
+      return TRUE;
+      }
+
+   return FALSE;
+   } // End of FormatFlush()
+
+
+/*
+ * Function: WriteThread()
+ * Pipeline thread that writes formatted blocks of JSON to the table file.
+ * Arguments:
+ * void *pData - The pipeline.
+ * Returns:
+ * void * - Always NULL.
+ */
+void *WriteThread(void *pData)
+   {
+   PEXPORTPIPE pPipe = (PEXPORTPIPE) pData;
+   POUTBLOCK pBlock;
+
+   while((pBlock = RingGet(&pPipe->ringOut)) != NULL)
+      {
+      if(fwrite(pBlock->pData, 1, pBlock->nLen, pPipe->pTable->fd)
+        != pBlock->nLen)
+         {
+         fprintf(stderr, "Error %d writing table %s\n", errno,
+           pPipe->pTable->pName);
+         pPipe->bError = TRUE;
+         g_bStop = TRUE;
+         }
+      PipePutBlock(pPipe, pBlock);
+      }
+
+   return NULL;
+   } // End of WriteThread()
+
+
+/*
+ * Function: RingPut()
+ * Put an item in a pipeline ring, waiting for space if it is full. Only one
+ * thread may put items in a ring.
+ * Arguments:
+ * PPIPERING pRing - The ring.
+ * void *pItem - The item to put. NULL marks the end of the items.
+ * Returns:
+ * BOOL - TRUE if the export was stopped while waiting, else FALSE.
+ */
+BOOL RingPut(PPIPERING pRing, void *pItem)
+   {
+   unsigned int nTail = pRing->nTail;
+   unsigned int nDepth;
+   unsigned int nWait;
+
+   for(nWait = 0; (nDepth = nTail - __atomic_load_n(&pRing->nHead,
+     __ATOMIC_ACQUIRE)) >= PIPE_RING_SIZE; nWait++)
+      {
+      if(nWait == 0)
+         pRing->stats.llFull++;
+      if(g_bStop)
+         return TRUE;
+      if(nWait < PIPE_SPIN_MAX)
+         sched_yield();
+      else if(RingWait(pRing, TRUE))
+         return TRUE;
+      }
+
+   pRing->pItems[nTail % PIPE_RING_SIZE] = pItem;
+   __atomic_store_n(&pRing->nTail, nTail + 1, __ATOMIC_SEQ_CST);
+   RingWake(pRing);
+
+// Keep track of the depth of the queue, not counting the end marker.
+   if(pItem != NULL)
+      {
+      pRing->stats.llPuts++;
+      pRing->stats.llDepth += nDepth + 1;
+      if(nDepth + 1 > pRing->stats.nMaxDepth)
+         pRing->stats.nMaxDepth = nDepth + 1;
+      }
+
+   return FALSE;
+   } // End of RingPut()
+
+
+/*
+ * Function: RingGet()
+ * Get an item from a pipeline ring, waiting for one if it is empty. Only one
+ * thread may get items from a ring.
+ * Arguments:
+ * PPIPERING pRing - The ring.
+ * Returns:
+ * void * - The item, NULL at the end of the items or if the export was
+ *   stopped.
+ */
+void *RingGet(PPIPERING pRing)
+   {
+   unsigned int nHead = pRing->nHead;
+   unsigned int nWait;
+   void *pItem;
+
+   for(nWait = 0; __atomic_load_n(&pRing->nTail, __ATOMIC_ACQUIRE) == nHead;
+     nWait++)
+      {
+      if(nWait == 0)
+         pRing->stats.llEmpty++;
+      if(g_bStop)
+         return NULL;
+      if(nWait < PIPE_SPIN_MAX)
+         sched_yield();
+      else if(RingWait(pRing, FALSE))
+         return NULL;
+      }
+
+   pItem = pRing->pItems[nHead % PIPE_RING_SIZE];
+   __atomic_store_n(&pRing->nHead, nHead + 1, __ATOMIC_SEQ_CST);
+   RingWake(pRing);
+
+   return pItem;
+   } // End of RingGet()
+
+
+/*
+ * Function: RingTryPut()
+ * Put an item in a pipeline ring if there is room for it, without waiting.
+ * Only one thread may put items in a ring.
+ * Arguments:
+ * PPIPERING pRing - The ring.
+ * void *pItem - The item to put.
+ * Returns:
+ * BOOL - TRUE if the ring is full, else FALSE.
+ */
+BOOL RingTryPut(PPIPERING pRing, void *pItem)
+   {
+   unsigned int nTail = pRing->nTail;
+
+   if(nTail - __atomic_load_n(&pRing->nHead, __ATOMIC_ACQUIRE)
+     >= PIPE_RING_SIZE)
+      return TRUE;
+   pRing->pItems[nTail % PIPE_RING_SIZE] = pItem;
+   __atomic_store_n(&pRing->nTail, nTail + 1, __ATOMIC_RELEASE);
+
+   return FALSE;
+   } // End of RingTryPut()
+
+
+/*
+ * Function: RingTryGet()
+ * Get an item from a pipeline ring if there is one, without waiting. Only one
+ * thread may get items from a ring.
+ * Arguments:
+ * PPIPERING pRing - The ring.
+ * Returns:
+ * void * - The item, NULL if the ring is empty.
+ */
+void *RingTryGet(PPIPERING pRing)
+   {
+   unsigned int nHead = pRing->nHead;
+   void *pItem;
+
+   if(__atomic_load_n(&pRing->nTail, __ATOMIC_ACQUIRE) == nHead)
+      return NULL;
+   pItem = pRing->pItems[nHead % PIPE_RING_SIZE];
+   __atomic_store_n(&pRing->nHead, nHead + 1, __ATOMIC_RELEASE);
+
+   return pItem;
+   } // End of RingTryGet()
+
+
+/*
+ * Function: RingInit()
+ * Set up the lock and the condition of a pipeline ring.
+ * Arguments:
+ * PPIPERING pRing - The ring.
+ */
+void RingInit(PPIPERING pRing)
+   {
+   pthread_mutex_init(&pRing->mtx, NULL);
+   pthread_cond_init(&pRing->cond, NULL);
+
+   return;
+   } // End of RingInit()
+
+
+/*
+ * Function: RingFree()
+ * Free the lock and the condition of a pipeline ring.
+ * Arguments:
+ * PPIPERING pRing - The ring.
+ */
+void RingFree(PPIPERING pRing)
+   {
+   pthread_cond_destroy(&pRing->cond);
+   pthread_mutex_destroy(&pRing->mtx);
+
+   return;
+   } // End of RingFree()
+
+
+/*
+ * Function: RingWait()
+ * Sleep until the other stage of a pipeline ring gets or puts an item. The
+ * ring is checked again after bWaiting is set, so a wake up isn't missed.
+ * The sleep is cut short now and then to check for a stop.
+ * Arguments:
+ * PPIPERING pRing - The ring.
+ * BOOL bPut - Waiting for room to put an item, else for an item to get.
+ * Returns:
+ * BOOL - TRUE if the export was stopped, else FALSE.
+ */
+BOOL RingWait(PPIPERING pRing, BOOL bPut)
+   {
+   struct timespec ts;
+
+   pthread_mutex_lock(&pRing->mtx);
+   __atomic_store_n(&pRing->bWaiting, TRUE, __ATOMIC_SEQ_CST);
+   if(bPut ? pRing->nTail - __atomic_load_n(&pRing->nHead, __ATOMIC_SEQ_CST)
+     >= PIPE_RING_SIZE
+     : __atomic_load_n(&pRing->nTail, __ATOMIC_SEQ_CST) == pRing->nHead)
+      {
+      clock_gettime(CLOCK_REALTIME, &ts);
+      ts.tv_nsec += PIPE_WAIT_MS * 1000000L;
+      if(ts.tv_nsec >= 1000000000L)
+         {
+         ts.tv_sec++;
+         ts.tv_nsec -= 1000000000L;
+         }
+      pthread_cond_timedwait(&pRing->cond, &pRing->mtx, &ts);
+      }
+   __atomic_store_n(&pRing->bWaiting, FALSE, __ATOMIC_SEQ_CST);
+   pthread_mutex_unlock(&pRing->mtx);
+
+   return g_bStop;
+   } // End of RingWait()
+
+
+/*
+ * Function: RingWake()
+ * Wake the other stage of a pipeline ring, if it sleeps in RingWait().
+ * Arguments:
+ * PPIPERING pRing - The ring.
+ */
+void RingWake(PPIPERING pRing)
+   {
+   if(__atomic_load_n(&pRing->bWaiting, __ATOMIC_SEQ_CST))
+      {
+      pthread_mutex_lock(&pRing->mtx);
+      pthread_cond_signal(&pRing->cond);
+      pthread_mutex_unlock(&pRing->mtx);
+      }
+
+   return;
+   } // End of RingWake()
+
+
+/*
+ * Function: AddPipeStats()
+ * Add pipeline queue statistics to another set of them.
+ * Arguments:
+ * PPIPESTATS pTo - The statistics to add to.
+ * PPIPESTATS pFrom - The statistics to add.
+ */
+void AddPipeStats(PPIPESTATS pTo, PPIPESTATS pFrom)
+   {
+   pTo->llPuts += pFrom->llPuts;
+   pTo->llDepth += pFrom->llDepth;
+   pTo->llFull += pFrom->llFull;
+   pTo->llEmpty += pFrom->llEmpty;
+   if(pFrom->nMaxDepth > pTo->nMaxDepth)
+      pTo->nMaxDepth = pFrom->nMaxDepth;
+
+   return;
+   } // End of AddPipeStats()
+
+
+/*
+ * Function: PrintPipeStats()
+ * Print the queue depths of the pipeline of a table. A row queue that is
+ * mostly full means formatting is the slowest stage, an empty one that
+ * fetching is, and a full write queue that writing is.
+ * Arguments:
+ * PJSONTABLE pTable - The table to print statistics for.
+ */
+void PrintPipeStats(PJSONTABLE pTable)
+   {
+   fprintf(stderr, "  Row queue: Chunks: %llu Avg depth: %.1f Max depth: %u Full: %llu Empty: %llu\n",
+     pTable->statRows.llPuts, pTable->statRows.llPuts == 0 ? 0.0
+     : (double) pTable->statRows.llDepth / pTable->statRows.llPuts,
+     pTable->statRows.nMaxDepth, pTable->statRows.llFull,
+     pTable->statRows.llEmpty);
+   fprintf(stderr, "  Write queue: Blocks: %llu Avg depth: %.1f Max depth: %u Full: %llu Empty: %llu\n",
+     pTable->statOut.llPuts, pTable->statOut.llPuts == 0 ? 0.0
+     : (double) pTable->statOut.llDepth / pTable->statOut.llPuts,
+     pTable->statOut.nMaxDepth, pTable->statOut.llFull,
+     pTable->statOut.llEmpty);
+
+   return;
+   } // End of PrintPipeStats()
+
+
+/*
+ * Function: PrintMsg()
+ * Print a message to the current log.
+ * Arguments:
+ * unsigned int nLoglevel - Log level of message.
+ * char *pFmt - Message format as defined by vprintf().
+ * ... Any arguments as per pFmt.
+ */
+void PrintMsg(unsigned int nLoglevel, char *pFmt, ...)
+   {
+   struct tm tm;
+   time_t now;
+   va_list va;
+
+   time(&now);
+   localtime_r(&now, &tm);
+
+// Print to logfile, if one is specified, or stderr if not.
+   if(LOG_LEVEL(nLoglevel) <= g_nLoglevel)
+      {
+      va_start(va, pFmt);
+      if(LOG_FLAG_CHECK(nLoglevel, STDOUT) && g_fdLog != stdout)
+         vprintf(pFmt, va);
+
+// Print date and time, unless requested not to.
+      va_start(va, pFmt);
+      if(!LOG_FLAG_CHECK(nLoglevel, NODATE))
+         fprintf(g_fdLog == NULL ? stderr : g_fdLog,
+           "%04d-%02d-%02d %02d:%02d:%02d ", 1900 + tm.tm_year,
+           tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec);
+
+      vfprintf(g_fdLog == NULL ? stderr : g_fdLog, pFmt, va);
+      va_end(va);
+      if(g_fdLog != NULL && g_fdLog != stderr)
+         fflush(g_fdLog);
+      }
+
+   return;
+   } // End of PrintMsg().
+
+
+/*
+ * Function: PrintStats()
+ * Signal handler that shows current status.
+ * Arguments:
+ * int nData - Signal to process.
+ */
+void PrintStats(int nData)
+   {
+// If this is an interupt, stop gracefully.
+   if(nData == SIGINT)
+      g_bStop = TRUE;
+
+   return;
+   } // End of PrintStats()
+
+
+/*
+ * Function: StringIsNumeric()
+ * Check if a string is numeric.
+ * Arguments:
+ * char *pStr - The string to check.
+ * BOOL bInt - Check for integer only.
+ * Returns:
+ * BOOL - TRUE if the string is a valid number, else FALSE.
+ */
+BOOL StringIsNumeric(char *pStr, BOOL bInt)
+   {
+   BOOL bComa;
+
+// Skip leading sign.
+   if(*pStr != '-' && *pStr != '+' && *pStr < '0' && *pStr > '9')
+      return FALSE;
+
+// Skip past leading digits.
+   while(*pStr >= '0' && *pStr <= '9')
+      pStr++;
+   if(*pStr == '\0')
+      return TRUE;
+   if(bInt)
+      return FALSE;
+
+// Check decimals.
+   if(*pStr == ',')
+      {
+      bComa = TRUE;
+      pStr++;
+      while(*pStr >= '0' && *pStr <= '9')
+         pStr++;
+      if(*pStr == '\0')
+         return TRUE;
+      }
+
+// Check exponent.
+   if(*pStr != 'e' || *pStr != 'E')
+      return FALSE;
+
+   pStr++;
+   if(*pStr != '-' && *pStr != '+')
+      pStr++;
+   while(*pStr >= '0' && *pStr <= '9')
+      pStr++;
+   if(*pStr == '\0')
+      return TRUE;
+
+   return FALSE;
+   } // End of StringIsNumeric()
+
+
+/*
+ * Function: json_escape()
+ * Escape a JSON string properly.
+ * Arguments:
+ * char *pStr - The JSON string to quote.
+ * char *pRet - A buffer of sufficient size to hold the JSON string.
+ * unsigned int *pnLen - Length of the string. Is set to the allocated len, unless if NULL when this is ignored.
+ * Returns:
+ * char * - A pointer to the converted string, NULL if there is an error.
+ */
+char *json_escape(char *pStr, char *pRet, unsigned int *pnLen)
+   {
+   size_t nLen = strlen(pStr);
+   size_t nEscLen = g_pJSONLenEscaped(pStr, nLen);
+
+   if(pnLen == NULL || nEscLen + 1 > *pnLen)
+      {
+      if((pRet = realloc(pRet, nEscLen + 1025)) == NULL)
+         return NULL;
+      if(pnLen != NULL)
+         *pnLen = nEscLen + 1024;
+      }
+   *g_pJSONEscape(pStr, nLen, pRet) = '\0';
+
+   return pRet;
+   } // End of json_escape()
+
+
+/*
+ * Function: json_len_escaped()
+ * Get the length of a quoted JSON string from an unquoted one. Excluding a terminiting null.
+ * Arguments:
+ * char *pStr - The string to compute the length of.
+ * Returns:
+ * unsigned int - The öth of pStr as a quoted JSON string.
+ */
+unsigned int json_len_escaped(char *pStr)
+   {
+   return g_pJSONLenEscaped(pStr, strlen(pStr));
+   } // End of json_len_escaped()
+
+
+/*
+ * Function: JSONKernelInit()
+ * Choose the JSON escape kernels for the instruction sets the CPU supports,
+ * or the ones forced by --json-kernel. All kernels produce the same output.
+ * Returns:
+ * BOOL - TRUE if the forced kernels can't be used, else FALSE.
+ */
+BOOL JSONKernelInit(void)
+   {
+   static char *pKernels[] = { "auto", "scalar", "sse2", "avx2", "avx512" };
+   unsigned int nKernel = g_nJSONKernel;
+
+#ifdef JSON_SIMD_X86
+   __builtin_cpu_init();
+   if(nKernel == JSON_KERNEL_AUTO)
+      nKernel = __builtin_cpu_supports("avx512bw") ? JSON_KERNEL_AVX512
+        : __builtin_cpu_supports("avx2") ? JSON_KERNEL_AVX2
+        : __builtin_cpu_supports("sse2") ? JSON_KERNEL_SSE2
+        : JSON_KERNEL_SCALAR;
+   if((nKernel == JSON_KERNEL_AVX512 && !__builtin_cpu_supports("avx512bw"))
+     || (nKernel == JSON_KERNEL_AVX2 && !__builtin_cpu_supports("avx2"))
+     || (nKernel == JSON_KERNEL_SSE2 && !__builtin_cpu_supports("sse2")))
+      {
+      fprintf(stderr, "The CPU doesn't support the %s JSON escape kernel.\n",
+        pKernels[nKernel]);
+      return TRUE;
+      }
+
+   if(nKernel == JSON_KERNEL_AVX512)
+      {
+      g_pJSONEscape = json_escape_avx512;
+      g_pJSONLenEscaped = json_len_escaped_avx512;
+      g_pJSONEscapePass = json_escape_pass_avx512;
+      g_pUTF8Valid = utf8_valid_avx2;
+      g_pASCIILen = ascii_len_avx2;
+      g_pJSONKernel = "avx512";
+      }
+   else if(nKernel == JSON_KERNEL_AVX2)
+      {
+      g_pJSONEscape = json_escape_avx2;
+      g_pJSONLenEscaped = json_len_escaped_avx2;
+      g_pJSONEscapePass = json_escape_pass_avx2;
+      g_pUTF8Valid = utf8_valid_avx2;
+      g_pASCIILen = ascii_len_avx2;
+      g_pJSONKernel = "avx2";
+      }
+   else if(nKernel == JSON_KERNEL_SSE2)
+      {
+      g_pJSONEscape = json_escape_sse2;
+      g_pJSONLenEscaped = json_len_escaped_sse2;
+      g_pJSONEscapePass = json_escape_pass_sse2;
+      g_pASCIILen = ascii_len_sse2;
+      g_pJSONKernel = "sse2";
+      }
+#else
+   if(nKernel != JSON_KERNEL_AUTO && nKernel != JSON_KERNEL_SCALAR)
+      {
+      fprintf(stderr, "The %s JSON escape kernel isn't built in.\n",
+        pKernels[nKernel]);
+      return TRUE;
+      }
+#endif
+   PrintMsg(LOG_VERBOSE, "Using %s JSON escape kernels.\n", g_pJSONKernel);
+
+// In the UTF-8 modes, the byte kernels are used for the ASCII parts only.
+   g_pJSONEscapeBytes = g_pJSONEscape;
+   if(g_nUnicode != UNICODE_BYTES)
+      {
+      g_pJSONEscape = json_escape_utf8;
+      g_pJSONLenEscaped = json_len_escaped_utf8;
+      }
+
+   return FALSE;
+   } // End of JSONKernelInit()
+
+
+/*
+ * Function: json_escape_char()
+ * Escape a single character that may not appear as is in a JSON string.
+ * Arguments:
+ * unsigned char cChar - The character to escape.
+ * char *pRet - Where to write the escaped character.
+ * Returns:
+ * char * - A pointer after the escaped character.
+ */
+char *json_escape_char(unsigned char cChar, char *pRet)
+   {
+   *pRet++ = '\\';
+   if(cChar == '\\')
+      *pRet++ = '\\';
+   else if(cChar == '"')
+      *pRet++ = '"';
+   else if(cChar == '/')
+      *pRet++ = '/';
+   else if(cChar == '\b')
+      *pRet++ = 'b';
+   else if(cChar == '\f')
+      *pRet++ = 'f';
+   else if(cChar == '\n')
+      *pRet++ = 'n';
+   else if(cChar == '\r')
+      *pRet++ = 'r';
+   else if(cChar == '\t')
+      *pRet++ = 't';
+// Any other control or 8-bit non-ASCII character, use the \uNNNN notation.
+   else
+      {
+      *pRet++ = 'u';
+      *pRet++ = '0';
+      *pRet++ = '0';
+      *pRet++ = "0123456789ABCDEF"[cChar >> 4];
+      *pRet++ = "0123456789ABCDEF"[cChar & 0x0F];
+      }
+
+   return pRet;
+   } // End of json_escape_char()
+
+// Check if a character must be escaped in a JSON string, and the length of
+// it when escaped.
+#define JSON_CHAR_ESCAPE(C) ((C) < 0x20 || (C) >= 0x7F || (C) == '"' \
+  || (C) == '\\' || (C) == '/')
+#define JSON_CHAR_LEN_ESCAPED(C) (((C) == '\\' || (C) == '"' || (C) == '/' \
+  || (C) == '\b' || (C) == '\f' || (C) == '\n' || (C) == '\r' || (C) == '\t') \
+  ? 2 : 6)
+
+
+/*
+ * Function: json_escape_scalar()
+ * Escape a string for JSON, one character at the time. Used when there are
+ * no SIMD kernels and for the tail of the string by those.
+ * Arguments:
+ * char *pStr - The string to escape.
+ * size_t nLen - The length of the string.
+ * char *pRet - Buffer to hold the escaped string, not null terminated.
+ * Returns:
+ * char * - A pointer after the escaped string.
+ */
+char *json_escape_scalar(char *pStr, size_t nLen, char *pRet)
+   {
+   unsigned char *pTmp = (unsigned char *) pStr;
+   unsigned char *pEnd = pTmp + nLen;
+
+   for(; pTmp < pEnd; pTmp++)
+      {
+      if(JSON_CHAR_ESCAPE(*pTmp))
+         pRet = json_escape_char(*pTmp, pRet);
+      else
+         *pRet++ = *pTmp;
+      }
+
+   return pRet;
+   } // End of json_escape_scalar()
+
+
+/*
+ * Function: json_len_escaped_scalar()
+ * Get the length of a string escaped for JSON, one character at the time.
+ * Arguments:
+ * char *pStr - The string.
+ * size_t nLen - The length of the string.
+ * Returns:
+ * size_t - The length of the escaped string.
+ */
+size_t json_len_escaped_scalar(char *pStr, size_t nLen)
+   {
+   unsigned char *pTmp = (unsigned char *) pStr;
+   unsigned char *pEnd = pTmp + nLen;
+   size_t nRet = nLen;
+
+   for(; pTmp < pEnd; pTmp++)
+      {
+      if(JSON_CHAR_ESCAPE(*pTmp))
+         nRet += JSON_CHAR_LEN_ESCAPED(*pTmp) - 1;
+      }
+
+   return nRet;
+   } // End of json_len_escaped_scalar()
+
+
+/*
+ * Function: json_escape_utf8()
+ * Escape a UTF-8 string for JSON. The ASCII start of the string is escaped
+ * with the byte kernels, and the rest is checked for valid UTF-8 in one go,
+ * as valid strings are escaped faster. In pass mode, valid UTF-8 sequences are kept
+ * as is, in escape mode they are written as \uXXXX, with a surrogate pair
+ * for characters outside the basic plane. Invalid bytes are written as
+ * \u00XX in both modes.
+ * Arguments:
+ * char *pStr - The string to escape.
+ * size_t nLen - The length of the string.
+ * char *pRet - Buffer to hold the escaped string, not null terminated.
+ * Returns:
+ * char * - A pointer after the escaped string.
+ */
+char *json_escape_utf8(char *pStr, size_t nLen, char *pRet)
+   {
+   size_t nASCII;
+
+// ASCII is escaped the same in all modes.
+   if((nASCII = g_pASCIILen(pStr, nLen)) == nLen)
+      return g_pJSONEscapeBytes(pStr, nLen, pRet);
+   if(nASCII > 0)
+      {
+      pRet = g_pJSONEscapeBytes(pStr, nASCII, pRet);
+      pStr += nASCII;
+      nLen -= nASCII;
+      }
+
+   if(g_nUnicode == UNICODE_PASS && g_pUTF8Valid(pStr, nLen))
+      return g_pJSONEscapePass(pStr, nLen, pRet);
+
+   return json_escape_utf8_scalar(pStr, nLen, pRet);
+   } // End of json_escape_utf8()
+
+
+/*
+ * Function: json_escape_utf8_scalar()
+ * Escape a UTF-8 string for JSON, one character at the time.
+ * Arguments:
+ * char *pStr - The string to escape.
+ * size_t nLen - The length of the string.
+ * char *pRet - Buffer to hold the escaped string, not null terminated.
+ * Returns:
+ * char * - A pointer after the escaped string.
+ */
+char *json_escape_utf8_scalar(char *pStr, size_t nLen, char *pRet)
+   {
+   unsigned char *pTmp = (unsigned char *) pStr;
+   unsigned char *pEnd = pTmp + nLen;
+   unsigned long lCode;
+   unsigned int nSeq;
+
+   while(pTmp < pEnd)
+      {
+      if(*pTmp < 0x80)
+         {
+         if(JSON_CHAR_ESCAPE(*pTmp))
+            pRet = json_escape_char(*pTmp, pRet);
+         else
+            *pRet++ = *pTmp;
+         pTmp++;
+         }
+      else if((nSeq = utf8_decode(pTmp, pEnd, &lCode)) == 0)
+         pRet = json_escape_char(*pTmp++, pRet);
+      else if(g_nUnicode == UNICODE_PASS)
+         {
+         memcpy(pRet, pTmp, nSeq);
+         pRet += nSeq;
+         pTmp += nSeq;
+         }
+      else
+         {
+         if(lCode > 0xFFFF)
+            {
+            lCode -= 0x10000;
+            sprintf(pRet, "\\u%04lX", 0xD800 + (lCode >> 10));
+            pRet += 6;
+            lCode = 0xDC00 + (lCode & 0x3FF);
+            }
+         sprintf(pRet, "\\u%04lX", lCode);
+         pRet += 6;
+         pTmp += nSeq;
+         }
+      }
+
+   return pRet;
+   } // End of json_escape_utf8_scalar()
+
+
+/*
+ * Function: json_escape_pass_scalar()
+ * Escape a valid UTF-8 string for JSON, keeping all characters of 0x80
+ * and up. This may start inside a UTF-8 sequence.
+ * Arguments:
+ * char *pStr - The string to escape.
+ * size_t nLen - The length of the string.
+ * char *pRet - Buffer to hold the escaped string, not null terminated.
+ * Returns:
+ * char * - A pointer after the escaped string.
+ */
+char *json_escape_pass_scalar(char *pStr, size_t nLen, char *pRet)
+   {
+   unsigned char *pTmp = (unsigned char *) pStr;
+   unsigned char *pEnd = pTmp + nLen;
+
+   for(; pTmp < pEnd; pTmp++)
+      {
+      if(*pTmp < 0x80 && JSON_CHAR_ESCAPE(*pTmp))
+         pRet = json_escape_char(*pTmp, pRet);
+      else
+         *pRet++ = *pTmp;
+      }
+
+   return pRet;
+   } // End of json_escape_pass_scalar()
+
+
+/*
+ * Function: json_len_escaped_utf8()
+ * Get the length of a UTF-8 string escaped for JSON.
+ * Arguments:
+ * char *pStr - The string.
+ * size_t nLen - The length of the string.
+ * Returns:
+ * size_t - The length of the escaped string.
+ */
+size_t json_len_escaped_utf8(char *pStr, size_t nLen)
+   {
+   unsigned char *pTmp = (unsigned char *) pStr;
+   unsigned char *pEnd = pTmp + nLen;
+   unsigned long lCode;
+   unsigned int nSeq;
+   size_t nRet = 0;
+
+   while(pTmp < pEnd)
+      {
+      if(*pTmp < 0x80)
+         {
+         nRet += JSON_CHAR_ESCAPE(*pTmp) ? JSON_CHAR_LEN_ESCAPED(*pTmp) : 1;
+         pTmp++;
+         }
+      else if((nSeq = utf8_decode(pTmp, pEnd, &lCode)) == 0)
+         {
+         nRet += 6;
+         pTmp++;
+         }
+      else
+         {
+         nRet += g_nUnicode == UNICODE_PASS ? nSeq : lCode > 0xFFFF ? 12 : 6;
+         pTmp += nSeq;
+         }
+      }
+
+   return nRet;
+   } // End of json_len_escaped_utf8()
+
+
+/*
+ * Function: utf8_decode()
+ * Decode a multi-byte UTF-8 sequence. Overlong sequences, surrogates and
+ * characters above U+10FFFF are invalid.
+ * Arguments:
+ * unsigned char *pStr - The start of the sequence.
+ * unsigned char *pEnd - The end of the string.
+ * unsigned long *plCode - Set to the decoded character.
+ * Returns:
+ * unsigned int - The length of the sequence, 0 if it is invalid.
+ */
+unsigned int utf8_decode(unsigned char *pStr, unsigned char *pEnd, unsigned long *plCode)
+   {
+   unsigned int nSeq;
+   unsigned int i;
+   unsigned long lMin;
+
+   if(*pStr >= 0xC2 && *pStr <= 0xDF)
+      {
+      nSeq = 2;
+      lMin = 0x80;
+      *plCode = *pStr & 0x1F;
+      }
+   else if(*pStr >= 0xE0 && *pStr <= 0xEF)
+      {
+      nSeq = 3;
+      lMin = 0x800;
+      *plCode = *pStr & 0x0F;
+      }
+   else if(*pStr >= 0xF0 && *pStr <= 0xF4)
+      {
+      nSeq = 4;
+      lMin = 0x10000;
+      *plCode = *pStr & 0x07;
+      }
+   else
+      return 0;
+
+   if(pEnd - pStr < nSeq)
+      return 0;
+   for(i = 1; i < nSeq; i++)
+      {
+      if((pStr[i] & 0xC0) != 0x80)
+         return 0;
+      *plCode = (*plCode << 6) | (pStr[i] & 0x3F);
+      }
+   if(*plCode < lMin || *plCode > 0x10FFFF
+     || (*plCode >= 0xD800 && *plCode <= 0xDFFF))
+      return 0;
+
+   return nSeq;
+   } // End of utf8_decode()
+
+
+/*
+ * Function: utf8_valid_scalar()
+ * Check if a string is valid UTF-8, one character at the time.
+ * Arguments:
+ * char *pStr - The string.
+ * size_t nLen - The length of the string.
+ * Returns:
+ * BOOL - TRUE if the string is valid UTF-8, else FALSE.
+ */
+BOOL utf8_valid_scalar(char *pStr, size_t nLen)
+   {
+   unsigned char *pTmp = (unsigned char *) pStr;
+   unsigned char *pEnd = pTmp + nLen;
+   unsigned long lCode;
+   unsigned int nSeq;
+
+   while(pTmp < pEnd)
+      {
+      if(*pTmp < 0x80)
+         pTmp++;
+      else if((nSeq = utf8_decode(pTmp, pEnd, &lCode)) == 0)
+         return FALSE;
+      else
+         pTmp += nSeq;
+      }
+
+   return TRUE;
+   } // End of utf8_valid_scalar()
+
+
+/*
+ * Function: ascii_len_scalar()
+ * Get the length of the ASCII start of a string, one character at the time.
+ * Arguments:
+ * char *pStr - The string.
+ * size_t nLen - The length of the string.
+ * Returns:
+ * size_t - The number of characters before the first one of 0x80 and up.
+ */
+size_t ascii_len_scalar(char *pStr, size_t nLen)
+   {
+   size_t i;
+
+   for(i = 0; i < nLen && (unsigned char) pStr[i] < 0x80; i++)
+      ;
+
+   return i;
+   } // End of ascii_len_scalar()
+
+#ifdef JSON_SIMD_X86
+// The SIMD kernels look at a block of characters at the time. A block with
+// nothing to escape is copied as is, else the characters up to the first one
+// to escape are copied, that one is escaped and the next block starts after
+// it. Signed compares catch both control and 8-bit characters as below 0x20.
+// The full block may be stored, as the output is at least as long as the
+// rest of the input.
+
+/*
+ * Function: json_escape_sse2()
+ * Escape a string for JSON, 16 characters at the time.
+ * Arguments:
+ * char *pStr - The string to escape.
+ * size_t nLen - The length of the string.
+ * char *pRet - Buffer to hold the escaped string, not null terminated.
+ * Returns:
+ * char * - A pointer after the escaped string.
+ */
+__attribute__((target("sse2")))
+char *json_escape_sse2(char *pStr, size_t nLen, char *pRet)
+   {
+   char *pEnd = pStr + nLen;
+   __m128i v;
+   unsigned int nMask;
+   unsigned int nSkip;
+
+   while(pEnd - pStr >= 16)
+      {
+      v = _mm_loadu_si128((__m128i *) pStr);
+      nMask = _mm_movemask_epi8(_mm_or_si128(_mm_or_si128(
+        _mm_cmplt_epi8(v, _mm_set1_epi8(0x20)),
+        _mm_cmpeq_epi8(v, _mm_set1_epi8(0x7F))),
+        _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('"')),
+        _mm_cmpeq_epi8(v, _mm_set1_epi8('\\'))),
+        _mm_cmpeq_epi8(v, _mm_set1_epi8('/')))));
+      _mm_storeu_si128((__m128i *) pRet, v);
+      if(nMask == 0)
+         {
+         pStr += 16;
+         pRet += 16;
+         continue;
+         }
+      nSkip = __builtin_ctz(nMask);
+      pRet = json_escape_char((unsigned char) pStr[nSkip], pRet + nSkip);
+      pStr += nSkip + 1;
+      }
+
+   return json_escape_scalar(pStr, pEnd - pStr, pRet);
+   } // End of json_escape_sse2()
+
+
+/*
+ * Function: json_len_escaped_sse2()
+ * Get the length of a string escaped for JSON, 16 characters at the time.
+ * Arguments:
+ * char *pStr - The string.
+ * size_t nLen - The length of the string.
+ * Returns:
+ * size_t - The length of the escaped string.
+ */
+__attribute__((target("sse2")))
+size_t json_len_escaped_sse2(char *pStr, size_t nLen)
+   {
+   char *pEnd = pStr + nLen;
+   size_t nRet = 0;
+   __m128i v;
+   unsigned int nMask;
+   unsigned int nSkip;
+
+   while(pEnd - pStr >= 16)
+      {
+      v = _mm_loadu_si128((__m128i *) pStr);
+      nMask = _mm_movemask_epi8(_mm_or_si128(_mm_or_si128(
+        _mm_cmplt_epi8(v, _mm_set1_epi8(0x20)),
+        _mm_cmpeq_epi8(v, _mm_set1_epi8(0x7F))),
+        _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('"')),
+        _mm_cmpeq_epi8(v, _mm_set1_epi8('\\'))),
+        _mm_cmpeq_epi8(v, _mm_set1_epi8('/')))));
+      if(nMask == 0)
+         {
+         pStr += 16;
+         nRet += 16;
+         continue;
+         }
+      nSkip = __builtin_ctz(nMask);
+      nRet += nSkip + JSON_CHAR_LEN_ESCAPED(pStr[nSkip]);
+      pStr += nSkip + 1;
+      }
+
+   return nRet + json_len_escaped_scalar(pStr, pEnd - pStr);
+   } // End of json_len_escaped_sse2()
+
+
+/*
+ * Function: json_escape_avx2()
+ * Escape a string for JSON, 32 characters at the time.
+ * Arguments:
+ * char *pStr - The string to escape.
+ * size_t nLen - The length of the string.
+ * char *pRet - Buffer to hold the escaped string, not null terminated.
+ * Returns:
+ * char * - A pointer after the escaped string.
+ */
+__attribute__((target("avx2")))
+char *json_escape_avx2(char *pStr, size_t nLen, char *pRet)
+   {
+   char *pEnd = pStr + nLen;
+   __m256i v;
+   unsigned int nMask;
+   unsigned int nSkip;
+
+   while(pEnd - pStr >= 32)
+      {
+      v = _mm256_loadu_si256((__m256i *) pStr);
+      nMask = (unsigned int) _mm256_movemask_epi8(_mm256_or_si256(_mm256_or_si256(
+        _mm256_cmpgt_epi8(_mm256_set1_epi8(0x20), v),
+        _mm256_cmpeq_epi8(v, _mm256_set1_epi8(0x7F))),
+        _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('"')),
+        _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\\'))),
+        _mm256_cmpeq_epi8(v, _mm256_set1_epi8('/')))));
+      _mm256_storeu_si256((__m256i *) pRet, v);
+      if(nMask == 0)
+         {
+         pStr += 32;
+         pRet += 32;
+         continue;
+         }
+      nSkip = __builtin_ctz(nMask);
+      pRet = json_escape_char((unsigned char) pStr[nSkip], pRet + nSkip);
+      pStr += nSkip + 1;
+      }
+
+   return json_escape_scalar(pStr, pEnd - pStr, pRet);
+   } // End of json_escape_avx2()
+
+
+/*
+ * Function: json_len_escaped_avx2()
+ * Get the length of a string escaped for JSON, 32 characters at the time.
+ * Arguments:
+ * char *pStr - The string.
+ * size_t nLen - The length of the string.
+ * Returns:
+ * size_t - The length of the escaped string.
+ */
+__attribute__((target("avx2")))
+size_t json_len_escaped_avx2(char *pStr, size_t nLen)
+   {
+   char *pEnd = pStr + nLen;
+   size_t nRet = 0;
+   __m256i v;
+   unsigned int nMask;
+   unsigned int nSkip;
+
+   while(pEnd - pStr >= 32)
+      {
+      v = _mm256_loadu_si256((__m256i *) pStr);
+      nMask = (unsigned int) _mm256_movemask_epi8(_mm256_or_si256(_mm256_or_si256(
+        _mm256_cmpgt_epi8(_mm256_set1_epi8(0x20), v),
+        _mm256_cmpeq_epi8(v, _mm256_set1_epi8(0x7F))),
+        _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('"')),
+        _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\\'))),
+        _mm256_cmpeq_epi8(v, _mm256_set1_epi8('/')))));
+      if(nMask == 0)
+         {
+         pStr += 32;
+         nRet += 32;
+         continue;
+         }
+      nSkip = __builtin_ctz(nMask);
+      nRet += nSkip + JSON_CHAR_LEN_ESCAPED(pStr[nSkip]);
+      pStr += nSkip + 1;
+      }
+
+   return nRet + json_len_escaped_scalar(pStr, pEnd - pStr);
+   } // End of json_len_escaped_avx2()
+
+
+/*
+ * Function: json_escape_avx512()
+ * Escape a string for JSON, 64 characters at the time.
+ * Arguments:
+ * char *pStr - The string to escape.
+ * size_t nLen - The length of the string.
+ * char *pRet - Buffer to hold the escaped string, not null terminated.
+ * Returns:
+ * char * - A pointer after the escaped string.
+ */
+__attribute__((target("avx512f,avx512bw")))
+char *json_escape_avx512(char *pStr, size_t nLen, char *pRet)
+   {
+   char *pEnd = pStr + nLen;
+   __m512i v;
+   unsigned long long llMask;
+   unsigned int nSkip;
+
+   while(pEnd - pStr >= 64)
+      {
+      v = _mm512_loadu_si512((void *) pStr);
+      llMask = _mm512_cmplt_epi8_mask(v, _mm512_set1_epi8(0x20))
+        | _mm512_cmpeq_epi8_mask(v, _mm512_set1_epi8(0x7F))
+        | _mm512_cmpeq_epi8_mask(v, _mm512_set1_epi8('"'))
+        | _mm512_cmpeq_epi8_mask(v, _mm512_set1_epi8('\\'))
+        | _mm512_cmpeq_epi8_mask(v, _mm512_set1_epi8('/'));
+      _mm512_storeu_si512((void *) pRet, v);
+      if(llMask == 0)
+         {
+         pStr += 64;
+         pRet += 64;
+         continue;
+         }
+      nSkip = __builtin_ctzll(llMask);
+      pRet = json_escape_char((unsigned char) pStr[nSkip], pRet + nSkip);
+      pStr += nSkip + 1;
+      }
+
+   return json_escape_avx2(pStr, pEnd - pStr, pRet);
+   } // End of json_escape_avx512()
+
+
+/*
+ * Function: json_len_escaped_avx512()
+ * Get the length of a string escaped for JSON, 64 characters at the time.
+ * Arguments:
+ * char *pStr - The string.
+ * size_t nLen - The length of the string.
+ * Returns:
+ * size_t - The length of the escaped string.
+ */
+__attribute__((target("avx512f,avx512bw")))
+size_t json_len_escaped_avx512(char *pStr, size_t nLen)
+   {
+   char *pEnd = pStr + nLen;
+   size_t nRet = 0;
+   __m512i v;
+   unsigned long long llMask;
+   unsigned int nSkip;
+
+   while(pEnd - pStr >= 64)
+      {
+      v = _mm512_loadu_si512((void *) pStr);
+      llMask = _mm512_cmplt_epi8_mask(v, _mm512_set1_epi8(0x20))
+        | _mm512_cmpeq_epi8_mask(v, _mm512_set1_epi8(0x7F))
+        | _mm512_cmpeq_epi8_mask(v, _mm512_set1_epi8('"'))
+        | _mm512_cmpeq_epi8_mask(v, _mm512_set1_epi8('\\'))
+        | _mm512_cmpeq_epi8_mask(v, _mm512_set1_epi8('/'));
+      if(llMask == 0)
+         {
+         pStr += 64;
+         nRet += 64;
+         continue;
+         }
+      nSkip = __builtin_ctzll(llMask);
+      nRet += nSkip + JSON_CHAR_LEN_ESCAPED(pStr[nSkip]);
+      pStr += nSkip + 1;
       }
 
-   return;
-   } // End of PrintMsg().
+   return nRet + json_len_escaped_avx2(pStr, pEnd - pStr);
+   } // End of json_len_escaped_avx512()
 
+// The pass kernels escape valid UTF-8 strings, keeping all characters of
+// 0x80 and up as they are. Unsigned compares are used to find the control
+// characters.
 
 /*
- * Function: PrintStats()
- * Signal handler that shows current status.
+ * Function: json_escape_pass_sse2()
+ * Escape a valid UTF-8 string for JSON, 16 characters at the time.
  * Arguments:
- * int nData - Signal to process.
+ * char *pStr - The string to escape.
+ * size_t nLen - The length of the string.
+ * char *pRet - Buffer to hold the escaped string, not null terminated.
+ * Returns:
+ * char * - A pointer after the escaped string.
  */
-void PrintStats(int nData)
+__attribute__((target("sse2")))
+char *json_escape_pass_sse2(char *pStr, size_t nLen, char *pRet)
    {
-// If this is an interupt, stop gracefully.
-   if(nData == SIGINT)
-      g_bStop = TRUE;
+   char *pEnd = pStr + nLen;
+   __m128i v;
+   unsigned int nMask;
+   unsigned int nSkip;
 
-   return;
-   } // End of PrintStats()
+   while(pEnd - pStr >= 16)
+      {
+      v = _mm_loadu_si128((__m128i *) pStr);
+      nMask = _mm_movemask_epi8(_mm_or_si128(_mm_or_si128(
+        _mm_cmpeq_epi8(_mm_max_epu8(v, _mm_set1_epi8(0x1F)), _mm_set1_epi8(0x1F)),
+        _mm_cmpeq_epi8(v, _mm_set1_epi8(0x7F))),
+        _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('"')),
+        _mm_cmpeq_epi8(v, _mm_set1_epi8('\\'))),
+        _mm_cmpeq_epi8(v, _mm_set1_epi8('/')))));
+      _mm_storeu_si128((__m128i *) pRet, v);
+      if(nMask == 0)
+         {
+         pStr += 16;
+         pRet += 16;
+         continue;
+         }
+      nSkip = __builtin_ctz(nMask);
+      pRet = json_escape_char((unsigned char) pStr[nSkip], pRet + nSkip);
+      pStr += nSkip + 1;
+      }
+
+   return json_escape_pass_scalar(pStr, pEnd - pStr, pRet);
+   } // End of json_escape_pass_sse2()
 
 
 /*
- * Function: StringIsNumeric()
- * Check if a string is numeric.
+ * Function: json_escape_pass_avx2()
+ * Escape a valid UTF-8 string for JSON, 32 characters at the time.
  * Arguments:
- * char *pStr - The string to check.
- * BOOL bInt - Check for integer only.
+ * char *pStr - The string to escape.
+ * size_t nLen - The length of the string.
+ * char *pRet - Buffer to hold the escaped string, not null terminated.
  * Returns:
- * BOOL - TRUE if the string is a valid number, else FALSE.
+ * char * - A pointer after the escaped string.
  */
-BOOL StringIsNumeric(char *pStr, BOOL bInt)
+__attribute__((target("avx2")))
+char *json_escape_pass_avx2(char *pStr, size_t nLen, char *pRet)
    {
-   BOOL bComa;
+   char *pEnd = pStr + nLen;
+   __m256i v;
+   unsigned int nMask;
+   unsigned int nSkip;
 
-// Skip leading sign.
-   if(*pStr != '-' && *pStr != '+' && *pStr < '0' && *pStr > '9')
-      return FALSE;
+   while(pEnd - pStr >= 32)
+      {
+      v = _mm256_loadu_si256((__m256i *) pStr);
+      nMask = (unsigned int) _mm256_movemask_epi8(_mm256_or_si256(_mm256_or_si256(
+        _mm256_cmpeq_epi8(_mm256_max_epu8(v, _mm256_set1_epi8(0x1F)), _mm256_set1_epi8(0x1F)),
+        _mm256_cmpeq_epi8(v, _mm256_set1_epi8(0x7F))),
+        _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('"')),
+        _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\\'))),
+        _mm256_cmpeq_epi8(v, _mm256_set1_epi8('/')))));
+      _mm256_storeu_si256((__m256i *) pRet, v);
+      if(nMask == 0)
+         {
+         pStr += 32;
+         pRet += 32;
+         continue;
+         }
+      nSkip = __builtin_ctz(nMask);
+      pRet = json_escape_char((unsigned char) pStr[nSkip], pRet + nSkip);
+      pStr += nSkip + 1;
+      }
 
-// Skip past leading digits.
-   while(*pStr >= '0' && *pStr <= '9')
-      pStr++;
-   if(*pStr == '\0')
-      return TRUE;
-   if(bInt)
-      return FALSE;
+   return json_escape_pass_scalar(pStr, pEnd - pStr, pRet);
+   } // End of json_escape_pass_avx2()
 
-// Check decimals.
-   if(*pStr == ',')
+
+/*
+ * Function: json_escape_pass_avx512()
+ * Escape a valid UTF-8 string for JSON, 64 characters at the time.
+ * Arguments:
+ * char *pStr - The string to escape.
+ * size_t nLen - The length of the string.
+ * char *pRet - Buffer to hold the escaped string, not null terminated.
+ * Returns:
+ * char * - A pointer after the escaped string.
+ */
+__attribute__((target("avx512f,avx512bw")))
+char *json_escape_pass_avx512(char *pStr, size_t nLen, char *pRet)
+   {
+   char *pEnd = pStr + nLen;
+   __m512i v;
+   unsigned long long llMask;
+   unsigned int nSkip;
+
+   while(pEnd - pStr >= 64)
       {
-      bComa = TRUE;
-      pStr++;
-      while(*pStr >= '0' && *pStr <= '9')
-         pStr++;
-      if(*pStr == '\0')
-         return TRUE;
+      v = _mm512_loadu_si512((void *) pStr);
+      llMask = _mm512_cmplt_epu8_mask(v, _mm512_set1_epi8(0x20))
+        | _mm512_cmpeq_epi8_mask(v, _mm512_set1_epi8(0x7F))
+        | _mm512_cmpeq_epi8_mask(v, _mm512_set1_epi8('"'))
+        | _mm512_cmpeq_epi8_mask(v, _mm512_set1_epi8('\\'))
+        | _mm512_cmpeq_epi8_mask(v, _mm512_set1_epi8('/'));
+      _mm512_storeu_si512((void *) pRet, v);
+      if(llMask == 0)
+         {
+         pStr += 64;
+         pRet += 64;
+         continue;
+         }
+      nSkip = __builtin_ctzll(llMask);
+      pRet = json_escape_char((unsigned char) pStr[nSkip], pRet + nSkip);
+      pStr += nSkip + 1;
       }
 
-// Check exponent.
-   if(*pStr != 'e' || *pStr != 'E')
-      return FALSE;
+   return json_escape_pass_avx2(pStr, pEnd - pStr, pRet);
+   } // End of json_escape_pass_avx512()
 
-   pStr++;
-   if(*pStr != '-' && *pStr != '+')
-      pStr++;
-   while(*pStr >= '0' && *pStr <= '9')
-      pStr++;
-   if(*pStr == '\0')
-      return TRUE;
+/*
+ * Function: ascii_len_sse2()
+ * Get the length of the ASCII start of a string, 16 characters at the time.
+ * Arguments:
+ * char *pStr - The string.
+ * size_t nLen - The length of the string.
+ * Returns:
+ * size_t - The number of characters before the first one of 0x80 and up.
+ */
+__attribute__((target("sse2")))
+size_t ascii_len_sse2(char *pStr, size_t nLen)
+   {
+   unsigned int nMask;
+   size_t i;
 
-   return FALSE;
-   } // End of StringIsNumeric()
+   for(i = 0; i + 16 <= nLen; i += 16)
+      {
+      if((nMask = _mm_movemask_epi8(_mm_loadu_si128((__m128i *) (pStr + i))))
+        != 0)
+         return i + __builtin_ctz(nMask);
+      }
+
+   return i + ascii_len_scalar(pStr + i, nLen - i);
+   } // End of ascii_len_sse2()
 
 
 /*
- * Function: json_escape()
- * Escape a JSON string properly.
+ * Function: ascii_len_avx2()
+ * Get the length of the ASCII start of a string, 32 characters at the time.
  * Arguments:
- * char *pStr - The JSON string to quote.
- * char *pRet - A buffer of sufficient size to hold the JSON string.
- * unsigned int *pnLen - Length of the string. Is set to the allocated len, unless if NULL when this is ignored.
+ * char *pStr - The string.
+ * size_t nLen - The length of the string.
  * Returns:
- * char * - A pointer to the converted string, NULL if there is an error.
+ * size_t - The number of characters before the first one of 0x80 and up.
  */
-char *json_escape(char *pStr, char *pRet, unsigned int *pnLen)
+__attribute__((target("avx2")))
+size_t ascii_len_avx2(char *pStr, size_t nLen)
    {
-   char *pTmp;
+   unsigned int nMask;
+   size_t i;
 
-   if(pnLen == NULL || json_len_escaped(pStr) + 1 >= *pnLen)
+   for(i = 0; i + 32 <= nLen; i += 32)
       {
-      if((pRet = realloc(pRet, json_len_escaped(pStr) + 1025)) == NULL)
-         return NULL;
-      if(pnLen != NULL)
-         *pnLen = json_len_escaped(pStr) + 1024;
-      }
-
-   for(pTmp = pRet; *pStr != '\0'; pStr++)
-      {
-      if(*pStr == '\\' || *pStr == '"' || *pStr == '/' || *pStr == '\b'
-        || *pStr == '\f' || *pStr == '\n' || *pStr == '\r' || *pStr == '\t')
-         {
-         *pTmp++ = '\\';
-         if(*pStr == '\\')
-            *pTmp++ = '\\';
-         else if(*pStr == '"')
-            *pTmp++ = '"';
-         else if(*pStr == '/')
-            *pTmp++ = '/';
-         else if(*pStr == '\b')
-            *pTmp++ = 'b';
-         else if(*pStr == '\f')
-            *pTmp++ = 'f';
-         else if(*pStr == '\n')
-            *pTmp++ = 'n';
-         else if(*pStr == '\r')
-            *pTmp++ = 'r';
-         else if(*pStr == '\t')
-            *pTmp++ = 't';
-         }
-// Any other control or 8-bit non-ASCII character, use the \uNNNN notation.
-      else if(*pStr <= 0x1F || *pStr >= 0x7F)
-         {
-         *pTmp++ = '\\';
-         *pTmp++ = 'u';
-         sprintf(pTmp, "%04X", (unsigned char) *pStr);
-         pTmp += 4;
-         }
-      else
-         *pTmp++ = *pStr;
+      if((nMask = (unsigned int) _mm256_movemask_epi8(_mm256_loadu_si256(
+        (__m256i *) (pStr + i)))) != 0)
+         return i + __builtin_ctz(nMask);
       }
-   *pTmp = '\0';
-
-   return pRet;
-   } // End of json_escape()
 
+   return i + ascii_len_sse2(pStr + i, nLen - i);
+   } // End of ascii_len_avx2()
+
+// Error classes of two byte UTF-8 sequences, as found by the lookup tables
+// of utf8_check_avx2(). This is the validation by Keiser and Lemire, where
+// the first byte high and low nibbles and the second byte high nibble each
+// give the errors they may be part of, and a real error is in all three.
+#define UTF8_TOO_SHORT 0x01
+#define UTF8_TOO_LONG 0x02
+#define UTF8_OVERLONG_3 0x04
+#define UTF8_TOO_LARGE 0x08
+#define UTF8_SURROGATE 0x10
+#define UTF8_OVERLONG_2 0x20
+#define UTF8_TOO_LARGE_1000 0x40
+#define UTF8_OVERLONG_4 0x40
+#define UTF8_TWO_CONTS 0x80
+#define UTF8_CARRY (UTF8_TOO_SHORT | UTF8_TOO_LONG | UTF8_TWO_CONTS)
+#define UTF8_TABLE(A,B,C,D,E,F,G,H,I,J,K,L,M,N,O,P) _mm256_setr_epi8( \
+  (char) (A), (char) (B), (char) (C), (char) (D), (char) (E), (char) (F), \
+  (char) (G), (char) (H), (char) (I), (char) (J), (char) (K), (char) (L), \
+  (char) (M), (char) (N), (char) (O), (char) (P), \
+  (char) (A), (char) (B), (char) (C), (char) (D), (char) (E), (char) (F), \
+  (char) (G), (char) (H), (char) (I), (char) (J), (char) (K), (char) (L), \
+  (char) (M), (char) (N), (char) (O), (char) (P))
 
 /*
- * Function: json_len_escaped()
- * Get the length of a quoted JSON string from an unquoted one. Excluding a terminiting null.
+ * Function: utf8_valid_avx2()
+ * Check if a string is valid UTF-8, 32 characters at the time. Blocks
+ * where this and the previous block are ASCII are not checked further.
  * Arguments:
- * char *pStr - The string to compute the length of.
+ * char *pStr - The string.
+ * size_t nLen - The length of the string.
  * Returns:
- * unsigned int - The öth of pStr as a quoted JSON string.
+ * BOOL - TRUE if the string is valid UTF-8, else FALSE.
  */
-unsigned int json_len_escaped(char *pStr)
+__attribute__((target("avx2")))
+BOOL utf8_valid_avx2(char *pStr, size_t nLen)
    {
-   unsigned int nLen;
+   __m256i v;
+   __m256i vPrev = _mm256_setzero_si256();
+   __m256i vError = _mm256_setzero_si256();
+   char szTail[32];
+   size_t i;
+
+   if(nLen < 32)
+      return utf8_valid_scalar(pStr, nLen);
 
-   for(nLen = 0; *pStr != '\0'; pStr++, nLen++)
+   for(i = 0; i + 32 <= nLen; i += 32)
       {
-      if(*pStr == '\\' || *pStr == '"' || *pStr == '/' || *pStr == '\b'
-        || *pStr == '\f' || *pStr == '\n' || *pStr == '\r' || *pStr == '\t')
-         nLen++;
-      else if(*pStr <= 0x1F || *pStr >= 0x7F)
-         nLen += 5;
+      v = _mm256_loadu_si256((__m256i *) (pStr + i));
+      if(_mm256_movemask_epi8(_mm256_or_si256(v, vPrev)) != 0)
+         vError = _mm256_or_si256(vError, utf8_check_avx2(v, vPrev));
+      vPrev = v;
       }
 
-   return nLen;
-   } // End of json_len_escaped()
+// Check the tail padded with zeros, and then a block of zeros, which finds
+// any sequence cut short at the end.
+   memset(szTail, 0, sizeof(szTail));
+   memcpy(szTail, pStr + i, nLen - i);
+   v = _mm256_loadu_si256((__m256i *) szTail);
+   vError = _mm256_or_si256(vError, utf8_check_avx2(v, vPrev));
+   vError = _mm256_or_si256(vError, utf8_check_avx2(_mm256_setzero_si256(), v));
+
+   return _mm256_testz_si256(vError, vError) ? TRUE : FALSE;
+   } // End of utf8_valid_avx2()
+
+
+/*
+ * Function: utf8_check_avx2()
+ * Find UTF-8 errors in a block of 32 characters.
+ * Arguments:
+ * __m256i v - The block.
+ * __m256i vPrev - The block before it.
+ * Returns:
+ * __m256i - Non-zero where there are errors.
+ */
+__attribute__((target("avx2")))
+__m256i utf8_check_avx2(__m256i v, __m256i vPrev)
+   {
+   __m256i vNibble = _mm256_set1_epi8(0x0F);
+   __m256i vShift = _mm256_permute2x128_si256(vPrev, v, 0x21);
+   __m256i vPrev1 = _mm256_alignr_epi8(v, vShift, 15);
+   __m256i vPrev2 = _mm256_alignr_epi8(v, vShift, 14);
+   __m256i vPrev3 = _mm256_alignr_epi8(v, vShift, 13);
+   __m256i vSpecial;
+   __m256i vMust23;
+
+// Errors found in two byte sequences.
+   vSpecial = _mm256_and_si256(_mm256_and_si256(
+     _mm256_shuffle_epi8(UTF8_TABLE(UTF8_TOO_LONG, UTF8_TOO_LONG,
+       UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG,
+       UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TWO_CONTS, UTF8_TWO_CONTS,
+       UTF8_TWO_CONTS, UTF8_TWO_CONTS, UTF8_TOO_SHORT | UTF8_OVERLONG_2,
+       UTF8_TOO_SHORT, UTF8_TOO_SHORT | UTF8_OVERLONG_3 | UTF8_SURROGATE,
+       UTF8_TOO_SHORT | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 | UTF8_OVERLONG_4),
+       _mm256_and_si256(_mm256_srli_epi16(vPrev1, 4), vNibble)),
+     _mm256_shuffle_epi8(UTF8_TABLE(
+       UTF8_CARRY | UTF8_OVERLONG_3 | UTF8_OVERLONG_2 | UTF8_OVERLONG_4,
+       UTF8_CARRY | UTF8_OVERLONG_2, UTF8_CARRY, UTF8_CARRY,
+       UTF8_CARRY | UTF8_TOO_LARGE,
+       UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+       UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+       UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+       UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+       UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+       UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+       UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+       UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+       UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 | UTF8_SURROGATE,
+       UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+       UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000),
+       _mm256_and_si256(vPrev1, vNibble))),
+     _mm256_shuffle_epi8(UTF8_TABLE(UTF8_TOO_SHORT, UTF8_TOO_SHORT,
+       UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT,
+       UTF8_TOO_SHORT, UTF8_TOO_SHORT,
+       UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_OVERLONG_3
+       | UTF8_TOO_LARGE_1000 | UTF8_OVERLONG_4,
+       UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_OVERLONG_3
+       | UTF8_TOO_LARGE,
+       UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_SURROGATE
+       | UTF8_TOO_LARGE,
+       UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_SURROGATE
+       | UTF8_TOO_LARGE,
+       UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT),
+       _mm256_and_si256(_mm256_srli_epi16(v, 4), vNibble)));
+
+// The third and fourth bytes of three and four byte sequences must be
+// continuations, which the two byte check sees as two continuations.
+   vMust23 = _mm256_and_si256(_mm256_or_si256(
+     _mm256_subs_epu8(vPrev2, _mm256_set1_epi8((char) (0xE0 - 0x80))),
+     _mm256_subs_epu8(vPrev3, _mm256_set1_epi8((char) (0xF0 - 0x80)))),
+     _mm256_set1_epi8((char) 0x80));
+
+   return _mm256_xor_si256(vMust23, vSpecial);
+   } // End of utf8_check_avx2()
+#endif
 
 
 /*
@@ -1609,20 +7636,36 @@ unsigned int json_len_escaped(char *pStr)
  * %O - Replaced by "ORDER BY <batch col>"
  * %W - Replaced by "WHERE <batch col> > <prev value> AND"
  * %w - Replaced by "WHERE <batch col> > <prev value>"
+ * If the table is a key range of a split table, the batch col is also
+ * limited by "<batch col> <= <range end>". A table batched on more than one
+ * key column uses all of them, as "(<col 1>, <col 2>) > (<value 1>, <value 2>)".
+ * A part of a table split by hash is limited by "<hash expr> <part - 1>".
+ * Quoted values are escaped for the connection.
  * Arguments:
+ * MYSQL *pMySQL - The connection the SQL is run on.
  * PJSONTABLE pTable - The table with the data to be formatted.
  * unsigned long lLimit - LIMIT clause.
+ * char **ppParams - If not NULL, the batch values and the limit are ? placeholders,
+ *   for a prepared statement. The values of the lower and upper batch
+ *   conditions are returned here, NULL for a condition that isn't used. The
+ *   lower condition has a placeholder for each key column.
  * Returns:
  * char * - The allocated SQL buffer, NULL if there is an error.
  */
-char *FormatSQL(PJSONTABLE pTable, unsigned long lLimit)
+char *FormatSQL(MYSQL *pMySQL, PJSONTABLE pTable, unsigned long lLimit, char **ppParams)
    {
    BOOL bWhere1 = FALSE;
    BOOL bWhere2 = FALSE;
    BOOL bOrderBy = FALSE;
+   BOOL bQuote;
    char *pTmp1;
    char *pTmp2;
+   char *pPrev = NULL;
+   char *pEnd = NULL;
+   char *pHash = NULL;
+   PJSONCOL pCol;
    unsigned int nLen;
+   unsigned int i;
 
 // Check which formats we have.
    for(pTmp1 = pTable->pSQLFormat; *pTmp1 != '\0'; pTmp1++)
@@ -1635,17 +7678,43 @@ char *FormatSQL(PJSONTABLE pTable, unsigned long lLimit)
          bOrderBy = TRUE;
       }
 
+// Get the batching conditions. The range of a table part may be changed by
+// other threads, so hold on to it while formatting.
+   if(ppParams != NULL)
+      ppParams[0] = ppParams[1] = NULL;
+   if(pTable->pParent != NULL)
+      pthread_mutex_lock(&pTable->mtxRange);
+   if(pTable->pBatchCol != NULL)
+      {
+      pPrev = pTable->pBatchCol->pPrevValue;
+      pEnd = pTable->pRangeEnd;
+      }
+   if(pTable->pParent != NULL)
+      pHash = pTable->pHashExpr;
+   bQuote = pTable->pBatchCol != NULL
+     && (JSONCOL_FLAG_CHECK(pTable->pBatchCol, QUOTED)
+     || !JSONCOL_FLAG_CHECK(pTable->pBatchCol, NUMERIC));
+
 // Calculate required space.
    nLen = strlen(pTable->pSQLFormat);
    if(bWhere1 || bWhere2)
       {
-      if(pTable->pBatchCol == NULL
-        || (pTable->pBatchCol != NULL && pTable->pBatchCol->pPrevValue == NULL))
 // <space>WHERE<space>
-         nLen += 7;
-      else if(pTable->pBatchCol != NULL)
-// <space>WHERE<space>`<column name>`<space>><space>`<column value>`<space>AND
-         nLen += 8 + strlen(pTable->pBatchCol->pJSONName) + 5 + strlen(pTable->pBatchCol->pPrevValue) + 5;
+      nLen += 7;
+// (`<column name>`,<space>...)<space>><space>('<column value>',<space>...)<space>AND<space>
+      if(pPrev != NULL)
+         {
+         nLen += 12;
+         for(i = 0; i < pTable->nKeyCols; i++)
+            nLen += strlen(pTable->pKeyCols[i]->pName)
+              + 2 * strlen(pTable->pKeyCols[i]->pPrevValue) + 8;
+         }
+// `<column name>`<space><=<space>'<column value>'<space>AND<space>
+      if(pEnd != NULL)
+         nLen += strlen(pTable->pBatchCol->pName) + 2 * strlen(pEnd) + 15;
+// <hash expr><part><space>AND<space>
+      if(pHash != NULL)
+         nLen += strlen(pHash) + 15;
 
 // Make space for suffix.
       if(g_pSQLWhereSuffix != NULL)
@@ -1654,8 +7723,12 @@ char *FormatSQL(PJSONTABLE pTable, unsigned long lLimit)
       }
 
    if(bOrderBy && pTable->pBatchCol != NULL)
-// <space>ORDER<space>BY<space>`<column name>`
-      nLen += 12 + strlen(pTable->pBatchCol->pJSONName);
+      {
+// <space>ORDER<space>BY<space>`<column name>`,<space>...
+      nLen += 10;
+      for(i = 0; i < pTable->nKeyCols; i++)
+         nLen += strlen(pTable->pKeyCols[i]->pName) + 4;
+      }
 
 // Add space for a limit clause.
    if(lLimit > 0)
@@ -1667,34 +7740,94 @@ char *FormatSQL(PJSONTABLE pTable, unsigned long lLimit)
       if((pTable->pSQL = realloc(pTable->pSQL, nLen + 1)) == NULL)
          {
          fprintf(stderr, "Memory allocation error.\n");
+         if(pTable->pParent != NULL)
+            pthread_mutex_unlock(&pTable->mtxRange);
          return NULL;
          }
       pTable->nSQLBufLen = nLen + 1;
       }
 
 // Now, do the formatting, char by char.
+   *pTable->pSQL = '\0';
    for(pTmp1 = pTable->pSQLFormat, pTmp2 = pTable->pSQL; *pTmp1 != '\0'; pTmp1++)
       {
       if(pTmp1[0] == '%' && (pTmp1[1] == 'w' || pTmp1[1] == 'W'))
          {
-// If this is the first batch, do this.
-         if(pTable->pBatchCol == NULL
-           || (pTable->pBatchCol != NULL && pTable->pBatchCol->pPrevValue == NULL))
+// If this is the first batch of a table, do this.
+         if(pPrev == NULL && pEnd == NULL && pHash == NULL)
             {
             if(pTmp1[1] == 'W')
                strcat(pTable->pSQL, " WHERE ");
             }
-// Do this for any following rounds.
-         else if(pTable->pBatchCol != NULL)
+// Do this for any following rounds or for a key range.
+         else
             {
-            strcat(pTable->pSQL, " WHERE `");
-            strcat(pTable->pSQL, pTable->pBatchCol->pJSONName);
-            strcat(pTable->pSQL, "` > ");
-            if(JSONCOL_FLAG_CHECK(pTable->pBatchCol, QUOTED) || !JSONCOL_FLAG_CHECK(pTable->pBatchCol, NUMERIC))
-               strcat(pTable->pSQL, "'");
-            strcat(pTable->pSQL, pTable->pBatchCol->pPrevValue);
-            if(JSONCOL_FLAG_CHECK(pTable->pBatchCol, QUOTED) || !JSONCOL_FLAG_CHECK(pTable->pBatchCol, NUMERIC))
-               strcat(pTable->pSQL, "'");
+            strcat(pTable->pSQL, " WHERE ");
+            if(pPrev != NULL)
+               {
+               if(pTable->nKeyCols > 1)
+                  strcat(pTable->pSQL, "(");
+               for(i = 0; i < pTable->nKeyCols; i++)
+                  {
+                  strcat(pTable->pSQL, i == 0 ? "`" : ", `");
+                  strcat(pTable->pSQL, pTable->pKeyCols[i]->pName);
+                  strcat(pTable->pSQL, "`");
+                  }
+               strcat(pTable->pSQL, pTable->nKeyCols > 1 ? ") > (" : " > ");
+               for(i = 0; i < pTable->nKeyCols; i++)
+                  {
+                  pCol = pTable->pKeyCols[i];
+                  if(i > 0)
+                     strcat(pTable->pSQL, ", ");
+                  if(ppParams != NULL)
+                     {
+                     strcat(pTable->pSQL, "?");
+                     ppParams[0] = pPrev;
+                     }
+                  else if(JSONCOL_FLAG_CHECK(pCol, QUOTED)
+                    || !JSONCOL_FLAG_CHECK(pCol, NUMERIC))
+                     {
+                     strcat(pTable->pSQL, "'");
+                     pTmp2 = &pTable->pSQL[strlen(pTable->pSQL)];
+                     mysql_real_escape_string(pMySQL, pTmp2, pCol->pPrevValue,
+                       strlen(pCol->pPrevValue));
+                     strcat(pTable->pSQL, "'");
+                     }
+                  else
+                     strcat(pTable->pSQL, pCol->pPrevValue);
+                  }
+               if(pTable->nKeyCols > 1)
+                  strcat(pTable->pSQL, ")");
+               if(pEnd != NULL)
+                  strcat(pTable->pSQL, " AND ");
+               }
+            if(pEnd != NULL)
+               {
+               strcat(pTable->pSQL, "`");
+               strcat(pTable->pSQL, pTable->pBatchCol->pName);
+               if(ppParams != NULL)
+                  {
+                  strcat(pTable->pSQL, "` <= ?");
+                  ppParams[1] = pEnd;
+                  }
+               else
+                  {
+                  strcat(pTable->pSQL, bQuote ? "` <= '" : "` <= ");
+                  pTmp2 = &pTable->pSQL[strlen(pTable->pSQL)];
+                  if(bQuote)
+                     mysql_real_escape_string(pMySQL, pTmp2, pEnd, strlen(pEnd));
+                  else
+                     strcpy(pTmp2, pEnd);
+                  strcat(pTable->pSQL, bQuote ? "'" : "");
+                  }
+               }
+            if(pHash != NULL)
+               {
+               if(pPrev != NULL || pEnd != NULL)
+                  strcat(pTable->pSQL, " AND ");
+               sprintf(&pTable->pSQL[strlen(pTable->pSQL)], "%s%u", pHash,
+                 pTable->nPart - 1);
+               }
             if(pTmp1[1] == 'W')
                strcat(pTable->pSQL, " AND ");
             }
@@ -1710,10 +7843,10 @@ char *FormatSQL(PJSONTABLE pTable, unsigned long lLimit)
          }
       else if(pTmp1[0] == '%' && (pTmp1[1] == 'o' || pTmp1[1] == 'O'))
          {
-         if(pTable->pBatchCol != NULL)
+         for(i = 0; i < pTable->nKeyCols; i++)
             {
-            strcat(pTable->pSQL, pTmp1[1] == 'O' ? " ORDER BY `" : ", `");
-            strcat(pTable->pSQL, pTable->pBatchCol->pJSONName);
+            strcat(pTable->pSQL, i == 0 && pTmp1[1] == 'O' ? " ORDER BY `" : ", `");
+            strcat(pTable->pSQL, pTable->pKeyCols[i]->pName);
             strcat(pTable->pSQL, "`");
             }
 
@@ -1727,8 +7860,12 @@ char *FormatSQL(PJSONTABLE pTable, unsigned long lLimit)
          }
       }
 
-   if(lLimit > 0)
+   if(lLimit > 0 && ppParams != NULL)
+      strcat(pTable->pSQL, " LIMIT ?");
+   else if(lLimit > 0)
       sprintf(&pTable->pSQL[strlen(pTable->pSQL)], " LIMIT %ld", lLimit);
+   if(pTable->pParent != NULL)
+      pthread_mutex_unlock(&pTable->mtxRange);
 
    return pTable->pSQL;
    } // End of FormatSQL()
@@ -1760,7 +7897,12 @@ PJSONCOL FindColByName(PJSONCOL pCols, unsigned int nCols, char *pName)
 
 /*
  * Function: SetBatchingColumn()
- * Set up the batching column in the specified table.
+ * Set up the batching columns in the specified table. This is the batch
+ * column, if one is given, followed by the primary key columns in key order,
+ * or the columns of the unique index from SetUniqueKey() if there is no
+ * primary key. A batch column that isn't the whole key may not be unique, so
+ * the rest of the key is needed to not skip rows with the same value at the
+ * end of a batch.
  * Arguments:
  * PJSONTABLE pTable - The table to set batching options for.
  * Returns:
@@ -1768,16 +7910,21 @@ PJSONCOL FindColByName(PJSONCOL pCols, unsigned int nCols, char *pName)
  */
 BOOL SetBatchingColumn(PJSONTABLE pTable)
    {
-   unsigned int nPk = 0;
+   PJSONCOL pCol;
+   unsigned int nSeq;
+   unsigned int j;
    int i;
 
+// The batching columns are only set up once.
+   if(pTable->nKeyCols > 0)
+      return FALSE;
+
    for(i = 0; i < pTable->nCols; i++) 
       {
       if(JSONCOL_FLAG_CHECK(&pTable->pCols[i], MYSQL)
         && JSONCOL_FLAG_CHECK(&pTable->pCols[i], BATCH))
          {
-         pTable->pBatchCol = &pTable->pCols[i];
-         pTable->lBatchSize = g_lBatchSize;
+         pTable->pKeyCols[pTable->nKeyCols++] = &pTable->pCols[i];
          break;
          }
       }
@@ -1790,47 +7937,274 @@ BOOL SetBatchingColumn(PJSONTABLE pTable)
         pTable->pName);
       return TRUE;
       }
-// Check if we didn't find the batching column, then look for a primary key.
-   else if(i >= pTable->nCols)
+
+// Add the primary or unique key columns, in key order first and then any
+// with an unknown position in the key.
+   for(nSeq = 1; nSeq <= KEY_COLS_MAX + 1; nSeq++)
       {
       for(i = 0; i < pTable->nCols; i++)
          {
-         if(JSONCOL_FLAG_CHECK(&pTable->pCols[i], PK))
+         pCol = &pTable->pCols[i];
+         if((!JSONCOL_FLAG_CHECK(pCol, PK) && !JSONCOL_FLAG_CHECK(pCol, UKEY))
+           || pCol->nKeySeq != (nSeq > KEY_COLS_MAX ? 0 : nSeq))
+            continue;
+         for(j = 0; j < pTable->nKeyCols && pTable->pKeyCols[j] != pCol; j++)
+            ;
+         if(j < pTable->nKeyCols)
+            continue;
+         if(pTable->nKeyCols >= KEY_COLS_MAX)
             {
-            nPk++;
-            pTable->pBatchCol = &pTable->pCols[i];
-            pTable->pCols[i].nFlags |= JSONCOL_FLAG_BATCH;
+            fprintf(stderr, "Too many key columns in table %s\n", pTable->pName);
+            return TRUE;
             }
+         pTable->pKeyCols[pTable->nKeyCols++] = pCol;
          }
-      if(nPk == 0)
+      }
+
+// All the key columns have to be selected.
+   for(j = 0; j < pTable->nKeyCols; j++)
+      pTable->pKeyCols[j]->nFlags |= JSONCOL_FLAG_BATCH;
+
+// The unique index is only forced when the batches are in its order, not
+// when it is the tiebreaker of a batch column outside of it.
+   if(pTable->pKeyIndex != NULL
+     && !JSONCOL_FLAG_CHECK(pTable->pKeyCols[0], UKEY))
+      {
+      free(pTable->pKeyIndex);
+      pTable->pKeyIndex = NULL;
+      }
+
+// If there is no primary key and no batch column, batching is off.
+   if(pTable->nKeyCols == 0)
+      {
+      pTable->pBatchCol = NULL;
+      pTable->lBatchSize = 0;
+      }
+   else
+      {
+      pTable->pBatchCol = pTable->pKeyCols[0];
+      pTable->lBatchSize = g_lBatchSize;
+      if(pTable->nKeyCols > 1)
+         PrintMsg(LOG_VERBOSE, "Batching %s on %u key columns.\n",
+           pTable->pName == NULL ? "SQL" : pTable->pName, pTable->nKeyCols);
+      }
+
+   return FALSE;
+   } // End of SetBatchingColumn()
+
+
+/*
+ * Function: SetKeyOrder()
+ * Get the position of each primary key column in the key, so that batches
+ * are ordered as the key is. This is only needed for a key of more than one
+ * column.
+ * Arguments:
+ * MYSQL *pMySQL - MySQL connection handle.
+ * PJSONTABLE pTable - The table to get the key order of.
+ * Returns:
+ * BOOL - TRUE if there is an error, else FALSE.
+ */
+BOOL SetKeyOrder(MYSQL *pMySQL, PJSONTABLE pTable)
+   {
+   MYSQL_RES *pRes;
+   MYSQL_ROW pRow;
+   PJSONCOL pCol;
+   char *pSQL;
+   unsigned int nPk = 0;
+   int i;
+
+   for(i = 0; i < pTable->nCols; i++)
+      {
+      if(JSONCOL_FLAG_CHECK(&pTable->pCols[i], PK))
+         nPk++;
+      }
+   if(nPk < 2)
+      return FALSE;
+
+   if((pSQL = malloc(strlen(pTable->pName) + 50)) == NULL)
+      {
+      fprintf(stderr, "Memory allocation error.\n");
+      return TRUE;
+      }
+   sprintf(pSQL, "SHOW INDEX FROM `%s` WHERE Key_name = 'PRIMARY'",
+     pTable->pName);
+   if(mysql_query(pMySQL, pSQL) != 0
+     || (pRes = mysql_store_result(pMySQL)) == NULL)
+      {
+      fprintf(stderr, "MySQL %s failed:\n%s\n", pSQL, mysql_error(pMySQL));
+      free(pSQL);
+      return TRUE;
+      }
+   free(pSQL);
+
+// Columns are 3 = Seq_in_index and 4 = Column_name.
+   while((pRow = mysql_fetch_row(pRes)) != NULL)
+      {
+      if(pRow[3] != NULL && pRow[4] != NULL
+        && (pCol = FindColByName(pTable->pCols, pTable->nCols, pRow[4])) != NULL
+        && pCol->pName != NULL)
+         pCol->nKeySeq = (unsigned int) atoi(pRow[3]);
+      }
+   mysql_free_result(pRes);
+
+   return FALSE;
+   } // End of SetKeyOrder()
+
+
+/*
+ * Function: SetUniqueKey()
+ * Find a unique index to batch a table without a primary key on. The index
+ * has to be on whole NOT NULL columns that are all in the table. Integer
+ * keys are preferred, then the narrowest key and then the one with the
+ * fewest columns. Invisible indexes are skipped. The columns of the index
+ * are flagged as UKEY in key order and the index name is kept to force it
+ * in the SQL.
+ * Arguments:
+ * MYSQL *pMySQL - MySQL connection handle.
+ * PJSONTABLE pTable - The table to find a unique index for.
+ * Returns:
+ * BOOL - TRUE if there is an error, else FALSE.
+ */
+BOOL SetUniqueKey(MYSQL *pMySQL, PJSONTABLE pTable)
+   {
+   static char *pIntTypes[] = { "tinyint", "smallint", "mediumint", "int",
+     "bigint", NULL };
+   static unsigned int nIntWidths[] = { 1, 2, 3, 4, 8 };
+   MYSQL_RES *pRes;
+   MYSQL_ROW pRow;
+   PJSONCOL pCols[KEY_COLS_MAX];
+   PJSONCOL pBestCols[KEY_COLS_MAX];
+   char *pSQL;
+   char *pIndex = NULL;
+   char *pBest = NULL;
+   unsigned int nCols = 0;
+   unsigned int nBestCols = 0;
+   unsigned long lWidth = 0;
+   unsigned long lBestWidth = 0;
+   BOOL bInt = TRUE;
+   BOOL bBestInt = FALSE;
+   BOOL bUsable = TRUE;
+   unsigned int j;
+   int i;
+
+// A table with a primary key is batched on that.
+   for(i = 0; i < pTable->nCols; i++)
+      {
+      if(JSONCOL_FLAG_CHECK(&pTable->pCols[i], PK))
+         return FALSE;
+      }
+
+   if((pSQL = malloc((strlen(g_pDatabase) + strlen(pTable->pName)) * 2
+     + 512)) == NULL)
+      {
+      fprintf(stderr, "Memory allocation error.\n");
+      return TRUE;
+      }
+   strcpy(pSQL, "SELECT s.INDEX_NAME, s.COLUMN_NAME, s.SUB_PART,"
+     " c.IS_NULLABLE, c.DATA_TYPE, c.CHARACTER_OCTET_LENGTH"
+     " FROM information_schema.STATISTICS s"
+     " LEFT JOIN information_schema.COLUMNS c"
+     " ON c.TABLE_SCHEMA = s.TABLE_SCHEMA AND c.TABLE_NAME = s.TABLE_NAME"
+     " AND c.COLUMN_NAME = s.COLUMN_NAME"
+     " WHERE s.NON_UNIQUE = 0 AND s.TABLE_SCHEMA = '");
+   mysql_real_escape_string(pMySQL, &pSQL[strlen(pSQL)], g_pDatabase,
+     strlen(g_pDatabase));
+   strcat(pSQL, "' AND s.TABLE_NAME = '");
+   mysql_real_escape_string(pMySQL, &pSQL[strlen(pSQL)], pTable->pName,
+     strlen(pTable->pName));
+// Invisible indexes, from MySQL 8.0, can't be forced.
+   strcat(pSQL, "' /*!80000 AND s.IS_VISIBLE = 'YES' */"
+     " ORDER BY s.INDEX_NAME, s.SEQ_IN_INDEX");
+
+   PrintMsg(LOG_DEBUG, "Unique index SQL: %s\n", pSQL);
+   if(mysql_query(pMySQL, pSQL) != 0)
+      {
+      fprintf(stderr, "MySQL Error:%s\nin:%s\n", mysql_error(pMySQL), pSQL);
+      free(pSQL);
+      return TRUE;
+      }
+   free(pSQL);
+   if((pRes = mysql_store_result(pMySQL)) == NULL)
+      {
+      fprintf(stderr, "MySQL store results failed:\n%s\n", mysql_error(pMySQL));
+      return TRUE;
+      }
+
+// The rows of an index are in key order, and a row for another index, or no
+// row, ends the index.
+   do
+      {
+      pRow = mysql_fetch_row(pRes);
+      if(pIndex != NULL && (pRow == NULL || strcmp(pRow[0], pIndex) != 0))
          {
-         if(g_bAutoBatch)
-            pTable->lBatchSize = 0;
-         else
+         if(bUsable && (pBest == NULL || (bInt && !bBestInt)
+           || (bInt == bBestInt && (lWidth < lBestWidth
+           || (lWidth == lBestWidth && nCols < nBestCols)))))
             {
-            fprintf(stderr, "No batching column found in table %s\n",  pTable->pName);
-            return TRUE;
+            pBest = pIndex;
+            memcpy(pBestCols, pCols, nCols * sizeof(PJSONCOL));
+            nBestCols = nCols;
+            lBestWidth = lWidth;
+            bBestInt = bInt;
             }
+         pIndex = NULL;
          }
-      else if(nPk > 1)
+      if(pRow == NULL || pRow[0] == NULL)
+         continue;
+
+// Start a new index.
+      if(pIndex == NULL)
          {
-         if(g_bAutoBatch)
-            {
-            pTable->pBatchCol = NULL;
-            pTable->lBatchSize = 0;
-            }
-         else
-            {
-            fprintf(stderr, "More than 1 primary key in table %s. You must specify a batching column.\n",  pTable->pName);
-            return TRUE;
-            }
+         pIndex = pRow[0];
+         nCols = 0;
+         lWidth = 0;
+         bInt = bUsable = TRUE;
+         }
+
+// Functional and prefix key parts, NULL columns and columns not selected
+// can't be batched on.
+      if(!bUsable || pRow[1] == NULL || pRow[2] != NULL || pRow[3] == NULL
+        || strcmp(pRow[3], "NO") != 0 || nCols >= KEY_COLS_MAX
+        || (pCols[nCols] = FindColByName(pTable->pCols, pTable->nCols,
+        pRow[1])) == NULL || !JSONCOL_FLAG_CHECK(pCols[nCols], MYSQL))
+         {
+         bUsable = FALSE;
+         continue;
          }
+      for(j = 0; pIntTypes[j] != NULL && (pRow[4] == NULL
+        || strcasecmp(pRow[4], pIntTypes[j]) != 0); j++)
+         ;
+      if(pIntTypes[j] != NULL)
+         lWidth += nIntWidths[j];
       else
-         pTable->lBatchSize = g_lBatchSize;
+         {
+         bInt = FALSE;
+         lWidth += pRow[5] == NULL ? 8 : strtoul(pRow[5], NULL, 10);
+         }
+      nCols++;
+      }
+   while(pRow != NULL);
+
+   if(pBest != NULL)
+      {
+      if((pTable->pKeyIndex = strdup(pBest)) == NULL)
+         {
+         fprintf(stderr, "Memory allocation error.\n");
+         mysql_free_result(pRes);
+         return TRUE;
+         }
+      for(j = 0; j < nBestCols; j++)
+         {
+         pBestCols[j]->nFlags |= JSONCOL_FLAG_UKEY;
+         pBestCols[j]->nKeySeq = j + 1;
+         }
+      PrintMsg(LOG_VERBOSE, "Batching %s on unique index %s.\n",
+        pTable->pName, pTable->pKeyIndex);
       }
+   mysql_free_result(pRes);
 
    return FALSE;
-   } // End of SetBatchingColumn()
+   } // End of SetUniqueKey()
 
 
 /*
@@ -1877,11 +8251,15 @@ PJSONCOL SetColsFromResult(PJSONCOL pCols, unsigned int *pnCols, MYSQL_RES *pRes
          {
          pRet[i].pName = NULL;
          pRet[i].pJSONName = NULL;
+         pRet[i].pJSONKey = NULL;
+         pRet[i].nJSONKeyLen = 0;
          pRet[i].pValue = NULL;
          pRet[i].pPrevValue = NULL;
+         pRet[i].nPrevValueSize = 0;
          pRet[i].lValue = 0;
          pRet[i].lIncr = 0;
          pRet[i].nFlags = JSONCOL_FLAG_NONE;
+         pRet[i].nKeySeq = 0;
          pRet[i].nMySQLCol = -1;
          }
 
@@ -1918,6 +8296,23 @@ PJSONCOL SetColsFromResult(PJSONCOL pCols, unsigned int *pnCols, MYSQL_RES *pRes
         || pFields[i].type == MYSQL_TYPE_FLOAT || pFields[i].type == MYSQL_TYPE_DOUBLE)
          pCol->nFlags |= JSONCOL_FLAG_NUMERIC;
 
+// Numeric and temporal values never have anything to escape.
+      if(pFields[i].type == MYSQL_TYPE_TINY || pFields[i].type == MYSQL_TYPE_SHORT
+        || pFields[i].type == MYSQL_TYPE_LONG || pFields[i].type == MYSQL_TYPE_INT24
+        || pFields[i].type == MYSQL_TYPE_LONGLONG || pFields[i].type == MYSQL_TYPE_DECIMAL
+        || pFields[i].type == MYSQL_TYPE_NEWDECIMAL || pFields[i].type == MYSQL_TYPE_FLOAT
+        || pFields[i].type == MYSQL_TYPE_DOUBLE || pFields[i].type == MYSQL_TYPE_DATE
+        || pFields[i].type == MYSQL_TYPE_NEWDATE || pFields[i].type == MYSQL_TYPE_DATETIME
+        || pFields[i].type == MYSQL_TYPE_TIMESTAMP || pFields[i].type == MYSQL_TYPE_TIME
+        || pFields[i].type == MYSQL_TYPE_YEAR)
+         pCol->nFlags |= JSONCOL_FLAG_NOESCAPE;
+
+// JSON documents are already valid JSON, and are embedded as they are.
+#ifdef HAVE_MYSQL_TYPE_JSON
+      if(pFields[i].type == MYSQL_TYPE_JSON)
+         pCol->nFlags |= JSONCOL_FLAG_JSON;
+#endif
+
 // Check if this is a primary key column.
       if((pFields[i].flags & PRI_KEY_FLAG) == PRI_KEY_FLAG)
          pCol->nFlags |= JSONCOL_FLAG_PK;
@@ -1947,6 +8342,8 @@ void PrintTableCols(FILE *fd, PJSONTABLE pTable)
    fprintf(fd, "Batch size: %ld\n", pTable->lBatchSize);
    if(pTable->pBatchCol != NULL)
       fprintf(fd, "Batch col: %s\n", pTable->pBatchCol->pName);
+   for(i = 1; i < pTable->nKeyCols; i++)
+      fprintf(fd, "Key col: %s\n", pTable->pKeyCols[i]->pName);
    fprintf(fd, "Columns:\n");
 
 // Print columns.